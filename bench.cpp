@@ -0,0 +1,558 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <random>
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <iomanip>
+#include <limits>
+#include <numeric>
+#include <algorithm>
+#include "simd.h"
+#include "aligned_allocator.h"
+#include "threadpool.h"
+#include "model.h"
+#include "calibration.h"
+#include "tensor/layout.h"
+
+struct bench_options {
+    std::vector<std::size_t> threads_nums, batch_sizes;
+    std::size_t repeats;
+    // Only layers named here are run, all of them if empty.
+    std::vector<std::string> layers;
+    const char *json;
+    // The SIMD path is the best one the CPU has, or this one if it is lower.
+    tnn::simd::isa isa;
+    tnn::memory::huge_pages huge_pages;
+};
+
+// A layer of load_alexnet(), created through the model factory, with the input it sees for one 224x224 image, or a
+// convolution added to run every fixed shape kernel both with and without padding.
+struct layer_shape {
+    const char *name, *type;
+    std::vector<std::size_t> input;
+    std::vector<std::int64_t> params;
+};
+
+// Throughput of the machine with every thread of a pool busy, which results are compared with.
+// Bandwidth is measured streaming from DRAM and from buffers that stay in L2.
+struct machine_peak {
+    double gflops, gbps, l2_gbps;
+};
+
+struct bench_result {
+    std::string layer, type, mode;
+    std::size_t threads_num, batch_size;
+    double median, p95, flops, bytes;
+    // NaN for layers without a reference to check against.
+    float error;
+};
+
+const layer_shape alexnet_layers[] = {
+        {"conv1", "conv2d", {3, 224, 224}, {3, 64, 11, 4, 2, 1}},
+        {"relu1", "relu", {64, 55, 55}, {}},
+        {"pool1", "maxpool2d", {64, 55, 55}, {3, 2, 0}},
+        {"conv2", "conv2d", {64, 27, 27}, {64, 192, 5, 1, 2, 1}},
+        {"relu2", "relu", {192, 27, 27}, {}},
+        {"pool2", "maxpool2d", {192, 27, 27}, {3, 2, 0}},
+        {"conv3", "conv2d", {192, 13, 13}, {192, 384, 3, 1, 1, 1}},
+        {"relu3", "relu", {384, 13, 13}, {}},
+        {"conv4", "conv2d", {384, 13, 13}, {384, 256, 3, 1, 1, 1}},
+        {"relu4", "relu", {256, 13, 13}, {}},
+        {"conv5", "conv2d", {256, 13, 13}, {256, 256, 3, 1, 1, 1}},
+        {"relu5", "relu", {256, 13, 13}, {}},
+        {"pool5", "maxpool2d", {256, 13, 13}, {3, 2, 0}},
+        {"flatten", "reshape", {256, 6, 6}, {256 * 6 * 6}},
+        {"fc6", "linear", {256 * 6 * 6}, {256 * 6 * 6, 4096, 1}},
+        {"relu6", "relu", {4096}, {}},
+        {"fc7", "linear", {4096}, {4096, 4096, 1}},
+        {"relu7", "relu", {4096}, {}},
+        {"pca", "bias", {4096}, {4096}},
+        // Not in Alexnet: the fixed shapes above without padding, and 1x1 with and without.
+        {"conv1-p0", "conv2d", {3, 224, 224}, {3, 64, 11, 4, 0, 1}},
+        {"conv2-p0", "conv2d", {64, 27, 27}, {64, 192, 5, 1, 0, 1}},
+        {"conv3-p0", "conv2d", {192, 13, 13}, {192, 384, 3, 1, 0, 1}},
+        {"conv1x1", "conv2d", {256, 13, 13}, {256, 256, 1, 1, 0, 1}},
+        {"conv1x1-p1", "conv2d", {256, 13, 13}, {256, 256, 1, 1, 1, 1}}
+};
+
+bench_options parse_args(int argc, const char *argv[]);
+machine_peak measure_peak(tnn::thread_pool &threads);
+tnn::tensor<> random_tensor(const std::vector<std::size_t> &shape, std::mt19937 &engine);
+std::vector<float> random_load(tnn::layer<> &layer, std::mt19937 &engine);
+std::vector<double> time_forward(const tnn::layer<> &layer, const tnn::tensor<> &x, tnn::tensor<> &y, std::size_t repeats, tnn::thread_pool &threads);
+std::size_t parameter_bytes(tnn::layer<> &layer);
+float max_relative_error(const tnn::tensor<> &expected, const tnn::tensor<> &actual);
+float linear_error(const std::vector<float> &weight, const tnn::tensor<> &x, const tnn::tensor<> &y, std::mt19937 &engine);
+void print_result(const bench_result &result, const machine_peak &peak);
+void save_json(const char *filename, const std::vector<std::size_t> &threads_nums, const std::vector<machine_peak> &peaks,
+               const std::vector<bench_result> &results);
+
+
+int main(int argc, const char *argv[])
+{
+    bench_options options = parse_args(argc, argv);
+    std::mt19937 engine(0);
+
+    tnn::memory::set_huge_pages(options.huge_pages);
+    std::cout << "Repeats: " << options.repeats << ", SIMD path: " << tnn::simd::name(tnn::simd::select(options.isa))
+              << ", huge pages: " << tnn::memory::name(options.huge_pages) << "\n";
+    // Pools for all thread counts are created up front, so that every layer is loaded and quantized once.
+    std::vector<std::unique_ptr<tnn::thread_pool> > pools;
+    std::vector<machine_peak> peaks;
+    for (std::size_t threads_num: options.threads_nums) {
+        pools.emplace_back(new tnn::thread_pool(threads_num));
+        peaks.push_back(measure_peak(*pools.back()));
+        std::cout << "Threads num: " << threads_num << ", peak: " << std::fixed << std::setprecision(2)
+                  << peaks.back().gflops << " GFLOPS, " << peaks.back().gbps << " GB/s from DRAM, "
+                  << peaks.back().l2_gbps << " GB/s from L2\n";
+    }
+    std::cout << "\n" << std::left << std::setw(12) << "layer" << std::setw(10) << "mode" << std::right
+              << std::setw(8) << "threads" << std::setw(7) << "batch" << std::setw(12) << "median" << std::setw(12) << "p95"
+              << std::setw(10) << "GFLOPS" << std::setw(9) << "%peak" << std::setw(9) << "GB/s" << std::setw(9) << "%DRAM"
+              << std::setw(9) << "%L2"
+              << std::setw(12) << "max error" << "\n";
+
+    std::vector<bench_result> results;
+    for (const layer_shape &shape: alexnet_layers) {
+        if (!options.layers.empty() && std::find(options.layers.begin(), options.layers.end(), shape.name) == options.layers.end())
+            continue;
+        std::shared_ptr<tnn::layer<> > layer = tnn::model<>::factory()[shape.type](shape.params);
+        std::vector<float> weight = random_load(*layer, engine);
+        std::vector<tnn::tensor<> > inputs, references(options.batch_sizes.size());
+        for (std::size_t batch_size: options.batch_sizes) {
+            std::vector<std::size_t> input_shape(1, batch_size);
+            input_shape.insert(input_shape.end(), shape.input.begin(), shape.input.end());
+            inputs.push_back(random_tensor(input_shape, engine));
+        }
+
+        // Convolutions are checked against the direct mode and pooling against the plain layout, which run
+        // first, and linear layers on a sample of outputs against a plain dot product. The generic mode is the
+        // direct one with the fixed shape kernels disabled. INT8 runs last, since quantizing a layer cannot be
+        // undone.
+        std::vector<std::string> modes(1, "float");
+        tnn::conv2d<> *conv = dynamic_cast<tnn::conv2d<> *>(layer.get());
+        tnn::linear<> *fc = dynamic_cast<tnn::linear<> *>(layer.get());
+        bool pool = shape.type == std::string("maxpool2d");
+        if (conv) {
+            modes = {"direct"};
+            if (conv->fixed_kernels())
+                modes.push_back("generic");
+            modes.push_back("gemm");
+            if (shape.params[2] == 3 && shape.params[3] == 1)
+                modes.push_back("winograd");
+            if (shape.params[3] > 1)
+                modes.push_back("s2d");
+            else
+                modes.push_back("fft");
+        }
+        if (conv || pool)
+            modes.push_back("blocked");
+        if (conv || fc)
+            modes.push_back("int8");
+        // The blocked layout runs on blocked inputs, as behind another blocked layer, but conv1 and conv1-p0 read the image.
+        std::vector<tnn::tensor<> > blocked_inputs;
+        for (std::size_t b = 0; b < inputs.size() && (conv || pool); ++b)
+            blocked_inputs.push_back(shape.input[0] != 3 ? tnn::layout::to_blocked(inputs[b], tnn::layout::preferred_block())
+                                                         : inputs[b].clone());
+        for (const std::string &mode: modes) {
+            if (mode == "direct")
+                conv->set_mode(tnn::conv2d_mode::direct);
+            else if (mode == "generic")
+                conv->set_fixed_kernels(false);
+            else if (mode == "gemm") {
+                conv->set_fixed_kernels(true);
+                conv->set_mode(tnn::conv2d_mode::gemm);
+            }
+            else if (mode == "winograd")
+                conv->set_mode(tnn::conv2d_mode::winograd);
+            else if (mode == "fft")
+                conv->set_mode(tnn::conv2d_mode::fft);
+            else if (mode == "s2d")
+                conv->set_mode(tnn::conv2d_mode::space_to_depth);
+            else if (mode == "blocked" && conv)
+                conv->set_mode(tnn::conv2d_mode::blocked);
+            else if (mode == "int8" && conv)
+                conv->quantize(tnn::qgemm::range::from_bounds(-1, 1));
+            else if (mode == "int8")
+                fc->quantize(tnn::qgemm::range::from_bounds(-1, 1));
+            std::size_t parameters = parameter_bytes(*layer);
+            for (std::size_t t = 0; t < pools.size(); ++t)
+                for (std::size_t b = 0; b < options.batch_sizes.size(); ++b) {
+                    tnn::tensor<> y;
+                    const tnn::tensor<> &x = mode == "blocked" ? blocked_inputs[b] : inputs[b];
+                    std::vector<double> times = time_forward(*layer, x, y, options.repeats, *pools[t]);
+                    float error = std::numeric_limits<float>::quiet_NaN();
+                    if ((conv && mode == "direct") || (pool && mode == "float")) {
+                        error = 0;
+                        if (t == 0)
+                            references[b] = y.clone();
+                    } else if ((conv || pool) && y.layout() != tnn::tensor_layout::nchw)
+                        error = max_relative_error(references[b], tnn::layout::to_plain(y, references[b].shape(1)));
+                    else if (conv || pool)
+                        error = max_relative_error(references[b], y);
+                    else if (fc)
+                        error = linear_error(weight, inputs[b], y, engine);
+                    // Layers working in place, relu and bias, read and write their input.
+                    double bytes = sizeof(float) * (x.size() + y.size()) + parameters;
+                    if (shape.type == std::string("reshape"))
+                        bytes = 0;
+                    bench_result result {
+                            shape.name, shape.type, mode, options.threads_nums[t], options.batch_sizes[b],
+                            times[(times.size() - 1) / 2], times[(times.size() * 95 + 99) / 100 - 1],
+                            layer->flops(x.shape(), y.shape()), bytes, error
+                    };
+                    print_result(result, peaks[t]);
+                    results.push_back(result);
+                }
+        }
+    }
+    if (options.json)
+        save_json(options.json, options.threads_nums, peaks, results);
+    return 0;
+}
+
+const char *help_str = ""
+        "Usage: bench [OPTION]...\n"
+        "Options:\n"
+        "  -t, --threads=LIST        run with every comma separated number of worker\n"
+        "                            threads (default all cores)\n"
+        "  -s, --batch=LIST          run with every comma separated batch size\n"
+        "                            (default 1,8)\n"
+        "  -r, --repeats=NUM         run every layer NUM times for the median and 95th\n"
+        "                            percentile (default 10)\n"
+        "  -l, --layers=LIST         run only the comma separated layers, e.g. conv1,fc6\n"
+        "  -j, --json=FILE           save the results as JSON\n"
+        "  -i, --isa=NAME            use at most this SIMD path: scalar, sse4.1, avx2\n"
+        "                            or avx512 (default the best the CPU has)\n"
+        "  -g, --huge-pages=MODE     back large buffers with huge pages: none\n"
+        "                            (default), transparent or hugetlb\n"
+        "  -h, --help                print this help message\n"
+;
+
+std::size_t parse_number(const char *str, const char *what) {
+    const char *char_p;
+    int temp_int;
+    for (char_p = str; *char_p && *char_p >= '0' && *char_p <= '9'; ++char_p);
+    if (!*str || *char_p || (temp_int = std::atoi(str)) < 1) {
+        std::cerr << "bench: invalid number of " << what << std::endl;
+        std::exit(1);
+    }
+    return temp_int;
+}
+
+std::vector<std::string> parse_list(const char *str) {
+    std::vector<std::string> items;
+    std::istringstream in(str);
+    std::string item;
+    while (std::getline(in, item, ','))
+        items.push_back(item);
+    return items;
+}
+
+std::vector<std::size_t> parse_numbers(const char *str, const char *what) {
+    std::vector<std::string> items = parse_list(str);
+    std::vector<std::size_t> numbers;
+    for (const std::string &item: items)
+        numbers.push_back(parse_number(item.c_str(), what));
+    if (numbers.empty())
+        parse_number("", what);
+    return numbers;
+}
+
+bench_options parse_args(int argc, const char *argv[]) {
+    bench_options options {{std::thread::hardware_concurrency()}, {1, 8}, 10, {}, nullptr, tnn::simd::avx512,
+                           tnn::memory::none};
+    const char *short_options = "tsrljig", *long_options[] = {"--threads=", "--batch=", "--repeats=", "--layers=", "--json=",
+                                                             "--isa=", "--huge-pages="};
+    for (int i = 1; i < argc; ++i) {
+        char option = 0;
+        const char *value = nullptr;
+        if (argv[i][0] == '-' && argv[i][1] && std::strchr(short_options, argv[i][1]) && !argv[i][2]) {
+            if (i + 1 == argc) {
+                std::cerr << "bench: requires a value after \"" << argv[i] << "\"" << std::endl;
+                std::exit(1);
+            }
+            option = argv[i][1];
+            value = argv[++i];
+        } else if (!std::strcmp(argv[i], "-h") || !std::strcmp(argv[i], "--help")) {
+            std::cout << help_str << std::endl;
+            std::exit(0);
+        } else {
+            for (std::size_t j = 0; j < std::strlen(short_options); ++j)
+                if (!std::strncmp(argv[i], long_options[j], std::strlen(long_options[j]))) {
+                    option = short_options[j];
+                    value = argv[i] + std::strlen(long_options[j]);
+                }
+            if (!option) {
+                std::cerr << "bench: unrecognized option \"" << argv[i] << "\"" << std::endl;
+                std::exit(1);
+            }
+        }
+        if (option == 't')
+            options.threads_nums = parse_numbers(value, "threads");
+        else if (option == 's')
+            options.batch_sizes = parse_numbers(value, "batch size");
+        else if (option == 'r')
+            options.repeats = parse_number(value, "repeats");
+        else if (option == 'l')
+            options.layers = parse_list(value);
+        else if (option == 'j')
+            options.json = value;
+        else if (option == 'g') {
+            if (!tnn::memory::parse(value, options.huge_pages)) {
+                std::cerr << "bench: unknown huge page mode \"" << value << "\"" << std::endl;
+                std::exit(1);
+            }
+        } else if (!tnn::simd::parse(value, options.isa)) {
+            std::cerr << "bench: unknown SIMD path \"" << value << "\"" << std::endl;
+            std::exit(1);
+        }
+    }
+    return options;
+}
+
+// Ten independent chains of `iterations` multiply-adds each, spread over the lanes of the SIMD path in use.
+float peak_scalar(std::size_t iterations) {
+    float acc[10];
+    for (std::size_t j = 0; j < 10; ++j)
+        acc[j] = j;
+    for (std::size_t i = 0; i < iterations; ++i)
+        for (std::size_t j = 0; j < 10; ++j)
+            acc[j] = acc[j] * 0.999999f + 1e-6f;
+    return std::accumulate(acc, acc + 10, 0.0f);
+}
+
+#if TNN_X86
+TNN_TARGET_SSE41 float peak_sse41(std::size_t iterations) {
+    const __m128 a = _mm_set1_ps(0.999999f), b = _mm_set1_ps(1e-6f);
+    __m128 acc[10];
+    for (std::size_t j = 0; j < 10; ++j)
+        acc[j] = _mm_set1_ps(j);
+    for (std::size_t i = 0; i < iterations / 4; ++i)
+        for (std::size_t j = 0; j < 10; ++j)
+            acc[j] = _mm_add_ps(_mm_mul_ps(acc[j], a), b);
+    for (std::size_t j = 1; j < 10; ++j)
+        acc[0] = _mm_add_ps(acc[0], acc[j]);
+    return tnn::simd::mm_sum(acc[0]);
+}
+
+TNN_TARGET_AVX2 float peak_avx2(std::size_t iterations) {
+    const __m256 a = _mm256_set1_ps(0.999999f), b = _mm256_set1_ps(1e-6f);
+    __m256 acc[10];
+    for (std::size_t j = 0; j < 10; ++j)
+        acc[j] = _mm256_set1_ps(j);
+    for (std::size_t i = 0; i < iterations / 8; ++i)
+        for (std::size_t j = 0; j < 10; ++j)
+            acc[j] = _mm256_fmadd_ps(acc[j], a, b);
+    for (std::size_t j = 1; j < 10; ++j)
+        acc[0] = _mm256_add_ps(acc[0], acc[j]);
+    return tnn::simd::mm256_sum(acc[0]);
+}
+
+TNN_TARGET_AVX512 float peak_avx512(std::size_t iterations) {
+    const __m512 a = _mm512_set1_ps(0.999999f), b = _mm512_set1_ps(1e-6f);
+    __m512 acc[10];
+    for (std::size_t j = 0; j < 10; ++j)
+        acc[j] = _mm512_set1_ps(j);
+    for (std::size_t i = 0; i < iterations / 16; ++i)
+        for (std::size_t j = 0; j < 10; ++j)
+            acc[j] = _mm512_fmadd_ps(acc[j], a, b);
+    for (std::size_t j = 1; j < 10; ++j)
+        acc[0] = _mm512_add_ps(acc[0], acc[j]);
+    return _mm512_reduce_add_ps(acc[0]);
+}
+#endif
+
+float peak_chains(std::size_t iterations) {
+#if TNN_X86
+    switch (tnn::simd::current()) {
+        case tnn::simd::avx512: return peak_avx512(iterations);
+        case tnn::simd::avx2: return peak_avx2(iterations);
+        case tnn::simd::sse41: return peak_sse41(iterations);
+        default: break;
+    }
+#endif
+    return peak_scalar(iterations);
+}
+
+// Sum of [first, last). The compiler may not reorder a float sum, so it is split over four SSE registers where
+// there are some.
+float stream_sum(const float *first, const float *last) {
+    float sum = 0;
+#if TNN_X86
+    __m128 acc[4] = {_mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps()};
+    for (; first + 16 <= last; first += 16)
+        for (std::size_t j = 0; j < 4; ++j)
+            acc[j] = _mm_add_ps(acc[j], _mm_loadu_ps(first + 4 * j));
+    float lanes[4];
+    _mm_storeu_ps(lanes, _mm_add_ps(_mm_add_ps(acc[0], acc[1]), _mm_add_ps(acc[2], acc[3])));
+    sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+    return std::accumulate(first, last, sum);
+}
+
+// Independent multiply-adds on registers for the arithmetic peak, a sum over a buffer larger than the caches for
+// the DRAM bandwidth, and repeated sums over a buffer of 128 KB per chunk for the L2 bandwidth, on as many chunks
+// as the pool runs at once.
+machine_peak measure_peak(tnn::thread_pool &threads) {
+    const std::size_t iterations = 1 << 24, floats = 1 << 24, chunks = threads.get_thread_num() + 1,
+                      cached = 1 << 15, passes = 512;
+    std::vector<float> buffer(floats, 1), small(cached * chunks, 1), sums(chunks);
+    machine_peak peak {0, 0, 0};
+    for (std::size_t repeat = 0; repeat < 3; ++repeat) {
+        std::chrono::high_resolution_clock::time_point begin = std::chrono::high_resolution_clock::now();
+        threads.parallel_for(0, chunks, 1, [&sums, iterations](std::size_t s, std::size_t e) {
+            for (; s < e; ++s)
+                sums[s] = peak_chains(iterations);
+        });
+        std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - begin;
+        peak.gflops = std::max(peak.gflops, 2.0 * 10 * iterations * chunks / elapsed.count() / 1e9);
+
+        begin = std::chrono::high_resolution_clock::now();
+        threads.parallel_for(0, chunks, 1, [&buffer, &sums, floats, chunks](std::size_t s, std::size_t e) {
+            for (; s < e; ++s)
+                sums[s] += stream_sum(buffer.data() + floats / chunks * s, buffer.data() + floats / chunks * (s + 1));
+        });
+        elapsed = std::chrono::high_resolution_clock::now() - begin;
+        peak.gbps = std::max(peak.gbps, sizeof(float) * (floats / chunks * chunks) / elapsed.count() / 1e9);
+
+        begin = std::chrono::high_resolution_clock::now();
+        threads.parallel_for(0, chunks, 1, [&small, &sums, cached, passes](std::size_t s, std::size_t e) {
+            for (; s < e; ++s)
+                for (std::size_t pass = 0; pass < passes; ++pass)
+                    sums[s] += stream_sum(small.data() + cached * s, small.data() + cached * (s + 1));
+        });
+        elapsed = std::chrono::high_resolution_clock::now() - begin;
+        peak.l2_gbps = std::max(peak.l2_gbps, sizeof(float) * cached * chunks * passes / elapsed.count() / 1e9);
+    }
+    // Keeps the loops from being optimized out.
+    volatile float sink = std::accumulate(sums.begin(), sums.end(), 0.0f);
+    (void) sink;
+    return peak;
+}
+
+tnn::tensor<> random_tensor(const std::vector<std::size_t> &shape, std::mt19937 &engine) {
+    std::uniform_real_distribution<float> distribution(-1, 1);
+    tnn::tensor<> x;
+    x.resize(shape.begin(), shape.end());
+    for (std::size_t i = 0; i < x.size(); ++i)
+        x.at(i) = distribution(engine);
+    return x;
+}
+
+// Returns the parameters loaded, one tensor after another.
+std::vector<float> random_load(tnn::layer<> &layer, std::mt19937 &engine) {
+    std::uniform_real_distribution<float> distribution(-0.1, 0.1);
+    std::size_t floats = 0;
+    for (tnn::tensor<> *parameter: layer.parameters())
+        floats += parameter->size();
+    std::vector<float> data(floats);
+    for (std::size_t i = 0; i < floats; ++i)
+        data[i] = distribution(engine);
+    std::istringstream in(std::string(reinterpret_cast<const char *>(data.data()), floats * sizeof(float)));
+    layer.load(in);
+    return data;
+}
+
+// Sorted times of `repeats` runs, after one to warm up.
+std::vector<double> time_forward(const tnn::layer<> &layer, const tnn::tensor<> &x, tnn::tensor<> &y, std::size_t repeats, tnn::thread_pool &threads) {
+    // Buffers are planned beforehand, so that allocations are not timed.
+    tnn::workspace<> ws;
+    layer.plan(ws.acquire(x.shape()), ws);
+    std::vector<double> times;
+    for (std::size_t i = 0; i <= repeats; ++i) {
+        y = tnn::tensor<>();
+        tnn::tensor<> input = ws.acquire(x.shape());
+        std::copy(x.get_raw(), x.get_raw() + x.size(), input.get_raw());
+        std::chrono::high_resolution_clock::time_point begin = std::chrono::high_resolution_clock::now();
+        y = layer.forward(std::move(input), threads, ws);
+        std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - begin;
+        if (i)
+            times.push_back(elapsed.count());
+    }
+    std::sort(times.begin(), times.end());
+    return times;
+}
+
+// Parameters read by the layer in its current mode.
+std::size_t parameter_bytes(tnn::layer<> &layer) {
+    if (tnn::conv2d<> *conv = dynamic_cast<tnn::conv2d<> *>(&layer))
+        if (conv->quantized())
+            return conv->quantized_bytes();
+    if (tnn::linear<> *fc = dynamic_cast<tnn::linear<> *>(&layer))
+        if (fc->quantized())
+            return fc->quantized_bytes();
+    std::size_t bytes = 0;
+    for (tnn::tensor<> *parameter: layer.parameters())
+        bytes += parameter->size() * sizeof(float);
+    return bytes;
+}
+
+float max_relative_error(const tnn::tensor<> &expected, const tnn::tensor<> &actual) {
+    assert(expected.shape() == actual.shape());
+    float error = 0, scale = 0;
+    for (std::size_t i = 0; i < expected.size(); ++i) {
+        error = std::max(error, std::abs(expected.at(i) - actual.at(i)));
+        scale = std::max(scale, std::abs(expected.at(i)));
+    }
+    return scale ? error / scale : error;
+}
+
+float linear_error(const std::vector<float> &weight, const tnn::tensor<> &x, const tnn::tensor<> &y, std::mt19937 &engine) {
+    std::size_t in_features = x.shape(1), out_features = y.shape(1);
+    std::uniform_int_distribution<std::size_t> rows(0, x.shape(0) - 1), cols(0, out_features - 1);
+    float error = 0, scale = 0;
+    for (std::size_t s = 0; s < 256; ++s) {
+        std::size_t i = rows(engine), j = cols(engine);
+        double sum = weight[out_features * in_features + j];
+        for (std::size_t k = 0; k < in_features; ++k)
+            sum += (double) x.at(i, k) * weight[j * in_features + k];
+        error = std::max(error, (float) std::abs(sum - y.at(i, j)));
+        scale = std::max(scale, (float) std::abs(sum));
+    }
+    return scale ? error / scale : error;
+}
+
+void print_result(const bench_result &result, const machine_peak &peak) {
+    double gflops = result.flops / result.median / 1e9, gbps = result.bytes / result.median / 1e9;
+    std::cout << std::left << std::setw(12) << result.layer << std::setw(10) << result.mode << std::right
+              << std::setw(8) << result.threads_num << std::setw(7) << result.batch_size << std::fixed << std::setprecision(3)
+              << std::setw(10) << result.median * 1e3 << "ms" << std::setw(10) << result.p95 * 1e3 << "ms"
+              << std::setprecision(2) << std::setw(10) << gflops << std::setprecision(1) << std::setw(8) << 100 * gflops / peak.gflops << "%"
+              << std::setprecision(2) << std::setw(9) << gbps << std::setprecision(1) << std::setw(8) << 100 * gbps / peak.gbps << "%"
+              << std::setw(8) << 100 * gbps / peak.l2_gbps << "%";
+    if (std::isnan(result.error))
+        std::cout << std::setw(12) << "-" << "\n";
+    else
+        std::cout << std::scientific << std::setprecision(2) << std::setw(12) << result.error << "\n";
+}
+
+void save_json(const char *filename, const std::vector<std::size_t> &threads_nums, const std::vector<machine_peak> &peaks,
+               const std::vector<bench_result> &results) {
+    std::ofstream out(filename);
+    if (!out) {
+        std::cerr << "bench: failed to open JSON file \"" << filename << "\"" << std::endl;
+        std::exit(1);
+    }
+    out << std::setprecision(6) << "{\n  \"isa\": \"" << tnn::simd::name(tnn::simd::current()) << "\",\n  \"peaks\": [\n";
+    for (std::size_t i = 0; i < peaks.size(); ++i)
+        out << "    {\"threads\": " << threads_nums[i] << ", \"gflops\": " << peaks[i].gflops << ", \"gbps\": "
+            << peaks[i].gbps << ", \"l2_gbps\": " << peaks[i].l2_gbps << "}" << (i + 1 < peaks.size() ? ",\n" : "\n");
+    out << "  ],\n  \"results\": [\n";
+    for (std::size_t i = 0; i < results.size(); ++i) {
+        const bench_result &result = results[i];
+        out << "    {\"layer\": \"" << result.layer << "\", \"type\": \"" << result.type << "\", \"mode\": \""
+            << result.mode << "\", \"threads\": " << result.threads_num << ", \"batch\": " << result.batch_size
+            << ", \"median\": " << result.median << ", \"p95\": " << result.p95 << ", \"flops\": " << result.flops
+            << ", \"bytes\": " << result.bytes << ", \"max_error\": ";
+        if (std::isnan(result.error))
+            out << "null";
+        else
+            out << result.error;
+        out << "}" << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+}
@@ -5,6 +5,8 @@
 #include <cstdlib>
 #include <iomanip>
 #include "CImg.h"
+#include "simd.h"
+#include "aligned_allocator.h"
 #include "threadpool.h"
 #include "layers/conv2d.h"
 #include "layers/relu.h"
@@ -12,18 +14,60 @@
 #include "layers/linear.h"
 #include "layers/reshape.h"
 #include "layers/bias.h"
+#include "model.h"
+#include "calibration.h"
+#include "fusion.h"
+#include "folding.h"
+#include "packed_cache.h"
+#include "resize.h"
+#include "pipeline.h"
+#include "profiler.h"
+#include "tensor/layout.h"
 
 struct program_options {
-    const char *alexnet, *pca, *output;
-    bool binary, verbose;
-    std::size_t threads_num, batch_size;
+    const char *alexnet, *pca, *output, *trace;
+    // Directory of the packed caches of the networks, see packed_cache.h.
+    const char *cache;
+    bool binary, verbose, mmap;
+    tnn::mapped_file::hint mmap_hint;
+    // Convolutions run in the blocked mode, so that images are channel blocked from conv1 to the reshape.
+    bool blocked;
+    // Highest SIMD path to use, if the CPU has it.
+    tnn::simd::isa isa;
+    // Backing of weights and activations of at least 2 MB.
+    tnn::memory::huge_pages huge_pages;
+    std::size_t threads_num, batch_size, calibration;
+    // Threads of the decode, preprocess, network and PCA stages, and batches waiting between two stages.
+    std::size_t stage_threads[4], capacity;
     std::vector<const char *> files;
 };
 
+typedef std::vector<cimg_library::CImg<unsigned char> > image_batch;
+
+// A batch of images on its way through the forward pipeline, with the time spent in every stage.
+struct batch {
+    std::vector<const char *>::iterator first, last;
+    image_batch images;
+    tnn::tensor<> sample;
+    std::chrono::high_resolution_clock::time_point begin;
+    std::chrono::high_resolution_clock::duration stages[4];
+};
+
 program_options parse_args(int argc, const char *argv[]);
 void print_options(const program_options &options);
-std::shared_ptr<tnn::layer<> > load_alexnet(const char *filename);
-std::shared_ptr<tnn::layer<> > load_pca(const char *filename);
+std::shared_ptr<tnn::layer<> > load_alexnet(const char *filename, const program_options &options);
+std::shared_ptr<tnn::layer<> > load_pca(const char *filename, const program_options &options);
+void use_blocked_layout(tnn::layer<> &network);
+std::uint64_t packed_cache_key(const char *filename, const std::string &setup, const program_options &options);
+template <typename Setup>
+std::shared_ptr<tnn::layer<> > setup_cached(std::uint64_t key, Setup setup, const program_options &options);
+void save_packed_cache(const tnn::layer<> &network, std::uint64_t key, const program_options &options);
+std::shared_ptr<tnn::layer<> > load_model(std::ifstream &in, const char *filename, const std::vector<std::size_t> &input_shape,
+                                          const program_options &options);
+void load_data(tnn::layer<> &layer, std::ifstream &in, const char *filename, const program_options &options);
+template <typename Iterator>
+image_batch decode_images(Iterator first, Iterator last, tnn::thread_pool &threads);
+tnn::tensor<> preprocess_images(image_batch &images, tnn::thread_pool &threads);
 template <typename Iterator>
 tnn::tensor<> load_sample(Iterator first, Iterator last, tnn::thread_pool &threads);
 tnn::tensor<> load_raw_features(const char *filename);
@@ -38,29 +82,124 @@ int main(int argc, const char *argv[])
     std::chrono::high_resolution_clock::time_point begin, end, forward_begin, total_begin = std::chrono::high_resolution_clock::now();
 
     program_options options = parse_args(argc, argv);
+    // Before anything is loaded, so that every layer runs the same kernels from the start.
+    tnn::simd::select(options.isa);
+    tnn::memory::set_huge_pages(options.huge_pages);
     if (options.verbose)
         print_options(options);
 
     tnn::thread_pool threads(options.threads_num);
 
     std::shared_ptr<tnn::layer<> > alexnet, pca;
+    // Keys of the networks in the packed cache, and whether their packed parameters came from it.
+    std::uint64_t alexnet_key = 0, pca_key = 0;
+    bool alexnet_cached = false, pca_cached = false;
     if (options.alexnet) {
         begin = std::chrono::high_resolution_clock::now();
-        alexnet = load_alexnet(options.alexnet);
+        std::vector<tnn::rewrite> rewrites;
+        std::size_t fused = 0;
+        auto setup = [&rewrites, &fused](const program_options &options) {
+            std::shared_ptr<tnn::layer<> > network = load_alexnet(options.alexnet, options);
+            if (options.blocked)
+                use_blocked_layout(*network);
+            rewrites = tnn::fold(*network, {3, 224, 224});
+            fused = tnn::fuse(*network);
+            return network;
+        };
+        if (options.cache) {
+            // Calibration is part of the setup, on the images named first.
+            std::string description = std::string("alexnet layout=") + (options.blocked ? "blocked" : "nchw");
+            if (options.calibration) {
+                description += " calibration=" + std::to_string(options.batch_size);
+                for (std::size_t i = 0; i < std::min(options.calibration, options.files.size()); ++i)
+                    description += std::string(" ") + options.files[i];
+            }
+            alexnet_key = packed_cache_key(options.alexnet, description, options);
+            alexnet = setup_cached(alexnet_key, setup, options);
+            alexnet_cached = static_cast<bool>(alexnet);
+        }
+        if (!alexnet)
+            alexnet = setup(options);
         end = std::chrono::high_resolution_clock::now();
-        if (options.verbose)
-            std::cout << "Alexnet loaded.\t" << (end - begin) << "\n";
+        if (options.verbose) {
+            std::cout << "Alexnet loaded.\t" << (end - begin) << "\t" << fused << " relus fused"
+                      << (alexnet_cached ? ", packed from cache\n" : "\n");
+            for (const tnn::rewrite &r: rewrites)
+                std::cout << "  " << r << "\n";
+        }
     }
     if (options.pca) {
         begin = std::chrono::high_resolution_clock::now();
-        pca = load_pca(options.pca);
+        std::vector<tnn::rewrite> rewrites;
+        auto setup = [&rewrites](const program_options &options) {
+            std::shared_ptr<tnn::layer<> > network = load_pca(options.pca, options);
+            rewrites = tnn::fold(*network, {4096});
+            return network;
+        };
+        if (options.cache) {
+            pca_key = packed_cache_key(options.pca, "pca", options);
+            pca = setup_cached(pca_key, setup, options);
+            pca_cached = static_cast<bool>(pca);
+        }
+        if (!pca)
+            pca = setup(options);
+        end = std::chrono::high_resolution_clock::now();
+        if (options.verbose) {
+            std::cout << "PCA loaded.\t" << (end - begin) << (pca_cached ? "\tpacked from cache\n" : "\n");
+            for (const tnn::rewrite &r: rewrites)
+                std::cout << "  " << r << "\n";
+        }
+    }
+    if (options.alexnet && options.calibration && !alexnet_cached) {
+        // Calibrated on the first images, with a workspace of its own so that the planned one stays minimal.
+        begin = std::chrono::high_resolution_clock::now();
+        tnn::calibrator<> calibrator(alexnet);
+        tnn::workspace<> calibration_ws;
+        std::size_t images = std::min(options.calibration, options.files.size());
+        for (std::size_t i = 0; i < images; i += options.batch_size) {
+            std::vector<const char *>::iterator first = options.files.begin() + i,
+                    last = options.files.begin() + std::min(i + options.batch_size, images);
+            calibrator.forward(load_sample(first, last, threads), threads, calibration_ws);
+        }
+        calibrator.apply();
         end = std::chrono::high_resolution_clock::now();
         if (options.verbose)
-            std::cout << "PCA loaded.\t" << (end - begin) << "\n";
+            std::cout << "INT8 calibrated.\t" << (end - begin) << "\t" << std::setprecision(2) << std::fixed
+                      << calibrator.float_bytes() / 1048576.0 << "MB -> " << calibrator.quantized_bytes() / 1048576.0
+                      << "MB of weights\n";
+    }
+    if (options.cache && options.alexnet && !alexnet_cached)
+        save_packed_cache(*alexnet, alexnet_key, options);
+    if (options.cache && options.pca && !pca_cached)
+        save_packed_cache(*pca, pca_key, options);
+    // Every thread of the network and PCA stages has a workspace of its own.
+    std::vector<tnn::workspace<> > network_ws(options.stage_threads[2]), pca_ws(options.stage_threads[3]);
+    tnn::workspace<> ws;
+    if (options.alexnet) {
+        begin = std::chrono::high_resolution_clock::now();
+        std::size_t batch_size = std::min(options.batch_size, options.files.size()), size = 0, buffers = 0;
+        for (tnn::workspace<> &stage_ws: network_ws) {
+            alexnet->plan(stage_ws.acquire({batch_size, 3, 224, 224}), stage_ws);
+            size += stage_ws.size();
+            buffers += stage_ws.buffers();
+        }
+        if (options.pca)
+            for (tnn::workspace<> &stage_ws: pca_ws) {
+                pca->plan(stage_ws.acquire({batch_size, 4096}), stage_ws);
+                size += stage_ws.size();
+                buffers += stage_ws.buffers();
+            }
+        end = std::chrono::high_resolution_clock::now();
+        if (options.verbose)
+            std::cout << "Workspace planned.\t" << (end - begin) << "\t" << std::setprecision(2) << std::fixed
+                      << size / 1048576.0 << "MB in " << buffers << " buffers\n";
     }
     if (options.verbose)
         std::cout << std::endl;
 
+    // Profiled from here on, so that loading, calibration and planning stay out of the summary and the trace.
+    if (options.verbose || options.trace)
+        tnn::profiler::instance().enable();
     forward_begin = std::chrono::high_resolution_clock::now();
     std::ofstream out;
     if (options.output) {
@@ -76,28 +215,68 @@ int main(int argc, const char *argv[])
     if (options.alexnet) {
         if (options.verbose)
             std::cout << "Forward finished:" << std::endl;
-        for (std::size_t i = 0; i < options.files.size(); i += options.batch_size) {
-            begin = std::chrono::high_resolution_clock::now();
-            std::vector<const char *>::iterator first = options.files.begin() + i, last = first + options.batch_size;
-            if (last > options.files.end())
-                last = options.files.end();
-            tnn::tensor<> sample = load_sample(first, last, threads);
-            sample = alexnet->forward(std::move(sample), threads);
-            if (options.pca)
-                sample = pca->forward(std::move(sample), threads);
+        // Batches go through decode -> preprocess -> network -> PCA -> writer, so that while one batch runs
+        // through Alexnet the next ones are decoded and the previous ones are written. The network and PCA
+        // stages hand over their outputs in the buffers of their workspaces, which are not reused while the
+        // batch holds them: a workspace adds a buffer for every batch it has output and that is still in flight,
+        // at most the window of the pipeline.
+        std::vector<const char *>::iterator next = options.files.begin();
+        std::size_t done = 0, index = 0;
+        tnn::pipeline<batch> stages(options.capacity);
+        stages.stage([&threads](batch &b, std::size_t) {
+            tnn::profiler::scope scope("decode");
+            std::chrono::high_resolution_clock::time_point begin = std::chrono::high_resolution_clock::now();
+            b.images = decode_images(b.first, b.last, threads);
+            b.stages[0] = std::chrono::high_resolution_clock::now() - begin;
+        }, options.stage_threads[0]);
+        stages.stage([&threads](batch &b, std::size_t) {
+            tnn::profiler::scope scope("preprocess");
+            std::chrono::high_resolution_clock::time_point begin = std::chrono::high_resolution_clock::now();
+            b.sample = preprocess_images(b.images, threads);
+            b.images.clear();
+            b.stages[1] = std::chrono::high_resolution_clock::now() - begin;
+        }, options.stage_threads[1]);
+        stages.stage([&threads, &alexnet, &network_ws](batch &b, std::size_t thread) {
+            tnn::profiler::scope scope("network");
+            std::chrono::high_resolution_clock::time_point begin = std::chrono::high_resolution_clock::now();
+            b.sample = alexnet->forward(std::move(b.sample), threads, network_ws[thread]);
+            b.stages[2] = std::chrono::high_resolution_clock::now() - begin;
+        }, options.stage_threads[2]);
+        if (options.pca)
+            stages.stage([&threads, &pca, &pca_ws](batch &b, std::size_t thread) {
+                tnn::profiler::scope scope("PCA");
+                std::chrono::high_resolution_clock::time_point begin = std::chrono::high_resolution_clock::now();
+                b.sample = pca->forward(std::move(b.sample), threads, pca_ws[thread]);
+                b.stages[3] = std::chrono::high_resolution_clock::now() - begin;
+            }, options.stage_threads[3]);
+        stages.run([&options, &next](batch &b) {
+            if (next == options.files.end())
+                return false;
+            b.first = next;
+            b.last = next + std::min<std::size_t>(options.batch_size, options.files.end() - next);
+            b.begin = std::chrono::high_resolution_clock::now();
+            next = b.last;
+            return true;
+        }, [&options, &out, &done, &index](batch &b) {
+            tnn::profiler::scope scope("write");
             if (options.output)
-                save_result(out, sample, options.binary);
+                save_result(out, b.sample, options.binary);
             else
-                save_result(std::cout, sample, options.binary);
-            end = std::chrono::high_resolution_clock::now();
-            if (options.verbose)
-                std::cout << "  "  << std::setw(4) << (i / options.batch_size + 1)
-                          << " (" << std::setw(6) << std::setprecision(2) << std::fixed << (100.0 * (i + sample.shape(0)) / options.files.size()) << "%)\t"
-                          << (end - begin) << std::endl;
-        }
+                save_result(std::cout, b.sample, options.binary);
+            done += b.sample.shape(0);
+            if (options.verbose) {
+                std::cout << "  "  << std::setw(4) << ++index
+                          << " (" << std::setw(6) << std::setprecision(2) << std::fixed << (100.0 * done / options.files.size()) << "%)\t"
+                          << (std::chrono::high_resolution_clock::now() - b.begin) << "\tdecode " << b.stages[0]
+                          << ", preprocess " << b.stages[1] << ", network " << b.stages[2];
+                if (options.pca)
+                    std::cout << ", PCA " << b.stages[3];
+                std::cout << std::endl;
+            }
+        });
     } else {
         tnn::tensor<> sample = load_raw_features(options.files.front());
-        sample = pca->forward(std::move(sample), threads);
+        sample = pca->forward(std::move(sample), threads, ws);
         if (options.output)
             save_result(out, sample, options.binary);
         else
@@ -107,8 +286,27 @@ int main(int argc, const char *argv[])
         out.close();
 
     end = std::chrono::high_resolution_clock::now();
+    tnn::profiler::instance().disable();
+    if (options.trace) {
+        std::ofstream trace(options.trace);
+        tnn::profiler::instance().save_trace(trace);
+        if (!trace) {
+            std::cerr << "feature: failed to write trace file \"" << options.trace << "\"" << std::endl;
+            std::exit(1);
+        }
+    }
     if (options.verbose) {
-        std::cout << "Forward finished.\t" << (end - forward_begin) << "\n" << std::endl;
+        std::cout << "Forward finished.\t" << (end - forward_begin) << "\n";
+        std::cout << "Tensor copies:\t" << tnn::tensor<>::storage::copies() << "\n";
+        std::size_t allocations = ws.allocations();
+        for (const tnn::workspace<> &stage_ws: network_ws)
+            allocations += stage_ws.allocations();
+        for (const tnn::workspace<> &stage_ws: pca_ws)
+            allocations += stage_ws.allocations();
+        std::cout << "Workspace allocations:\t" << allocations << "\n" << std::endl;
+        std::cout << "Profile:\n";
+        tnn::profiler::instance().print_summary(std::cout);
+        std::cout << std::endl;
         std::cout << "All finished.\t" << (end - total_begin) << "\n" << std::endl;
     }
 
@@ -126,6 +324,27 @@ const char *help_str = ""
         "  -t, --threads=NUM         create NUM worker threads\n"
         "  -s, --batch=NUM           set forward batch size\n"
         "  -o, --output=FILE         set output file\n"
+        "  -q, --quantize=NUM        run Alexnet in INT8, calibrated on the first NUM\n"
+        "                            images\n"
+        "  -m, --mmap[=HINT]         map data files instead of reading them; HINT is\n"
+        "                            none (default), populate or willneed\n"
+        "  -k, --packed-cache=DIR    map the packed weights of the networks from DIR,\n"
+        "                            keyed by data file, SIMD path and setup, and save\n"
+        "                            them there on a miss\n"
+        "  -j, --stages=LIST         run the decode, preprocess, network and PCA stages\n"
+        "                            on the comma separated numbers of threads\n"
+        "                            (default 1,1,1,1)\n"
+        "  -c, --capacity=NUM        let NUM batches wait between two stages\n"
+        "                            (default 2)\n"
+        "  -r, --trace=FILE          save a Chrome trace of the layers, thread pool\n"
+        "                            tasks and stages to FILE\n"
+        "  -i, --isa=NAME            use at most this SIMD path: scalar, sse4.1, avx2\n"
+        "                            or avx512 (default the best the CPU has)\n"
+        "  -g, --huge-pages=MODE     back large buffers with huge pages: none\n"
+        "                            (default), transparent or hugetlb\n"
+        "  -l, --layout=NAME         lay out images between the convolutions as nchw\n"
+        "                            (default) or blocked, 8 or 16 channels at a time\n"
+        "                            by the SIMD path\n"
         "  -b, --binary              set output mode to binary\n"
         "  -v, --verbose             enable verbose mode\n"
         "  -h, --help                print this help message\n"
@@ -140,9 +359,10 @@ const char *help_str = ""
 
 program_options parse_args(int argc, const char *argv[]) {
     program_options options {
-            nullptr, nullptr, nullptr,
-            false, false,
-            std::thread::hardware_concurrency(), std::thread::hardware_concurrency(),
+            nullptr, nullptr, nullptr, nullptr, nullptr,
+            false, false, false, tnn::mapped_file::none, false, tnn::simd::avx512, tnn::memory::none,
+            std::thread::hardware_concurrency(), std::thread::hardware_concurrency(), 0,
+            {1, 1, 1, 1}, 2,
             {}
     };
     const char *temp_str, *char_p;
@@ -177,6 +397,58 @@ program_options parse_args(int argc, const char *argv[]) {
                 options.output = argv[i];
             } else
                 options.output = argv[i] + 9;
+        } else if (!std::strcmp(argv[i], "-r") || (!std::strncmp(argv[i], "--trace=", 8) && sh--)) {
+            if (sh) {
+                if (++i == argc) {
+                    std::cerr << "feature: requires path to trace file after \"-r\"" << std::endl;
+                    std::exit(1);
+                }
+                options.trace = argv[i];
+            } else
+                options.trace = argv[i] + 8;
+        } else if (!std::strcmp(argv[i], "-i") || (!std::strncmp(argv[i], "--isa=", 6) && sh--)) {
+            if (sh) {
+                if (++i == argc) {
+                    std::cerr << "feature: requires name of SIMD path after \"-i\"" << std::endl;
+                    std::exit(1);
+                }
+                temp_str = argv[i];
+            } else
+                temp_str = argv[i] + 6;
+            if (!tnn::simd::parse(temp_str, options.isa)) {
+                std::cerr << "feature: invalid SIMD path \"" << temp_str << "\"" << std::endl;
+                std::exit(1);
+            }
+        } else if (!std::strcmp(argv[i], "-g") || (!std::strncmp(argv[i], "--huge-pages=", 13) && sh--)) {
+            if (sh) {
+                if (++i == argc) {
+                    std::cerr << "feature: requires huge page mode after \"-g\"" << std::endl;
+                    std::exit(1);
+                }
+                temp_str = argv[i];
+            } else
+                temp_str = argv[i] + 13;
+            if (!tnn::memory::parse(temp_str, options.huge_pages)) {
+                std::cerr << "feature: invalid huge page mode \"" << temp_str << "\"" << std::endl;
+                std::exit(1);
+            }
+        } else if (!std::strcmp(argv[i], "-l") || (!std::strncmp(argv[i], "--layout=", 9) && sh--)) {
+            if (sh) {
+                if (++i == argc) {
+                    std::cerr << "feature: requires name of layout after \"-l\"" << std::endl;
+                    std::exit(1);
+                }
+                temp_str = argv[i];
+            } else
+                temp_str = argv[i] + 9;
+            if (!std::strcmp(temp_str, "nchw"))
+                options.blocked = false;
+            else if (!std::strcmp(temp_str, "blocked"))
+                options.blocked = true;
+            else {
+                std::cerr << "feature: invalid layout \"" << temp_str << "\"" << std::endl;
+                std::exit(1);
+            }
         } else if (!std::strcmp(argv[i], "-t") || (!std::strncmp(argv[i], "--threads=", 10) && sh--)) {
             if (sh) {
                 if (++i == argc) {
@@ -207,6 +479,81 @@ program_options parse_args(int argc, const char *argv[]) {
                 std::exit(1);
             }
             options.batch_size = temp_int;
+        } else if (!std::strcmp(argv[i], "-q") || (!std::strncmp(argv[i], "--quantize=", 11) && sh--)) {
+            if (sh) {
+                if (++i == argc) {
+                    std::cerr << "feature: requires number of calibration images after \"-q\"" << std::endl;
+                    std::exit(1);
+                }
+                temp_str = argv[i];
+            } else
+                temp_str = argv[i] + 11;
+            for (char_p = temp_str; *char_p && *char_p >= '0' && *char_p <= '9'; ++char_p);
+            if (!*temp_str || *char_p || (temp_int = std::atoi(temp_str)) < 1) {
+                std::cerr << "feature: invalid number of calibration images" << std::endl;
+                std::exit(1);
+            }
+            options.calibration = temp_int;
+        } else if (!std::strcmp(argv[i], "-j") || (!std::strncmp(argv[i], "--stages=", 9) && sh--)) {
+            if (sh) {
+                if (++i == argc) {
+                    std::cerr << "feature: requires numbers of stage threads after \"-j\"" << std::endl;
+                    std::exit(1);
+                }
+                temp_str = argv[i];
+            } else
+                temp_str = argv[i] + 9;
+            // Stages left out of the list keep one thread.
+            for (std::size_t stage = 0; ; ++stage) {
+                for (char_p = temp_str; *char_p && *char_p >= '0' && *char_p <= '9'; ++char_p);
+                if (stage == 4 || char_p == temp_str || (*char_p && *char_p != ',') || (temp_int = std::atoi(temp_str)) < 1) {
+                    std::cerr << "feature: invalid numbers of stage threads" << std::endl;
+                    std::exit(1);
+                }
+                options.stage_threads[stage] = temp_int;
+                if (!*char_p)
+                    break;
+                temp_str = char_p + 1;
+            }
+        } else if (!std::strcmp(argv[i], "-c") || (!std::strncmp(argv[i], "--capacity=", 11) && sh--)) {
+            if (sh) {
+                if (++i == argc) {
+                    std::cerr << "feature: requires number of batches after \"-c\"" << std::endl;
+                    std::exit(1);
+                }
+                temp_str = argv[i];
+            } else
+                temp_str = argv[i] + 11;
+            for (char_p = temp_str; *char_p && *char_p >= '0' && *char_p <= '9'; ++char_p);
+            if (!*temp_str || *char_p || (temp_int = std::atoi(temp_str)) < 1) {
+                std::cerr << "feature: invalid number of batches" << std::endl;
+                std::exit(1);
+            }
+            options.capacity = temp_int;
+        } else if (!std::strcmp(argv[i], "-k") || (!std::strncmp(argv[i], "--packed-cache=", 15) && sh--)) {
+            if (sh) {
+                if (++i == argc) {
+                    std::cerr << "feature: requires path to packed cache directory after \"-k\"" << std::endl;
+                    std::exit(1);
+                }
+                options.cache = argv[i];
+            } else
+                options.cache = argv[i] + 15;
+        } else if (!std::strcmp(argv[i], "-m") || !std::strcmp(argv[i], "--mmap")) {
+            options.mmap = true;
+        } else if (!std::strncmp(argv[i], "--mmap=", 7)) {
+            options.mmap = true;
+            temp_str = argv[i] + 7;
+            if (!std::strcmp(temp_str, "none"))
+                options.mmap_hint = tnn::mapped_file::none;
+            else if (!std::strcmp(temp_str, "populate"))
+                options.mmap_hint = tnn::mapped_file::populate;
+            else if (!std::strcmp(temp_str, "willneed"))
+                options.mmap_hint = tnn::mapped_file::willneed;
+            else {
+                std::cerr << "feature: invalid mmap hint \"" << temp_str << "\"" << std::endl;
+                std::exit(1);
+            }
         } else if (!std::strcmp(argv[i], "-b") || !std::strcmp(argv[i], "--binary")) {
             options.binary = true;
         } else if (!std::strcmp(argv[i], "-v") || !std::strcmp(argv[i], "--verbose")) {
@@ -247,31 +594,59 @@ void print_options(const program_options &options) {
         std::cout << "  Output file:        \"" << options.output << "\"\n";
     else
         std::cout << "  Output file:        stdout\n";
+    if (options.trace)
+        std::cout << "  Trace file:         \"" << options.trace << "\"\n";
     if (options.binary)
         std::cout << "  Output mode:        binary\n";
     else
         std::cout << "  Output mode:        text\n";
+    if (options.mmap) {
+        const char *hints[] = {"none", "populate", "willneed"};
+        std::cout << "  Data loading:       mmap (" << hints[options.mmap_hint] << ")\n";
+    } else
+        std::cout << "  Data loading:       read\n";
+    if (options.cache)
+        std::cout << "  Packed cache:       \"" << options.cache << "\"\n";
+    std::cout << "  Huge pages:         " << tnn::memory::name(options.huge_pages) << "\n";
     if (options.alexnet) {
         std::cout << "  Files num:          " << options.files.size() << "\n";
         std::cout << "  Batch size:         " << options.batch_size <<"\n";
+        std::cout << "  Stage threads:      " << options.stage_threads[0] << " decode, " << options.stage_threads[1]
+                  << " preprocess, " << options.stage_threads[2] << " network";
+        if (options.pca)
+            std::cout << ", " << options.stage_threads[3] << " PCA";
+        std::cout << "\n";
+        std::cout << "  Stage capacity:     " << options.capacity << " batches\n";
     }
+    if (options.alexnet && options.calibration)
+        std::cout << "  Precision:          int8 (" << options.calibration << " calibration images)\n";
+    else
+        std::cout << "  Precision:          float\n";
     std::cout << "  Threads num:        " << options.threads_num <<"\n";
-    std::cout << "  AVX2 enabled:       " << std::boolalpha << AVX_ENABLED << "\n";
+    std::cout << "  SIMD path:          " << tnn::simd::name(tnn::simd::current()) << "\n";
+    if (options.alexnet && options.blocked)
+        std::cout << "  Layout:             NCHW" << tnn::layout::preferred_block() << "c\n";
+    else if (options.alexnet)
+        std::cout << "  Layout:             NCHW\n";
     std::cout << std::endl;
 }
 
-std::shared_ptr<tnn::layer<> > load_alexnet(const char *filename) {
+std::shared_ptr<tnn::layer<> > load_alexnet(const char *filename, const program_options &options) {
     std::ifstream in(filename, std::ios::in | std::ios::ate | std::ios::binary);
     if (!in) {
         std::cerr << "feature: failed to open Alexnet data file \"" << filename << "\"" << std::endl;
         std::exit(1);
     }
+    std::shared_ptr<tnn::layer<> > alexnet = load_model(in, filename, {3, 224, 224}, options);
+    if (alexnet)
+        return alexnet;
+    // Legacy data file: the raw parameters of the layers below, one after another.
     if (in.tellg() != 228015360) {
         std::cerr << "feature: invalid size of Alexnet data file \"" << filename << "\"" << std::endl;
         std::exit(1);
     }
     in.seekg(0);
-    std::shared_ptr<tnn::layer<> > alexnet = std::make_shared<tnn::layers<> >(std::initializer_list<std::shared_ptr<tnn::layer<> > >({
+    alexnet = std::make_shared<tnn::layers<> >(std::initializer_list<std::shared_ptr<tnn::layer<> > >({
             std::make_shared<tnn::conv2d<> >(3, 64, 11, 4, 2),
             std::make_shared<tnn::relu<> >(),
             std::make_shared<tnn::maxpool2d<> >(3, 2),
@@ -291,75 +666,172 @@ std::shared_ptr<tnn::layer<> > load_alexnet(const char *filename) {
             std::make_shared<tnn::linear<> >(4096, 4096),
             std::make_shared<tnn::relu<> >()
     }));
-    alexnet->load(in);
-    in.close();
+    load_data(*alexnet, in, filename, options);
     return alexnet;
 }
 
-std::shared_ptr<tnn::layer<> > load_pca(const char *filename) {
+void use_blocked_layout(tnn::layer<> &network) {
+    if (tnn::layers<> *sequence = dynamic_cast<tnn::layers<> *>(&network)) {
+        for (const std::shared_ptr<tnn::layer<> > &layer: sequence->get_layers())
+            use_blocked_layout(*layer);
+    } else if (tnn::conv2d<> *conv = dynamic_cast<tnn::conv2d<> *>(&network))
+        conv->set_mode(tnn::conv2d_mode::blocked);
+}
+
+std::uint64_t packed_cache_key(const char *filename, const std::string &setup, const program_options &options) {
+    tnn::mapped_file file(filename, options.mmap_hint);
+    if (!file) {
+        std::cerr << "feature: failed to map data file \"" << filename << "\"" << std::endl;
+        std::exit(1);
+    }
+    return tnn::packed_cache::key(file, setup);
+}
+
+// Sets up a network with `setup`, packing deferred, and maps its packed parameters from the cache for `key`.
+// The data file is mapped too, since computing the key has just read it. Returns nullptr if the cache has
+// nothing for `key` that fits.
+template <typename Setup>
+std::shared_ptr<tnn::layer<> > setup_cached(std::uint64_t key, Setup setup, const program_options &options) {
+    tnn::mapped_file file;
+    if (!tnn::packed_cache::open(file, tnn::packed_cache::filename(options.cache, key), key))
+        return nullptr;
+    program_options mapped = options;
+    mapped.mmap = true;
+    std::shared_ptr<tnn::layer<> > network;
+    {
+        tnn::packed_cache::defer deferred;
+        network = setup(mapped);
+    }
+    if (!network->load_packed(file) || !file)
+        return nullptr;
+    return network;
+}
+
+void save_packed_cache(const tnn::layer<> &network, std::uint64_t key, const program_options &options) {
+    std::string filename = tnn::packed_cache::filename(options.cache, key);
+    if (!tnn::packed_cache::save(network, filename, key))
+        std::cerr << "feature: failed to write packed cache file \"" << filename << "\"" << std::endl;
+}
+
+std::shared_ptr<tnn::layer<> > load_pca(const char *filename, const program_options &options) {
     std::ifstream in(filename, std::ios::in | std::ios::ate | std::ios::binary);
     if (!in) {
         std::cerr << "feature: failed to open PCA data file \"" << filename << "\"" << std::endl;
         std::exit(1);
     }
+    std::shared_ptr<tnn::layer<> > pca = load_model(in, filename, {4096}, options);
+    if (pca)
+        return pca;
+    // Legacy data file: the negated mean followed by the components.
     std::size_t features = in.tellg() / sizeof(float) / 4096 - 1;
     if (!features || (std::size_t) in.tellg() != sizeof(float) * 4096 * (features + 1)) {
         std::cerr << "feature: invalid size of PCA data file \"" << filename << "\"" << std::endl;
         std::exit(1);
     }
     in.seekg(0);
-    std::shared_ptr<tnn::layer<> > pca = std::make_shared<tnn::layers<> >(std::initializer_list<std::shared_ptr<tnn::layer<> > >({
+    pca = std::make_shared<tnn::layers<> >(std::initializer_list<std::shared_ptr<tnn::layer<> > >({
             std::make_shared<tnn::bias<> >(4096),
             std::make_shared<tnn::linear<> >(4096, features, false)
     }));
-    pca->load(in);
-    in.close();
+    load_data(*pca, in, filename, options);
     return pca;
 }
 
+// Returns nullptr if `in` is not a model file but a legacy data file, and leaves `in` at its end.
+std::shared_ptr<tnn::layer<> > load_model(std::ifstream &in, const char *filename, const std::vector<std::size_t> &input_shape,
+                                          const program_options &options) {
+    in.seekg(0);
+    if (!tnn::model<>::detect(in)) {
+        in.seekg(0, std::ios::end);
+        return nullptr;
+    }
+    tnn::model<> model;
+    if (options.mmap) {
+        tnn::mapped_file file(filename, options.mmap_hint);
+        if (!file) {
+            std::cerr << "feature: failed to map data file \"" << filename << "\"" << std::endl;
+            std::exit(1);
+        }
+        model.load(file);
+    } else
+        model.load(in);
+    in.close();
+    if (!model.network()) {
+        std::cerr << "feature: invalid model file \"" << filename << "\": " << model.error() << std::endl;
+        std::exit(1);
+    }
+    if (model.input_shape() != input_shape) {
+        std::cerr << "feature: unexpected input shape of model file \"" << filename << "\"" << std::endl;
+        std::exit(1);
+    }
+    return model.network();
+}
+
+// `in` is the already validated data file. With mmap the parameters point into a mapping of it instead.
+void load_data(tnn::layer<> &layer, std::ifstream &in, const char *filename, const program_options &options) {
+    if (options.mmap) {
+        in.close();
+        tnn::mapped_file file(filename, options.mmap_hint);
+        if (!file) {
+            std::cerr << "feature: failed to map data file \"" << filename << "\"" << std::endl;
+            std::exit(1);
+        }
+        layer.load(file);
+    } else {
+        layer.load(in);
+        in.close();
+    }
+}
+
 template <typename Iterator>
-tnn::tensor<> load_sample(Iterator first, Iterator last, tnn::thread_pool &threads) {
+image_batch decode_images(Iterator first, Iterator last, tnn::thread_pool &threads) {
+    image_batch images(std::distance(first, last), cimg_library::CImg<unsigned char>(1, 1, 1, 3, 0));
+    threads.parallel_for(0, images.size(), 1, [&images, first](std::size_t s, std::size_t e) {
+        Iterator iter = first;
+        std::advance(iter, s);
+        for (; s < e; ++iter, ++s) {
+            try {
+                images[s].load(*iter);
+            } catch (const cimg_library::CImgIOException &error) {
+                std::cerr << "feature: " << error.what() << std::endl;
+            }
+        }
+    });
+    return images;
+}
+
+// Resizes the images to 256 pixels on their shorter side and normalizes their center 224 x 224 crop, straight from
+// the decoded bytes: only the crop is ever resampled, see resize.h. Grayscale images fill all 3 channels.
+tnn::tensor<> preprocess_images(image_batch &images, tnn::thread_pool &threads) {
     const static float mean[] = {0.485, 0.456, 0.406}, std[] = {0.229, 0.224, 0.225};
-    std::size_t batch_size = std::distance(first, last);
-    tnn::tensor<> sample{batch_size, 3, 224, 224};
-
-    std::vector<std::future<void> > sync;
-    sync.reserve(threads.get_thread_num());
-    std::size_t start = 0;
-    double step = (double) batch_size / threads.get_thread_num();
-    for (std::size_t i = 0; i < threads.get_thread_num(); ++i) {
-        std::size_t end = (int) (step * (i + 1) + 0.5);
-        if (start != end)
-            sync.emplace_back(threads.enqueue([&sample](Iterator iter, std::size_t s, std::size_t e) {
-                for (; s < e; ++iter, ++s) {
-                    cimg_library::CImg<> image(1, 1, 3, 1);
-                    try {
-                        image.load(*iter);
-                    } catch (const cimg_library::CImgIOException &error) {
-                        std::cerr << "feature: " << error.what() << std::endl;
-                    }
-                    image /= 255;
-                    std::size_t h = 256, w = 256;
-                    if (image.height() > image.width())
-                        h = image.height() / image.width() * 256;
-                    else
-                        w = image.width() / image.height() * 256;
-                    image.resize(w, h, 1, 3, 3);
-                    size_t js = (size_t) ((w - 224) / 2.0 + 0.5), is = (size_t) ((h - 224) / 2.0 + 0.5);
-                    for (size_t k = 0; k < 3; ++k)
-                        for (size_t i = 0; i < 224; ++i)
-                            for (size_t j = 0; j < 224; ++j)
-                                sample.at(s, k, i, j) = (image(js + j, is + i, 0, k) - mean[k]) / std[k];
-                }
-            }, first, start, end));
-        std::advance(first, end - start);
-        start = end;
-    }
-    for (std::size_t i = 0; i < sync.size(); ++i)
-        sync[i].get();
+    tnn::tensor<> sample{images.size(), 3, 224, 224};
+
+    threads.parallel_for(0, images.size(), 1, [&sample, &images](std::size_t s, std::size_t e) {
+        for (; s < e; ++s) {
+            const cimg_library::CImg<unsigned char> &image = images[s];
+            std::size_t h = 256, w = 256;
+            if (image.height() > image.width())
+                h = image.height() / image.width() * 256;
+            else
+                w = image.width() / image.height() * 256;
+            size_t js = (size_t) ((w - 224) / 2.0 + 0.5), is = (size_t) ((h - 224) / 2.0 + 0.5);
+            tnn::resize::axis rows(image.height(), h, is, 224), cols(image.width(), w, js, 224);
+            for (size_t k = 0; k < 3; ++k) {
+                int plane = std::min<int>(k, image.spectrum() - 1);
+                tnn::resize::crop(image.data(0, 0, 0, plane), image.width(), rows, cols, 1 / (255 * std[k]),
+                                  -mean[k] / std[k], sample.get_raw(s, k, 0, 0));
+            }
+        }
+    });
     return sample;
 }
 
+template <typename Iterator>
+tnn::tensor<> load_sample(Iterator first, Iterator last, tnn::thread_pool &threads) {
+    image_batch images = decode_images(first, last, threads);
+    return preprocess_images(images, threads);
+}
+
 tnn::tensor<> load_raw_features(const char *filename) {
     std::ifstream in(filename, std::ios::in | std::ios::ate | std::ios::binary);
     if (!in) {
@@ -0,0 +1,158 @@
+#ifndef ALIGNED_ALLOCATOR_H
+#define ALIGNED_ALLOCATOR_H
+
+#include <new>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+#include <sys/mman.h>
+
+namespace tnn {
+
+    namespace memory {
+        // Backing of allocations of at least huge_page_size bytes; smaller ones always use normal pages.
+        // transparent: 2 MB aligned and advised for transparent huge pages (MADV_HUGEPAGE).
+        // hugetlb: taken from the reserved huge pages (MAP_HUGETLB), transparent if none are left.
+        enum huge_pages { none, transparent, hugetlb };
+
+        const std::size_t huge_page_size = 2 << 20;
+
+        inline std::atomic<int> &huge_page_policy() {
+            static std::atomic<int> policy(none);
+            return policy;
+        }
+
+        // Applies to allocations made from now on. Meant to be called before the model is loaded.
+        inline void set_huge_pages(huge_pages policy) {
+            huge_page_policy().store(policy, std::memory_order_relaxed);
+        }
+
+        inline huge_pages current_huge_pages() {
+            return static_cast<huge_pages>(huge_page_policy().load(std::memory_order_relaxed));
+        }
+
+        inline const char *name(huge_pages policy) {
+            const char *names[] = {"none", "transparent", "hugetlb"};
+            return names[policy];
+        }
+
+        inline bool parse(const char *text, huge_pages &policy) {
+            for (int i = none; i <= hugetlb; ++i)
+                if (std::strcmp(text, name(static_cast<huge_pages>(i))) == 0) {
+                    policy = static_cast<huge_pages>(i);
+                    return true;
+                }
+            return false;
+        }
+
+        inline bool aligned(const void *p, std::size_t alignment) {
+            return reinterpret_cast<std::uintptr_t>(p) % alignment == 0;
+        }
+
+        // Every block starts with a header, one alignment unit long, saying how to free it.
+        struct header {
+            void *base;
+            std::size_t length;
+            bool mapped;
+        };
+
+        // Returns `bytes` bytes aligned to `alignment`, a power of two of at least sizeof(header), or nullptr.
+        inline void *allocate(std::size_t bytes, std::size_t alignment) {
+            std::size_t total = bytes + alignment;
+            huge_pages policy = bytes >= huge_page_size ? current_huge_pages() : none;
+            header h {nullptr, total, false};
+            if (policy != none)
+                h.length = total = (total + huge_page_size - 1) / huge_page_size * huge_page_size;
+#ifdef MAP_HUGETLB
+            if (policy == hugetlb) {
+                void *address = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+                if (address != MAP_FAILED) {
+                    h.base = address;
+                    h.mapped = true;
+                }
+            }
+#endif
+            if (!h.base && posix_memalign(&h.base, policy != none ? huge_page_size : alignment, total) != 0)
+                return nullptr;
+#ifdef MADV_HUGEPAGE
+            if (policy != none && !h.mapped)
+                madvise(h.base, total, MADV_HUGEPAGE);
+#endif
+            char *p = static_cast<char *>(h.base) + alignment;
+            *reinterpret_cast<header *>(p - sizeof(header)) = h;
+            return p;
+        }
+
+        inline void deallocate(void *p) {
+            if (!p)
+                return;
+            header h = *reinterpret_cast<header *>(static_cast<char *>(p) - sizeof(header));
+            if (h.mapped)
+                munmap(h.base, h.length);
+            else
+                std::free(h.base);
+        }
+    }
+
+    // Allocator of Alignment-byte aligned memory, 64 by default: a cache line, and an AVX-512 register. Large
+    // buffers such as weights and activations get huge pages if memory::set_huge_pages() asks for them.
+    template<typename T, std::size_t Alignment = 64>
+    class aligned_allocator {
+        static_assert(Alignment >= sizeof(memory::header) && (Alignment & (Alignment - 1)) == 0,
+                      "alignment must be a power of two large enough for the header");
+    public:
+        typedef T value_type;
+        typedef T *pointer;
+        typedef const T *const_pointer;
+        typedef T &reference;
+        typedef const T &const_reference;
+        typedef std::size_t size_type;
+        typedef std::ptrdiff_t difference_type;
+        template<typename V>
+        struct rebind {
+            typedef aligned_allocator<V, Alignment> other;
+        };
+        static const std::size_t alignment = Alignment;
+
+        aligned_allocator() {}
+        template<typename V>
+        aligned_allocator(const aligned_allocator<V, Alignment> &) {}
+        T *allocate(std::size_t n) {
+            void *p = memory::allocate(n * sizeof(T), Alignment);
+            if (!p)
+                throw std::bad_alloc();
+            return static_cast<T *>(p);
+        }
+        void deallocate(T *p, std::size_t) {
+            memory::deallocate(p);
+        }
+    };
+
+    template<typename T, typename V, std::size_t Alignment>
+    bool operator==(const aligned_allocator<T, Alignment> &, const aligned_allocator<V, Alignment> &) {
+        return true;
+    }
+    template<typename T, typename V, std::size_t Alignment>
+    bool operator!=(const aligned_allocator<T, Alignment> &, const aligned_allocator<V, Alignment> &) {
+        return false;
+    }
+
+    // Alignment guaranteed for memory from an allocator: that of any scalar type, unless it says otherwise.
+    template<typename Allocator>
+    struct allocator_alignment {
+        static const std::size_t value = alignof(std::max_align_t);
+    };
+    template<typename T, std::size_t Alignment>
+    struct allocator_alignment<aligned_allocator<T, Alignment> > {
+        static const std::size_t value = Alignment;
+    };
+
+    // Vectors for packed operands and scratch buffers of kernels, whose SIMD loads may then be aligned.
+    template<typename T>
+    using aligned_vector = std::vector<T, aligned_allocator<T> >;
+}
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef CALIBRATION_H
+#define CALIBRATION_H
+
+#include <map>
+#include <limits>
+#include <algorithm>
+
+#include "layers/layer.h"
+#include "layers/conv2d.h"
+#include "layers/linear.h"
+#include "qgemm.h"
+
+namespace tnn {
+
+    // Post-training INT8 quantization of the conv2d and linear layers of a network. Forward passes through the
+    // calibrator run in float and record the range of the inputs of these layers over a sample of inputs.
+    // apply() then quantizes each of them for the range it has seen.
+    template <typename U = float, typename Allocator = aligned_allocator<U> >
+    class calibrator {
+    public:
+        typedef layer<U, Allocator> layer_type;
+        typedef typename layer_type::tensor_type tensor_type;
+        typedef typename layer_type::workspace_type workspace_type;
+        explicit calibrator(std::shared_ptr<layer_type> network) : m_network(std::move(network)), m_samples(0) {}
+        tensor_type forward(tensor_type &&x, thread_pool &threads, workspace_type &ws) {
+            m_samples += x.shape(0);
+            return forward(*m_network, std::move(x), threads, ws);
+        }
+        void apply() {
+            for (typename std::map<layer_type *, bounds>::iterator it = m_bounds.begin(); it != m_bounds.end(); ++it) {
+                qgemm::range range = qgemm::range::from_bounds(it->second.min, it->second.max);
+                if (conv2d<U, Allocator> *conv = dynamic_cast<conv2d<U, Allocator> *>(it->first))
+                    conv->quantize(range);
+                else if (linear<U, Allocator> *fc = dynamic_cast<linear<U, Allocator> *>(it->first))
+                    fc->quantize(range);
+            }
+        }
+        // Number of inputs seen so far.
+        std::size_t samples() const {
+            return m_samples;
+        }
+        // Weights of the quantizable layers in float and after apply(), in bytes.
+        std::size_t float_bytes() const {
+            std::size_t bytes = 0;
+            for (typename std::map<layer_type *, bounds>::const_iterator it = m_bounds.begin(); it != m_bounds.end(); ++it) {
+                std::vector<tensor_type *> tensors = it->first->parameters();
+                for (std::size_t i = 0; i < tensors.size(); ++i)
+                    bytes += tensors[i]->size() * sizeof(U);
+            }
+            return bytes;
+        }
+        std::size_t quantized_bytes() const {
+            std::size_t bytes = 0;
+            for (typename std::map<layer_type *, bounds>::const_iterator it = m_bounds.begin(); it != m_bounds.end(); ++it) {
+                if (conv2d<U, Allocator> *conv = dynamic_cast<conv2d<U, Allocator> *>(it->first))
+                    bytes += conv->quantized_bytes();
+                else if (linear<U, Allocator> *fc = dynamic_cast<linear<U, Allocator> *>(it->first))
+                    bytes += fc->quantized_bytes();
+            }
+            return bytes;
+        }
+    private:
+        struct bounds {
+            bounds() : min(std::numeric_limits<float>::max()), max(std::numeric_limits<float>::lowest()) {}
+            float min, max;
+        };
+        tensor_type forward(layer_type &l, tensor_type &&x, thread_pool &threads, workspace_type &ws) {
+            if (layers<U, Allocator> *sequence = dynamic_cast<layers<U, Allocator> *>(&l)) {
+                for (std::size_t i = 0; i < sequence->get_layers().size(); ++i)
+                    x = forward(*sequence->get_layers()[i], std::move(x), threads, ws);
+                return std::move(x);
+            }
+            if (dynamic_cast<conv2d<U, Allocator> *>(&l) || dynamic_cast<linear<U, Allocator> *>(&l)) {
+                bounds &b = m_bounds[&l];
+                std::pair<const U *, const U *> range = std::minmax_element(x.get_raw(), x.get_raw() + x.size());
+                b.min = std::min<float>(b.min, *range.first);
+                b.max = std::max<float>(b.max, *range.second);
+            }
+            return l.forward(std::move(x), threads, ws);
+        }
+        std::shared_ptr<layer_type> m_network;
+        std::map<layer_type *, bounds> m_bounds;
+        std::size_t m_samples;
+    };
+
+}
+
+#endif
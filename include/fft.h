@@ -0,0 +1,239 @@
+#ifndef FFT_H
+#define FFT_H
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <cassert>
+#include <type_traits>
+
+#include "aligned_allocator.h"
+#include "simd.h"
+
+namespace tnn {
+    namespace fft {
+        // Largest tile transformed, and the tile for a kernel: the smallest power of two at least four times the
+        // kernel, so that the windows overlapping the next tile are at most a quarter of the tile.
+        const std::size_t max_size = 64;
+
+        inline std::size_t tile_size(std::size_t kernel) {
+            std::size_t n = 2;
+            while (n < 4 * kernel)
+                n *= 2;
+            return n;
+        }
+
+        // Radix-2 discrete Fourier transforms of n points and of n x n real tiles, n a power of two, `lanes` at a
+        // time: element p of lane l at x[p * lanes + l], so that the innermost loops run over the lanes and
+        // vectorize. The spectrum of a real tile is Hermitian, so only its columns [0, n / 2] are kept:
+        // n * (n / 2 + 1) bins, bin (r, c) at r * (n / 2 + 1) + c. Like Winograd tiles, spectra are stored
+        // element-major, bin b of lane l at out[b * stride + l], real and imaginary parts in separate arrays.
+        template<typename U>
+        class transform {
+        public:
+            explicit transform(std::size_t n = 0) : m_n(n), m_cos(n / 2), m_sin(n / 2), m_reverse(n) {
+                assert(n <= max_size && (n & (n - 1)) == 0);
+                for (std::size_t i = 0; i < n / 2; ++i) {
+                    double angle = 2 * M_PI * i / n;
+                    m_cos[i] = std::cos(angle);
+                    m_sin[i] = std::sin(angle);
+                }
+                for (std::size_t i = 0, j = 0; i < n; ++i) {
+                    m_reverse[i] = j;
+                    std::size_t bit = n >> 1;
+                    for (; bit && (j & bit); bit >>= 1)
+                        j ^= bit;
+                    j |= bit;
+                }
+            }
+            std::size_t size() const {
+                return m_n;
+            }
+            std::size_t bins() const {
+                return m_n * (m_n / 2 + 1);
+            }
+            // In place, of re[i * stride + l] + i im[i * stride + l], i < n, l < lanes. The inverse is not divided
+            // by n.
+            void complex(U *re, U *im, std::size_t stride, std::size_t lanes, bool inverse) const {
+                std::size_t n = m_n;
+                for (std::size_t i = 0; i < n; ++i)
+                    if (i < m_reverse[i])
+                        for (std::size_t l = 0; l < lanes; ++l) {
+                            std::swap(re[i * stride + l], re[m_reverse[i] * stride + l]);
+                            std::swap(im[i * stride + l], im[m_reverse[i] * stride + l]);
+                        }
+                U sign = inverse ? 1 : -1;
+                butterfly_type butterfly = butterflies();
+                for (std::size_t length = 2; length <= n; length *= 2) {
+                    std::size_t half = length / 2, step = n / length;
+                    for (std::size_t i = 0; i < n; i += length)
+                        for (std::size_t j = 0; j < half; ++j) {
+                            U *ar = re + (i + j) * stride, *ai = im + (i + j) * stride;
+                            butterfly(ar, ai, ar + half * stride, ai + half * stride, m_cos[j * step],
+                                      sign * m_sin[j * step], lanes);
+                        }
+                }
+            }
+            // Spectra of the n x n tiles x. Two rows at a time go through one complex transform, as its real and
+            // imaginary parts, and are told apart by symmetry; then the kept columns are transformed.
+            void forward_real(const U *x, std::size_t lanes, U *re, U *im, std::size_t stride) const {
+                std::size_t n = m_n, h = n / 2 + 1;
+                aligned_vector<U> &buffer = scratch();
+                buffer.resize(std::max(buffer.size(), 2 * (n * h + n) * lanes));
+                U *tr = &buffer[0], *ti = tr + n * h * lanes, *zr = ti + n * h * lanes, *zi = zr + n * lanes;
+                for (std::size_t r = 0; r < n; r += 2) {
+                    std::copy(x + r * n * lanes, x + (r + 1) * n * lanes, zr);
+                    std::copy(x + (r + 1) * n * lanes, x + (r + 2) * n * lanes, zi);
+                    complex(zr, zi, lanes, lanes, false);
+                    for (std::size_t c = 0; c < h; ++c) {
+                        const U *ar = zr + c * lanes, *ai = zi + c * lanes, *br = zr + (n - c) % n * lanes,
+                                *bi = zi + (n - c) % n * lanes;
+                        U *r0 = tr + (r * h + c) * lanes, *i0 = ti + (r * h + c) * lanes,
+                          *r1 = tr + ((r + 1) * h + c) * lanes, *i1 = ti + ((r + 1) * h + c) * lanes;
+                        for (std::size_t l = 0; l < lanes; ++l) {
+                            r0[l] = (ar[l] + br[l]) / 2;
+                            i0[l] = (ai[l] - bi[l]) / 2;
+                            r1[l] = (ai[l] + bi[l]) / 2;
+                            i1[l] = (br[l] - ar[l]) / 2;
+                        }
+                    }
+                }
+                for (std::size_t c = 0; c < h; ++c)
+                    complex(tr + c * lanes, ti + c * lanes, h * lanes, lanes, false);
+                for (std::size_t b = 0; b < n * h; ++b) {
+                    std::copy(tr + b * lanes, tr + (b + 1) * lanes, re + b * stride);
+                    std::copy(ti + b * lanes, ti + (b + 1) * lanes, im + b * stride);
+                }
+            }
+            // The n x n tiles y of spectra, divided by n * n: the inverse of forward_real().
+            void inverse_real(const U *re, const U *im, std::size_t stride, std::size_t lanes, U *y) const {
+                std::size_t n = m_n, h = n / 2 + 1;
+                aligned_vector<U> &buffer = scratch();
+                buffer.resize(std::max(buffer.size(), 2 * (n * h + n) * lanes));
+                U *tr = &buffer[0], *ti = tr + n * h * lanes, *zr = ti + n * h * lanes, *zi = zr + n * lanes;
+                for (std::size_t b = 0; b < n * h; ++b) {
+                    std::copy(re + b * stride, re + b * stride + lanes, tr + b * lanes);
+                    std::copy(im + b * stride, im + b * stride + lanes, ti + b * lanes);
+                }
+                for (std::size_t c = 0; c < h; ++c)
+                    complex(tr + c * lanes, ti + c * lanes, h * lanes, lanes, true);
+                U scale = U(1) / (n * n);
+                for (std::size_t r = 0; r < n; r += 2) {
+                    // Row r + i row r + 1, the columns past n / 2 being the conjugates of those before.
+                    for (std::size_t c = 0; c < n; ++c) {
+                        std::size_t k = c < h ? c : n - c;
+                        U sign = c < h ? 1 : -1;
+                        const U *ar = tr + (r * h + k) * lanes, *ai = ti + (r * h + k) * lanes,
+                                *br = tr + ((r + 1) * h + k) * lanes, *bi = ti + ((r + 1) * h + k) * lanes;
+                        U *dr = zr + c * lanes, *di = zi + c * lanes;
+                        for (std::size_t l = 0; l < lanes; ++l) {
+                            dr[l] = ar[l] - sign * bi[l];
+                            di[l] = sign * ai[l] + br[l];
+                        }
+                    }
+                    complex(zr, zi, lanes, lanes, true);
+                    for (std::size_t p = 0; p < n * lanes; ++p) {
+                        y[r * n * lanes + p] = zr[p] * scale;
+                        y[(r + 1) * n * lanes + p] = zi[p] * scale;
+                    }
+                }
+            }
+        private:
+            // a, b = a + w b, a - w b in every lane.
+            typedef void (*butterfly_type)(U *, U *, U *, U *, U, U, std::size_t);
+
+            template<typename T = U>
+            static typename std::enable_if<!std::is_same<T, float>::value, butterfly_type>::type butterflies() {
+                return butterfly_scalar;
+            }
+            template<typename T = U>
+            static typename std::enable_if<std::is_same<T, float>::value, butterfly_type>::type butterflies() {
+#if TNN_X86
+                switch (simd::current()) {
+                    case simd::avx512: return butterfly_avx512;
+                    case simd::avx2: return butterfly_avx2;
+                    case simd::sse41: return butterfly_sse41;
+                    default: break;
+                }
+#endif
+                return butterfly_scalar;
+            }
+
+            static void butterfly_scalar(U *ar, U *ai, U *br, U *bi, U wr, U wi, std::size_t lanes) {
+                for (std::size_t l = 0; l < lanes; ++l) {
+                    U tr = br[l] * wr - bi[l] * wi, ti = br[l] * wi + bi[l] * wr;
+                    br[l] = ar[l] - tr;
+                    bi[l] = ai[l] - ti;
+                    ar[l] += tr;
+                    ai[l] += ti;
+                }
+            }
+#if TNN_X86
+            TNN_TARGET_SSE41 static void butterfly_sse41(float *ar, float *ai, float *br, float *bi, float wr, float wi,
+                                                         std::size_t lanes) {
+                __m128 vr = _mm_set1_ps(wr), vi = _mm_set1_ps(wi);
+                std::size_t l = 0;
+                for (; l + 4 <= lanes; l += 4) {
+                    __m128 xr = _mm_loadu_ps(br + l), xi = _mm_loadu_ps(bi + l), yr = _mm_loadu_ps(ar + l),
+                           yi = _mm_loadu_ps(ai + l);
+                    __m128 tr = _mm_sub_ps(_mm_mul_ps(xr, vr), _mm_mul_ps(xi, vi)),
+                           ti = _mm_add_ps(_mm_mul_ps(xr, vi), _mm_mul_ps(xi, vr));
+                    _mm_storeu_ps(br + l, _mm_sub_ps(yr, tr));
+                    _mm_storeu_ps(bi + l, _mm_sub_ps(yi, ti));
+                    _mm_storeu_ps(ar + l, _mm_add_ps(yr, tr));
+                    _mm_storeu_ps(ai + l, _mm_add_ps(yi, ti));
+                }
+                butterfly_scalar(ar + l, ai + l, br + l, bi + l, wr, wi, lanes - l);
+            }
+            TNN_TARGET_AVX2 static void butterfly_avx2(float *ar, float *ai, float *br, float *bi, float wr, float wi,
+                                                       std::size_t lanes) {
+                __m256 vr = _mm256_set1_ps(wr), vi = _mm256_set1_ps(wi);
+                std::size_t l = 0;
+                for (; l + 8 <= lanes; l += 8) {
+                    __m256 xr = _mm256_loadu_ps(br + l), xi = _mm256_loadu_ps(bi + l), yr = _mm256_loadu_ps(ar + l),
+                           yi = _mm256_loadu_ps(ai + l);
+                    __m256 tr = _mm256_fmsub_ps(xr, vr, _mm256_mul_ps(xi, vi)),
+                           ti = _mm256_fmadd_ps(xr, vi, _mm256_mul_ps(xi, vr));
+                    _mm256_storeu_ps(br + l, _mm256_sub_ps(yr, tr));
+                    _mm256_storeu_ps(bi + l, _mm256_sub_ps(yi, ti));
+                    _mm256_storeu_ps(ar + l, _mm256_add_ps(yr, tr));
+                    _mm256_storeu_ps(ai + l, _mm256_add_ps(yi, ti));
+                }
+                butterfly_scalar(ar + l, ai + l, br + l, bi + l, wr, wi, lanes - l);
+            }
+            TNN_TARGET_AVX512 static void butterfly_avx512(float *ar, float *ai, float *br, float *bi, float wr, float wi,
+                                                           std::size_t lanes) {
+                __m512 vr = _mm512_set1_ps(wr), vi = _mm512_set1_ps(wi);
+                for (std::size_t l = 0; l < lanes; l += 16) {
+                    __mmask16 mask = simd::mask16(lanes - l);
+                    __m512 xr = _mm512_maskz_loadu_ps(mask, br + l), xi = _mm512_maskz_loadu_ps(mask, bi + l),
+                           yr = _mm512_maskz_loadu_ps(mask, ar + l), yi = _mm512_maskz_loadu_ps(mask, ai + l);
+                    __m512 tr = _mm512_fmsub_ps(xr, vr, _mm512_mul_ps(xi, vi)),
+                           ti = _mm512_fmadd_ps(xr, vi, _mm512_mul_ps(xi, vr));
+                    _mm512_mask_storeu_ps(br + l, mask, _mm512_sub_ps(yr, tr));
+                    _mm512_mask_storeu_ps(bi + l, mask, _mm512_sub_ps(yi, ti));
+                    _mm512_mask_storeu_ps(ar + l, mask, _mm512_add_ps(yr, tr));
+                    _mm512_mask_storeu_ps(ai + l, mask, _mm512_add_ps(yi, ti));
+                }
+            }
+#endif
+
+            static aligned_vector<U> &scratch() {
+                static thread_local aligned_vector<U> buffer;
+                return buffer;
+            }
+
+            std::size_t m_n;
+            std::vector<U> m_cos, m_sin;
+            std::vector<std::size_t> m_reverse;
+        };
+
+        template<typename U>
+        aligned_vector<U> &thread_buffer(std::size_t i) {
+            static thread_local aligned_vector<U> buffers[4];
+            return buffers[i];
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,159 @@
+#ifndef FOLDING_H
+#define FOLDING_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <ostream>
+#include <algorithm>
+
+#include "workspace.h"
+#include "gemm.h"
+#include "layers/layer.h"
+#include "layers/bias.h"
+#include "layers/linear.h"
+#include "layers/reshape.h"
+
+namespace tnn {
+
+    // A rewrite made by fold(): the layers it replaced, by type and index in their chain, and the layer that took
+    // their place, nothing if they were removed.
+    struct rewrite {
+        std::string from, to;
+    };
+
+    inline std::ostream &operator<<(std::ostream &out, const rewrite &r) {
+        return out << r.from << " -> " << (r.to.empty() ? "removed" : r.to);
+    }
+
+    namespace folding {
+        template <typename U, typename Allocator>
+        std::shared_ptr<linear<U, Allocator> > make_linear(std::size_t in, std::size_t out, const U *weight,
+                                                           const std::vector<double> &bias, bool relu) {
+            std::shared_ptr<linear<U, Allocator> > result = std::make_shared<linear<U, Allocator> >(in, out, true);
+            std::vector<tensor<U, Allocator> *> tensors = result->parameters();
+            std::copy(weight, weight + in * out, tensors[0]->get_raw());
+            std::copy(bias.begin(), bias.end(), tensors[1]->get_raw());
+            result->prepare();
+            if (relu)
+                result->fuse_relu();
+            return result;
+        }
+
+        // Bias of a bias or linear layer, zeros if it has none.
+        template <typename U, typename Allocator>
+        std::vector<double> bias_of(layer<U, Allocator> &l, std::size_t features) {
+            std::vector<tensor<U, Allocator> *> tensors = l.parameters();
+            const tensor<U, Allocator> *b = dynamic_cast<bias<U, Allocator> *>(&l) ? tensors[0]
+                                            : tensors.size() == 2 ? tensors[1] : nullptr;
+            return b ? std::vector<double>(b->get_raw(), b->get_raw() + features) : std::vector<double>(features);
+        }
+
+        // The layer computing `first` then `second`, or nullptr if they do not fold.
+        template <typename U, typename Allocator>
+        std::shared_ptr<layer<U, Allocator> > fold(layer<U, Allocator> &first, layer<U, Allocator> &second) {
+            typedef tensor<U, Allocator> tensor_type;
+            bias<U, Allocator> *b1 = dynamic_cast<bias<U, Allocator> *>(&first),
+                               *b2 = dynamic_cast<bias<U, Allocator> *>(&second);
+            linear<U, Allocator> *l1 = dynamic_cast<linear<U, Allocator> *>(&first),
+                                 *l2 = dynamic_cast<linear<U, Allocator> *>(&second);
+            if ((!b1 && !l1) || (!b2 && !l2) || (l1 && (l1->quantized() || l1->relu_fused())) || (l2 && l2->quantized()))
+                return nullptr;
+            const tensor_type &w1 = *first.parameters()[0], &w2 = *second.parameters()[0];
+            if (b1 && b2) {
+                std::vector<double> sum = bias_of(first, w1.size()), other = bias_of(second, w2.size());
+                std::shared_ptr<bias<U, Allocator> > result = std::make_shared<bias<U, Allocator> >(w1.size());
+                U *values = result->parameters()[0]->get_raw();
+                for (std::size_t i = 0; i < sum.size(); ++i)
+                    values[i] = sum[i] + other[i];
+                return result;
+            }
+            if (b2) {
+                // W x + c + b
+                std::vector<double> sum = bias_of(first, w1.shape(0)), other = bias_of(second, w2.size());
+                for (std::size_t i = 0; i < sum.size(); ++i)
+                    sum[i] += other[i];
+                return make_linear<U, Allocator>(w1.shape(1), w1.shape(0), w1.get_raw(), sum, false);
+            }
+            // W (x + b) + c = W x + (W b + c), and W (V x + b) + c = (W V) x + (W b + c), which is worth it only if
+            // W V is smaller than W and V.
+            std::size_t in = b1 ? w1.size() : w1.shape(1), middle = w2.shape(1), out = w2.shape(0);
+            if (l1 && in * out >= (in + out) * middle)
+                return nullptr;
+            std::vector<double> inner = bias_of(first, middle), sum = bias_of(second, out);
+            for (std::size_t j = 0; j < out; ++j)
+                for (std::size_t i = 0; i < middle; ++i)
+                    sum[j] += w2.at(j, i) * inner[i];
+            if (b1)
+                return make_linear<U, Allocator>(in, out, w2.get_raw(), sum, l2->relu_fused());
+            std::vector<U> weight(out * in);
+            gemm::multiply(out, in, middle, gemm::strided_operand<gemm::mr, U>(w2.get_raw(), middle, 1),
+                           gemm::strided_operand<gemm::nr, U>(w1.get_raw(), 1, in), &weight[0], in);
+            return make_linear<U, Allocator>(in, out, &weight[0], sum, l2->relu_fused());
+        }
+
+        // Folds the layers of `chain`, planning `x` through the layers kept, for the shapes reshapes see.
+        template <typename U, typename Allocator>
+        void fold(layers<U, Allocator> &chain, tensor<U, Allocator> &x, workspace<U, Allocator> &ws,
+                  std::vector<rewrite> &rewrites) {
+            std::vector<std::shared_ptr<layer<U, Allocator> > > &list = chain.get_layers(), result;
+            std::vector<std::string> names;
+            for (std::size_t i = 0; i < list.size(); ++i) {
+                std::string name = list[i]->type() + ("[" + std::to_string(i) + "]");
+                if (layers<U, Allocator> *nested = dynamic_cast<layers<U, Allocator> *>(list[i].get())) {
+                    fold(*nested, x, ws, rewrites);
+                    result.push_back(list[i]);
+                    names.push_back(name);
+                    continue;
+                }
+                if (reshape<U, Allocator> *r = dynamic_cast<reshape<U, Allocator> *>(list[i].get())) {
+                    bool next = i + 1 < list.size() && dynamic_cast<reshape<U, Allocator> *>(list[i + 1].get());
+                    if (next || (x.layout() == tensor_layout::nchw &&
+                                 std::vector<std::size_t>(x.shape().begin() + 1, x.shape().end()) == r->shape())) {
+                        rewrites.push_back(rewrite{name, ""});
+                        continue;
+                    }
+                }
+                std::shared_ptr<layer<U, Allocator> > folded = result.empty() ? nullptr : fold(*result.back(), *list[i]);
+                x = list[i]->plan(std::move(x), ws);
+                if (folded) {
+                    names.back() += " " + name;
+                    rewrites.push_back(rewrite{names.back(), folded->type()});
+                    result.back() = folded;
+                } else {
+                    result.push_back(list[i]);
+                    names.push_back(name);
+                }
+            }
+            list.swap(result);
+        }
+    }
+
+    // Load-time rewrites of a chain of layers, and of the chains within it, into fewer layers computing the same
+    // function. Adjacent affine layers fold into one:
+    //
+    //   bias b, then linear (W, c)        -> linear (W, W b + c)
+    //   linear (V, c), then bias b        -> linear (V, c + b)
+    //   bias b, then bias d               -> bias b + d
+    //   linear (V, c), then linear (W, d) -> linear (W V, W c + d), where W V has fewer elements than W and V
+    //
+    // except after a layer with a relu fused or around a quantized one, so fold before fuse() and quantizing.
+    // Reshapes to the shape they are given and reshapes followed by another one are removed. `input` is the shape
+    // of one sample, without the batch. Outputs change only by rounding. Returns the rewrites made, in order.
+    template <typename U, typename Allocator>
+    std::vector<rewrite> fold(layer<U, Allocator> &network, const std::vector<std::size_t> &input) {
+        std::vector<rewrite> rewrites;
+        layers<U, Allocator> *chain = dynamic_cast<layers<U, Allocator> *>(&network);
+        if (!chain)
+            return rewrites;
+        std::vector<std::size_t> shape(1, 1);
+        shape.insert(shape.end(), input.begin(), input.end());
+        workspace<U, Allocator> ws;
+        tensor<U, Allocator> x = ws.acquire(shape);
+        folding::fold(*chain, x, ws, rewrites);
+        return rewrites;
+    }
+
+}
+
+#endif
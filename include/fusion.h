@@ -0,0 +1,47 @@
+#ifndef FUSION_H
+#define FUSION_H
+
+#include <vector>
+#include <memory>
+
+#include "layers/layer.h"
+#include "layers/relu.h"
+#include "layers/maxpool2d.h"
+
+namespace tnn {
+
+    // Rewrites a chain of layers, and the chains within it, so that a forward pass makes fewer passes over memory
+    // for the same outputs. A relu right after a layer that can fuse it (see layer::fuse_relu()), e.g. conv2d or
+    // linear, is applied by that layer as it stores its outputs. A relu right before a maxpool2d swaps places
+    // with it, which changes nothing since max and relu commute, and fuses into the pooling, which has fewer
+    // outputs. Returns the number of relus fused. The layers change in place, in all chains sharing them.
+    template <typename U, typename Allocator>
+    std::size_t fuse(layer<U, Allocator> &network) {
+        layers<U, Allocator> *sequence = dynamic_cast<layers<U, Allocator> *>(&network);
+        if (!sequence)
+            return 0;
+        std::vector<std::shared_ptr<layer<U, Allocator> > > &chain = sequence->get_layers(), result;
+        std::size_t fused = 0;
+        for (std::size_t i = 0; i < chain.size(); ++i) {
+            fused += fuse(*chain[i]);
+            if (dynamic_cast<relu<U, Allocator> *>(chain[i].get())) {
+                if (!result.empty() && result.back()->fuse_relu()) {
+                    ++fused;
+                    continue;
+                }
+                if (i + 1 < chain.size() && dynamic_cast<maxpool2d<U, Allocator> *>(chain[i + 1].get()) &&
+                    chain[i + 1]->fuse_relu()) {
+                    result.push_back(chain[++i]);
+                    ++fused;
+                    continue;
+                }
+            }
+            result.push_back(chain[i]);
+        }
+        chain.swap(result);
+        return fused;
+    }
+
+}
+
+#endif
@@ -0,0 +1,391 @@
+#ifndef GEMM_H
+#define GEMM_H
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <memory>
+#include <ostream>
+#include <cassert>
+#include <algorithm>
+#include <type_traits>
+
+#include "simd.h"
+#include "aligned_allocator.h"
+#include "mapped_file.h"
+#include "packed_cache.h"
+
+namespace tnn {
+    namespace gemm {
+        // C (m x n) = A (m x k) * B (k x n). The microkernel computes a mr x nr tile of C from a packed mr-row
+        // panel of A and a packed nr-column panel of B. A kc x nr sliver of B stays in L1 and a mc x kc block of
+        // A in L2 while the macro kernel sweeps over an nc wide block of B.
+        //
+        // Packed panels live in aligned_vector buffers, or 64-byte aligned in a mapped packed cache, and a row of a
+        // B panel is nr floats, 64 bytes, so the microkernels load B with aligned loads.
+        const std::size_t mr = 6, nr = 16, mc = 168, kc = 256, nc = 4080;
+
+        inline std::size_t round_up(std::size_t x, std::size_t m) {
+            return (x + m - 1) / m * m;
+        }
+
+        // Packs `rows` rows of depth `depth` into Panel-row panels. Element (i, p) is at data[i * rs + p * cs].
+        // Missing rows of the last panel are filled with zeros.
+        template<std::size_t Panel, typename U>
+        void pack(std::size_t rows, std::size_t depth, const U *data, std::size_t rs, std::size_t cs, U *dst) {
+            for (std::size_t i0 = 0; i0 < rows; i0 += Panel) {
+                std::size_t count = std::min(Panel, rows - i0);
+                for (std::size_t p = 0; p < depth; ++p) {
+                    const U *src = data + i0 * rs + p * cs;
+                    std::size_t i;
+                    for (i = 0; i < count; ++i)
+                        *dst++ = src[i * rs];
+                    for (; i < Panel; ++i)
+                        *dst++ = 0;
+                }
+            }
+        }
+
+        // Operand read through strides and packed on demand. For A the rows are the rows of the matrix, for B
+        // they are its columns.
+        template<std::size_t Panel, typename U>
+        class strided_operand {
+        public:
+            strided_operand(const U *data, std::size_t rs, std::size_t cs)
+                    : m_data(data), m_rs(rs), m_cs(cs) {}
+            const U *panels(std::size_t i0, std::size_t count, std::size_t p0, std::size_t depth, U *buffer) const {
+                pack<Panel>(count, depth, m_data + i0 * m_rs + p0 * m_cs, m_rs, m_cs, buffer);
+                return buffer;
+            }
+        private:
+            const U *m_data;
+            std::size_t m_rs, m_cs;
+        };
+
+        // Operand packed once, typically the weights of a layer. Every kc deep block is stored as consecutive
+        // panels, so the macro kernel can read them in place without repacking. The panels are either owned or,
+        // once mapped from a packed cache (see packed_cache.h), read in place from the mapping.
+        template<std::size_t Panel, typename U>
+        class packed_operand {
+        public:
+            packed_operand() : m_rows(0), m_depth(0), m_mapped(nullptr) {}
+            void pack(std::size_t rows, std::size_t depth, const U *data, std::size_t rs, std::size_t cs) {
+                m_rows = round_up(rows, Panel);
+                m_depth = depth;
+                m_mapped = nullptr;
+                m_owner.reset();
+                m_data.resize(m_rows * depth);
+                for (std::size_t p0 = 0; p0 < depth; p0 += kc)
+                    gemm::pack<Panel>(rows, std::min(kc, depth - p0), data + p0 * cs, rs, cs, &m_data[p0 * m_rows]);
+            }
+            const U *panels(std::size_t i0, std::size_t count, std::size_t p0, std::size_t depth, U *buffer) const {
+                return data() + p0 * m_rows + i0 * depth;
+            }
+            bool empty() const {
+                return !m_rows || !m_depth;
+            }
+            // The padded rows and the depth, then the panels at the next multiple of packed_cache::alignment.
+            void save(std::ostream &out) const {
+                std::uint64_t shape[2] = {m_rows, m_depth};
+                out.write(reinterpret_cast<const char *>(shape), sizeof(shape));
+                packed_cache::pad(out);
+                out.write(reinterpret_cast<const char *>(data()), sizeof(U) * m_rows * m_depth);
+            }
+            // Points the operand at what save() wrote for `rows` rows of depth `depth`. Returns false if `in` does
+            // not hold that.
+            bool map(mapped_file &in, std::size_t rows, std::size_t depth) {
+                std::uint64_t shape[2];
+                const char *header = in.read(sizeof(shape));
+                if (!header)
+                    return false;
+                std::memcpy(shape, header, sizeof(shape));
+                if (shape[0] != round_up(rows, Panel) || shape[1] != depth)
+                    return false;
+                in.align(packed_cache::alignment);
+                const char *panels = in.read(sizeof(U) * shape[0] * shape[1]);
+                if (!panels)
+                    return false;
+                m_rows = shape[0];
+                m_depth = depth;
+                m_data = aligned_vector<U>();
+                m_mapped = reinterpret_cast<const U *>(panels);
+                m_owner = in.owner();
+                return true;
+            }
+        private:
+            const U *data() const {
+                return m_mapped ? m_mapped : m_data.data();
+            }
+            std::size_t m_rows, m_depth;
+            aligned_vector<U> m_data;
+            const U *m_mapped;
+            std::shared_ptr<const void> m_owner;
+        };
+
+        // Rows [first, ...) of another operand; first must be a multiple of its panel size.
+        template<typename Operand>
+        class operand_slice {
+        public:
+            operand_slice(const Operand &operand, std::size_t first)
+                    : m_operand(operand), m_first(first) {}
+            template<typename U>
+            const U *panels(std::size_t i0, std::size_t count, std::size_t p0, std::size_t depth, U *buffer) const {
+                return m_operand.panels(m_first + i0, count, p0, depth, buffer);
+            }
+        private:
+            const Operand &m_operand;
+            std::size_t m_first;
+        };
+
+        template<typename U>
+        void micro_kernel_scalar(std::size_t k, const U *a, const U *b, U *c, std::size_t ldc, bool accumulate) {
+            U acc[mr][nr] = {};
+            for (std::size_t p = 0; p < k; ++p, a += mr, b += nr)
+                for (std::size_t i = 0; i < mr; ++i)
+                    for (std::size_t j = 0; j < nr; ++j)
+                        acc[i][j] += a[i] * b[j];
+            for (std::size_t i = 0; i < mr; ++i, c += ldc)
+                for (std::size_t j = 0; j < nr; ++j)
+                    c[j] = accumulate ? c[j] + acc[i][j] : acc[i][j];
+        }
+
+#if TNN_X86
+        // The tile as four 4-column quarters of 6 accumulators each, two quarters at a time.
+        TNN_TARGET_SSE41 inline void micro_kernel_sse41(std::size_t k, const float *a, const float *b, float *c,
+                                                       std::size_t ldc, bool accumulate) {
+            for (std::size_t half = 0; half < nr; half += 8) {
+                __m128 acc[mr][2];
+                for (std::size_t i = 0; i < mr; ++i)
+                    acc[i][0] = acc[i][1] = _mm_setzero_ps();
+                const float *ap = a, *bp = b + half;
+                for (std::size_t p = 0; p < k; ++p, ap += mr, bp += nr) {
+                    __m128 b0 = _mm_load_ps(bp), b1 = _mm_load_ps(bp + 4);
+                    for (std::size_t i = 0; i < mr; ++i) {
+                        __m128 ai = _mm_set1_ps(ap[i]);
+                        acc[i][0] = _mm_add_ps(acc[i][0], _mm_mul_ps(ai, b0));
+                        acc[i][1] = _mm_add_ps(acc[i][1], _mm_mul_ps(ai, b1));
+                    }
+                }
+                float *cp = c + half;
+                for (std::size_t i = 0; i < mr; ++i, cp += ldc) {
+                    if (accumulate) {
+                        acc[i][0] = _mm_add_ps(acc[i][0], _mm_loadu_ps(cp));
+                        acc[i][1] = _mm_add_ps(acc[i][1], _mm_loadu_ps(cp + 4));
+                    }
+                    _mm_storeu_ps(cp, acc[i][0]);
+                    _mm_storeu_ps(cp + 4, acc[i][1]);
+                }
+            }
+        }
+
+        TNN_TARGET_AVX2 inline void micro_kernel_avx2(std::size_t k, const float *a, const float *b, float *c,
+                                                     std::size_t ldc, bool accumulate) {
+            __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps(), c10 = _mm256_setzero_ps(),
+                   c11 = _mm256_setzero_ps(), c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps(),
+                   c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps(), c40 = _mm256_setzero_ps(),
+                   c41 = _mm256_setzero_ps(), c50 = _mm256_setzero_ps(), c51 = _mm256_setzero_ps();
+            for (std::size_t p = 0; p < k; ++p, a += mr, b += nr) {
+                __m256 b0 = _mm256_load_ps(b), b1 = _mm256_load_ps(b + 8), ai;
+                ai = _mm256_broadcast_ss(a + 0);
+                c00 = _mm256_fmadd_ps(ai, b0, c00);
+                c01 = _mm256_fmadd_ps(ai, b1, c01);
+                ai = _mm256_broadcast_ss(a + 1);
+                c10 = _mm256_fmadd_ps(ai, b0, c10);
+                c11 = _mm256_fmadd_ps(ai, b1, c11);
+                ai = _mm256_broadcast_ss(a + 2);
+                c20 = _mm256_fmadd_ps(ai, b0, c20);
+                c21 = _mm256_fmadd_ps(ai, b1, c21);
+                ai = _mm256_broadcast_ss(a + 3);
+                c30 = _mm256_fmadd_ps(ai, b0, c30);
+                c31 = _mm256_fmadd_ps(ai, b1, c31);
+                ai = _mm256_broadcast_ss(a + 4);
+                c40 = _mm256_fmadd_ps(ai, b0, c40);
+                c41 = _mm256_fmadd_ps(ai, b1, c41);
+                ai = _mm256_broadcast_ss(a + 5);
+                c50 = _mm256_fmadd_ps(ai, b0, c50);
+                c51 = _mm256_fmadd_ps(ai, b1, c51);
+            }
+            __m256 rows[mr][2] = {{c00, c01}, {c10, c11}, {c20, c21}, {c30, c31}, {c40, c41}, {c50, c51}};
+            for (std::size_t i = 0; i < mr; ++i, c += ldc) {
+                if (accumulate) {
+                    rows[i][0] = _mm256_add_ps(rows[i][0], _mm256_loadu_ps(c));
+                    rows[i][1] = _mm256_add_ps(rows[i][1], _mm256_loadu_ps(c + 8));
+                }
+                _mm256_storeu_ps(c, rows[i][0]);
+                _mm256_storeu_ps(c + 8, rows[i][1]);
+            }
+        }
+
+        // nr is exactly one zmm register, so a row of the tile is one accumulator. Even and odd steps of k go to
+        // accumulators of their own, which makes 12 independent chains to cover the latency of the FMAs.
+        TNN_TARGET_AVX512 inline void micro_kernel_avx512(std::size_t k, const float *a, const float *b, float *c,
+                                                         std::size_t ldc, bool accumulate) {
+            __m512 c0 = _mm512_setzero_ps(), c1 = _mm512_setzero_ps(), c2 = _mm512_setzero_ps(),
+                   c3 = _mm512_setzero_ps(), c4 = _mm512_setzero_ps(), c5 = _mm512_setzero_ps(),
+                   d0 = _mm512_setzero_ps(), d1 = _mm512_setzero_ps(), d2 = _mm512_setzero_ps(),
+                   d3 = _mm512_setzero_ps(), d4 = _mm512_setzero_ps(), d5 = _mm512_setzero_ps();
+            std::size_t p = 0;
+            for (; p + 2 <= k; p += 2, a += 2 * mr, b += 2 * nr) {
+                __m512 b0 = _mm512_load_ps(b), b1 = _mm512_load_ps(b + nr);
+                c0 = _mm512_fmadd_ps(_mm512_set1_ps(a[0]), b0, c0);
+                c1 = _mm512_fmadd_ps(_mm512_set1_ps(a[1]), b0, c1);
+                c2 = _mm512_fmadd_ps(_mm512_set1_ps(a[2]), b0, c2);
+                c3 = _mm512_fmadd_ps(_mm512_set1_ps(a[3]), b0, c3);
+                c4 = _mm512_fmadd_ps(_mm512_set1_ps(a[4]), b0, c4);
+                c5 = _mm512_fmadd_ps(_mm512_set1_ps(a[5]), b0, c5);
+                d0 = _mm512_fmadd_ps(_mm512_set1_ps(a[mr + 0]), b1, d0);
+                d1 = _mm512_fmadd_ps(_mm512_set1_ps(a[mr + 1]), b1, d1);
+                d2 = _mm512_fmadd_ps(_mm512_set1_ps(a[mr + 2]), b1, d2);
+                d3 = _mm512_fmadd_ps(_mm512_set1_ps(a[mr + 3]), b1, d3);
+                d4 = _mm512_fmadd_ps(_mm512_set1_ps(a[mr + 4]), b1, d4);
+                d5 = _mm512_fmadd_ps(_mm512_set1_ps(a[mr + 5]), b1, d5);
+            }
+            if (p < k) {
+                __m512 b0 = _mm512_load_ps(b);
+                c0 = _mm512_fmadd_ps(_mm512_set1_ps(a[0]), b0, c0);
+                c1 = _mm512_fmadd_ps(_mm512_set1_ps(a[1]), b0, c1);
+                c2 = _mm512_fmadd_ps(_mm512_set1_ps(a[2]), b0, c2);
+                c3 = _mm512_fmadd_ps(_mm512_set1_ps(a[3]), b0, c3);
+                c4 = _mm512_fmadd_ps(_mm512_set1_ps(a[4]), b0, c4);
+                c5 = _mm512_fmadd_ps(_mm512_set1_ps(a[5]), b0, c5);
+            }
+            __m512 rows[mr] = {_mm512_add_ps(c0, d0), _mm512_add_ps(c1, d1), _mm512_add_ps(c2, d2),
+                               _mm512_add_ps(c3, d3), _mm512_add_ps(c4, d4), _mm512_add_ps(c5, d5)};
+            for (std::size_t i = 0; i < mr; ++i, c += ldc)
+                _mm512_storeu_ps(c, accumulate ? _mm512_add_ps(rows[i], _mm512_loadu_ps(c)) : rows[i]);
+        }
+
+        // Only the first Rows rows of the tile, and of each row the columns in the mask. Loads and stores of C
+        // are masked, so the tile is written in place.
+        template<std::size_t Rows>
+        TNN_TARGET_AVX512 void edge_rows_avx512(std::size_t k, const float *a, const float *b, float *c,
+                                                std::size_t ldc, bool accumulate, __mmask16 columns) {
+            __m512 acc[Rows];
+            for (std::size_t i = 0; i < Rows; ++i)
+                acc[i] = _mm512_setzero_ps();
+            for (std::size_t p = 0; p < k; ++p, a += mr, b += nr) {
+                __m512 b0 = _mm512_load_ps(b);
+                for (std::size_t i = 0; i < Rows; ++i)
+                    acc[i] = _mm512_fmadd_ps(_mm512_set1_ps(a[i]), b0, acc[i]);
+            }
+            for (std::size_t i = 0; i < Rows; ++i, c += ldc) {
+                if (accumulate)
+                    acc[i] = _mm512_add_ps(acc[i], _mm512_maskz_loadu_ps(columns, c));
+                _mm512_mask_storeu_ps(c, columns, acc[i]);
+            }
+        }
+
+        TNN_TARGET_AVX512 inline void edge_kernel_avx512(std::size_t rows, std::size_t cols, std::size_t k,
+                                                        const float *a, const float *b, float *c, std::size_t ldc,
+                                                        bool accumulate) {
+            __mmask16 columns = simd::mask16(cols);
+            switch (rows) {
+                case 1: edge_rows_avx512<1>(k, a, b, c, ldc, accumulate, columns); break;
+                case 2: edge_rows_avx512<2>(k, a, b, c, ldc, accumulate, columns); break;
+                case 3: edge_rows_avx512<3>(k, a, b, c, ldc, accumulate, columns); break;
+                case 4: edge_rows_avx512<4>(k, a, b, c, ldc, accumulate, columns); break;
+                case 5: edge_rows_avx512<5>(k, a, b, c, ldc, accumulate, columns); break;
+                default: edge_rows_avx512<mr>(k, a, b, c, ldc, accumulate, columns); break;
+            }
+        }
+#endif
+
+        // Computes a full mr x nr tile of C, see micro_kernel_scalar(). An edge kernel computes the first rows x
+        // cols of a tile at the edges of C. Without one, the full tile is computed into a buffer and copied.
+        template<typename U>
+        struct kernel {
+            typedef void (*type)(std::size_t k, const U *a, const U *b, U *c, std::size_t ldc, bool accumulate);
+            typedef void (*edge_type)(std::size_t rows, std::size_t cols, std::size_t k, const U *a, const U *b, U *c,
+                                      std::size_t ldc, bool accumulate);
+        };
+
+        // The microkernel of the SIMD path in use. Only float has SIMD ones.
+        template<typename U>
+        typename kernel<U>::type micro_kernel() {
+            return micro_kernel_scalar<U>;
+        }
+
+        template<>
+        inline kernel<float>::type micro_kernel<float>() {
+#if TNN_X86
+            switch (simd::current()) {
+                case simd::avx512: return micro_kernel_avx512;
+                case simd::avx2: return micro_kernel_avx2;
+                case simd::sse41: return micro_kernel_sse41;
+                default: break;
+            }
+#endif
+            return micro_kernel_scalar<float>;
+        }
+
+        template<typename U>
+        typename kernel<U>::edge_type edge_kernel() {
+            return nullptr;
+        }
+
+        template<>
+        inline kernel<float>::edge_type edge_kernel<float>() {
+#if TNN_X86
+            if (simd::current() == simd::avx512)
+                return edge_kernel_avx512;
+#endif
+            return nullptr;
+        }
+
+        template<typename U>
+        void macro_kernel(typename kernel<U>::type micro, typename kernel<U>::edge_type edge, std::size_t m,
+                          std::size_t n, std::size_t k, const U *a, const U *b, U *c, std::size_t ldc, bool accumulate) {
+            U tile[mr * nr];
+            for (std::size_t j = 0; j < n; j += nr) {
+                std::size_t cols = std::min(nr, n - j);
+                for (std::size_t i = 0; i < m; i += mr) {
+                    std::size_t rows = std::min(mr, m - i);
+                    if (rows == mr && cols == nr)
+                        micro(k, a + i * k, b + j * k, c + i * ldc + j, ldc, accumulate);
+                    else if (edge)
+                        edge(rows, cols, k, a + i * k, b + j * k, c + i * ldc + j, ldc, accumulate);
+                    else {
+                        micro(k, a + i * k, b + j * k, tile, nr, false);
+                        for (std::size_t r = 0; r < rows; ++r)
+                            for (std::size_t s = 0; s < cols; ++s)
+                                c[(i + r) * ldc + j + s] = accumulate ? c[(i + r) * ldc + j + s] + tile[r * nr + s]
+                                                                      : tile[r * nr + s];
+                    }
+                }
+            }
+        }
+
+        template<typename U>
+        aligned_vector<U> &thread_buffer(std::size_t i) {
+            static thread_local aligned_vector<U> buffers[2];
+            return buffers[i];
+        }
+
+        // C = A * B, or C += A * B if `accumulate`. A is any operand with mr-row panels and B any operand with
+        // nr-column panels, e.g. strided_operand<mr>/packed_operand<nr>. Runs on the calling thread.
+        template<typename U, typename OperandA, typename OperandB>
+        void multiply(std::size_t m, std::size_t n, std::size_t k, const OperandA &a, const OperandB &b,
+                      U *c, std::size_t ldc, bool accumulate = false) {
+            typename kernel<U>::type micro = micro_kernel<U>();
+            typename kernel<U>::edge_type edge = edge_kernel<U>();
+            aligned_vector<U> &buffer_a = thread_buffer<U>(0), &buffer_b = thread_buffer<U>(1);
+            buffer_a.resize(std::max(buffer_a.size(), round_up(std::min(mc, m), mr) * std::min(kc, k)));
+            buffer_b.resize(std::max(buffer_b.size(), round_up(std::min(nc, n), nr) * std::min(kc, k)));
+            for (std::size_t jc = 0; jc < n; jc += nc) {
+                std::size_t nb = std::min(nc, n - jc);
+                for (std::size_t pc = 0; pc < k; pc += kc) {
+                    std::size_t kb = std::min(kc, k - pc);
+                    const U *bp = b.panels(jc, nb, pc, kb, &buffer_b[0]);
+                    assert(memory::aligned(bp, 64));
+                    for (std::size_t ic = 0; ic < m; ic += mc) {
+                        std::size_t mb = std::min(mc, m - ic);
+                        const U *ap = a.panels(ic, mb, pc, kb, &buffer_a[0]);
+                        macro_kernel(micro, edge, mb, nb, kb, ap, bp, c + ic * ldc + jc, ldc, accumulate || pc != 0);
+                    }
+                }
+            }
+        }
+    }
+}
+
+#endif
@@ -1,40 +1,86 @@
 #ifndef BIAS_H
 #define BIAS_H
 
+#include <algorithm>
 #include <type_traits>
 
 #include "layer.h"
-#include "avx.h"
+#include "simd.h"
 
 namespace tnn {
-    template <typename U = float, typename Allocator = std::allocator<U> >
+    template <typename U = float, typename Allocator = aligned_allocator<U> >
     class bias: public layer<U, Allocator> {
     public:
         typedef typename layer<U, Allocator>::tensor_type tensor_type;
+        typedef typename layer<U, Allocator>::workspace_type workspace_type;
         bias(std::size_t features) : m_features(features), m_bias{features} {}
-        tensor_type forward(tensor_type &&x, thread_pool &threads) const {
+        tensor_type forward(tensor_type &&x, thread_pool &threads, workspace_type &ws) const {
             assert(x.ndim() == 2 && x.shape(1) == m_features);
-            std::size_t start = 0;
-            std::vector<std::future<void> > sync;
-            sync.reserve(threads.get_thread_num());
-            double step = (double) x.size() / threads.get_thread_num();
-            for (std::size_t i = 0; i < threads.get_thread_num(); ++i) {
-                std::size_t end = (int) (step * (i + 1) + 0.5);
-                if (start != end)
-                    sync.emplace_back(threads.enqueue([this, &x](std::size_t s, std::size_t e) {
-                        for (; s < e; ++s)
-                            x.at(s) += m_bias.at(s % m_features);
-                    }, start, end));
-                start = end;
-            }
-            for (std::size_t i = 0; i < sync.size(); ++i)
-                sync[i].get();
-            return x;
+            threads.parallel_for(0, x.size(), 1 << 14, [this, &x](std::size_t s, std::size_t e) {
+                // A piece of one row at a time.
+                while (s < e) {
+                    std::size_t first = s % m_features, count = std::min(e - s, m_features - first);
+                    single_bias(x.get_raw(s), m_bias.get_raw(first), count);
+                    s += count;
+                }
+            });
+            return std::move(x);
+        }
+        std::vector<tensor_type *> parameters() {
+            return {&m_bias};
         }
-        void load(std::istream &in) {
-            m_bias.load(in);
+        const char *type() const {
+            return "bias";
+        }
+        double flops(const std::vector<std::size_t> &input, const std::vector<std::size_t> &output) const {
+            return this->elements(output);
         }
     private:
+        template<typename T = U>
+        static typename std::enable_if<!std::is_same<T, float>::value>::type
+            single_bias(U *x, const U *bias, std::size_t n) {
+            bias_scalar(x, bias, n);
+        }
+        template<typename T = U>
+        static typename std::enable_if<std::is_same<T, float>::value>::type
+            single_bias(float *x, const float *bias, std::size_t n) {
+#if TNN_X86
+            switch (simd::current()) {
+                case simd::avx512: return bias_avx512(x, bias, n);
+                case simd::avx2: return bias_avx2(x, bias, n);
+                case simd::sse41: return bias_sse41(x, bias, n);
+                default: break;
+            }
+#endif
+            bias_scalar(x, bias, n);
+        }
+
+        static void bias_scalar(U *x, const U *bias, std::size_t n) {
+            for (std::size_t i = 0; i < n; ++i)
+                x[i] += bias[i];
+        }
+#if TNN_X86
+        TNN_TARGET_SSE41 static void bias_sse41(float *x, const float *bias, std::size_t n) {
+            std::size_t i = 0;
+            for (; i + 4 <= n; i += 4)
+                _mm_storeu_ps(x + i, _mm_add_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(bias + i)));
+            bias_scalar(x + i, bias + i, n - i);
+        }
+        TNN_TARGET_AVX2 static void bias_avx2(float *x, const float *bias, std::size_t n) {
+            std::size_t i = 0;
+            for (; i + 8 <= n; i += 8)
+                _mm256_storeu_ps(x + i, _mm256_add_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(bias + i)));
+            bias_scalar(x + i, bias + i, n - i);
+        }
+        TNN_TARGET_AVX512 static void bias_avx512(float *x, const float *bias, std::size_t n) {
+            for (std::size_t i = 0; i < n; i += 16) {
+                __mmask16 lanes = simd::mask16(n - i);
+                _mm512_mask_storeu_ps(x + i, lanes, _mm512_add_ps(_mm512_maskz_loadu_ps(lanes, x + i),
+                                                                  _mm512_maskz_loadu_ps(lanes, bias + i)));
+            }
+        }
+#endif
+
         std::size_t m_features;
         tensor_type m_bias;
     };
@@ -2,135 +2,1256 @@
 #define CONV2D_H
 
 #include <cstring>
+#include <algorithm>
 #include <type_traits>
 
 #include "layer.h"
-#include "avx.h"
+#include "simd.h"
+#include "tensor/layout.h"
+#include "gemm.h"
+#include "winograd.h"
+#include "fft.h"
+#include "window.h"
+#include "qgemm.h"
 
 namespace tnn {
-    template <typename U = float, typename Allocator = std::allocator<U> >
+    // direct: one output plane at a time with a sliding window.
+    // gemm: lowers each image to im2col panels and multiplies them with the packed weights.
+    // winograd: F(4x4, 3x3) for 3x3 kernels with stride 1.
+    // blocked: direct, from plain or channel blocked input to channel blocked output (see tensor_layout), a
+    // register tile of pixels times a vector of output channels at a time.
+    // space_to_depth: the input rearranged so that a convolution with stride s is one with stride 1 over s * s
+    // times the channels and a kernel s times smaller, e.g. 48 channels and 3x3 for 3 channels and 11x11 with
+    // stride 4, run in the automatic mode, i.e. winograd for that example. For the strided layers with few
+    // channels, which no other mode runs densely.
+    // fft: for stride 1, the input cut into overlapping tiles of fft::tile_size() pixels, whose spectra are
+    // multiplied with those of the kernels and summed over the input channels bin by bin, then transformed back.
+    // The spectra are (tile / kernel)^2 times the size of the weights and read once per block of 16 tiles, so the
+    // mode pays off for large kernels and large batches, e.g. conv2 of Alexnet from a batch of 8 (see bench).
+    // automatic: winograd where it applies, gemm otherwise.
+    // Independently of the mode, quantize() switches a layer to INT8 im2row + qgemm. All but the blocked mode
+    // take blocked input back to plain first.
+    enum class conv2d_mode { direct, gemm, winograd, blocked, space_to_depth, fft, automatic };
+
+    template <typename U = float, typename Allocator = aligned_allocator<U> >
     class conv2d: public layer<U, Allocator> {
     public:
         typedef typename layer<U, Allocator>::tensor_type tensor_type;
-        conv2d(std::size_t in_channels, std::size_t out_channels, std::size_t kernel_size, std::size_t stride = 1, std::size_t padding = 0, bool bias = true)
+        typedef typename layer<U, Allocator>::workspace_type workspace_type;
+        conv2d(std::size_t in_channels, std::size_t out_channels, std::size_t kernel_size, std::size_t stride = 1, std::size_t padding = 0, bool bias = true,
+               conv2d_mode mode = conv2d_mode::automatic)
                 : m_in_channels(in_channels), m_out_channels(out_channels), m_kernel_size(kernel_size), m_stride(stride),
-                  m_padding(padding), m_has_bias(bias), m_weight({out_channels, in_channels, kernel_size, kernel_size}) {
+                  m_padding(padding), m_has_bias(bias), m_quantized(false), m_relu(false),
+                  m_fixed_shape(fixed_shape(kernel_size, stride)),
+                  m_weight({out_channels, in_channels, kernel_size, kernel_size}) {
             if (bias)
                 m_bias.resize({out_channels});
-
+            set_mode(mode);
         }
-        tensor_type forward(tensor_type &&x, thread_pool &threads) const {
-            assert(x.ndim() == 4 && x.shape(1) == m_in_channels);
-            std::size_t n = x.shape(0), start = 0;
-            std::vector<std::future<void> > sync;
-            double step;
-            if (m_padding) {
-                sync.reserve(threads.get_thread_num());
-                tensor_type temp{n, x.shape(1), x.shape(2) + 2 * m_padding, x.shape(3) + 2 * m_padding};
-                step = (double) n * x.shape(1) * x.shape(2) / threads.get_thread_num();
-                for (std::size_t i = 0; i < threads.get_thread_num(); ++i) {
-                    std::size_t end = (int) (step * (i + 1) + 0.5);
-                    if (start != end)
-                        sync.emplace_back(threads.enqueue([this, &temp, &x](std::size_t s, std::size_t e) {
-                            for (std::size_t j = s; j < e; ++j) {
-                                std::size_t c = j / x.shape(2), h = j % x.shape(2);
-                                memcpy(temp.get_raw(c, h + m_padding, m_padding), x.get_raw(c, h, 0), x.shape(3) * sizeof(float));
-                            }
-                        }, start, end));
-                    start = end;
-                }
-                for (std::size_t i = 0; i < sync.size(); ++i)
-                    sync[i].get();
-                sync.clear();
-                start = 0;
+        tensor_type forward(tensor_type &&x, thread_pool &threads, workspace_type &ws) const {
+            assert(x.layout() == tensor_layout::nchw ? x.ndim() == 4 && x.shape(1) == m_in_channels
+                                                     : (x.shape(1) - 1) * x.shape(4) < m_in_channels &&
+                                                       x.shape(1) * x.shape(4) >= m_in_channels);
+            std::size_t n = x.shape(0);
+            if (x.layout() != tensor_layout::nchw && (m_quantized || m_mode != conv2d_mode::blocked)) {
+                tensor_type temp = plan_plain(x, ws);
+                threads.parallel_for(0, n * m_in_channels, 16, [&x, &temp](std::size_t s, std::size_t e) {
+                    layout::to_plain(x, temp, s, e);
+                });
                 x = std::move(temp);
             }
-            tensor_type y{n, m_out_channels, (x.shape(2) - m_kernel_size) / m_stride + 1,
-                          (x.shape(3) - m_kernel_size) / m_stride + 1};
-            sync.reserve(threads.get_thread_num());
-            step = (double) n * m_out_channels / threads.get_thread_num();
-            for (std::size_t i = 0; i < threads.get_thread_num(); ++i) {
-                std::size_t end = (int) (step * (i + 1) + 0.5);
-                sync.emplace_back(threads.enqueue([this, &x, &y](std::size_t s, std::size_t e) {
+            if (m_quantized) {
+                tensor_type q = plan_quantized(x, ws);
+                tensor_type y = plan_output(x, ws);
+                forward_int8(x, q, y, threads);
+                return y;
+            }
+            if (m_mode == conv2d_mode::space_to_depth) {
+                tensor_type temp = plan_space_to_depth(x, ws);
+                threads.parallel_for(0, temp.shape(0) * temp.shape(1), 1, [this, &x, &temp](std::size_t s, std::size_t e) {
                     for (std::size_t j = s; j < e; ++j)
-                        single_conv(x, y, j / m_out_channels, j % m_out_channels);
-                }, start, end));
-                start = end;
+                        single_space_to_depth(x, temp, j / temp.shape(1), j % temp.shape(1));
+                });
+                return m_space_to_depth->forward(std::move(temp), threads, ws);
+            }
+            tensor_type y = plan_output(x, ws);
+            if (m_mode == conv2d_mode::gemm) {
+                forward_gemm(x, y, threads);
+                return y;
+            }
+            if (m_mode == conv2d_mode::winograd) {
+                forward_winograd(x, y, threads);
+                return y;
+            }
+            if (m_mode == conv2d_mode::fft) {
+                forward_fft(x, y, threads);
+                return y;
+            }
+            if (m_mode == conv2d_mode::blocked) {
+                forward_blocked(x, y, threads);
+                return y;
             }
-            for (std::size_t i = 0; i < sync.size(); ++i)
-                sync[i].get();
+            threads.parallel_for(0, n * m_out_channels, 1, [this, &x, &y](std::size_t s, std::size_t e) {
+                for (std::size_t j = s; j < e; ++j)
+                    single_conv(x, y, j / m_out_channels, j % m_out_channels);
+            });
             return y;
         }
-        void load(std::istream &in) {
-            m_weight.load(in);
+        tensor_type plan(tensor_type &&x, workspace_type &ws) const {
+            if (x.layout() != tensor_layout::nchw && (m_quantized || m_mode != conv2d_mode::blocked))
+                x = plan_plain(x, ws);
+            if (m_mode == conv2d_mode::space_to_depth && !m_quantized)
+                return m_space_to_depth->plan(plan_space_to_depth(x, ws), ws);
+            tensor_type q = m_quantized ? plan_quantized(x, ws) : tensor_type();
+            return plan_output(x, ws);
+        }
+        std::vector<tensor_type *> parameters() {
             if (m_has_bias)
-                m_bias.load(in);
+                return {&m_weight, &m_bias};
+            return {&m_weight};
         }
-    private:
-#if AVX_ENABLED
-        template<bool ForceDisableAVX = false>
-        typename std::enable_if<std::is_same<U, float>::value && AVX_ENABLED && !ForceDisableAVX>::type
-            single_conv(const tensor_type &x, tensor_type &y, std::size_t i, std::size_t out) const {
-            std::size_t height = y.shape(2), width = y.shape(3);
-            for (std::size_t h = 0; h < height; ++h) {
-                std::size_t hs = m_stride * h, w;
-                for (w = 0; w + 7 < width; w += 8) {
-                    __m256 sum = _mm256_setzero_ps();
-                    std::size_t ws = m_stride * w;
+        const char *type() const {
+            return "conv2d";
+        }
+        // Those of the direct convolution, whatever the mode, so that the modes are comparable. Channels padding
+        // the last block of blocked outputs count as well.
+        double flops(const std::vector<std::size_t> &input, const std::vector<std::size_t> &output) const {
+            return (2 * m_in_channels * m_kernel_size * m_kernel_size + m_relu) * this->elements(output);
+        }
+        bool fuse_relu() {
+            m_relu = true;
+            if (m_space_to_depth)
+                m_space_to_depth->fuse_relu();
+            return true;
+        }
+        bool relu_fused() const {
+            return m_relu;
+        }
+        conv2d_mode mode() const {
+            return m_mode;
+        }
+        void set_mode(conv2d_mode mode) {
+            bool winograd = m_kernel_size == winograd::kernel && m_stride == 1;
+            if (mode == conv2d_mode::automatic)
+                mode = winograd ? conv2d_mode::winograd : conv2d_mode::gemm;
+            assert(mode != conv2d_mode::winograd || winograd);
+            assert(mode != conv2d_mode::fft || (m_stride == 1 && fft::tile_size(m_kernel_size) <= fft::max_size));
+            m_mode = mode;
+            prepare();
+        }
+        // The direct mode runs the kernels compiled for the shape of the layer if it has one of the fixed shapes,
+        // or the generic ones if they are disabled, e.g. to compare the two.
+        bool fixed_kernels() const {
+            return m_fixed_shape != 0;
+        }
+        void set_fixed_kernels(bool enabled) {
+            m_fixed_shape = enabled ? fixed_shape(m_kernel_size, m_stride) : 0;
+        }
+        void prepare() {
+            m_packed_weight = gemm::packed_operand<gemm::mr, U>();
+            m_winograd_weight.clear();
+            m_fft_weight.clear();
+            m_fft = fft::transform<U>();
+            m_blocked_weight = aligned_tensor();
+            m_blocked_bias = aligned_tensor();
+            m_space_to_depth.reset();
+            if (packed_cache::deferred())
+                return;
+            std::size_t depth = m_in_channels * m_kernel_size * m_kernel_size;
+            if (m_quantized)
+                m_quantized_weight.pack(m_out_channels, depth, m_weight.get_raw(), depth, 1);
+            else if (m_mode == conv2d_mode::gemm) {
+                m_packed_weight.pack(m_out_channels, depth, m_weight.get_raw(), depth, 1);
+            } else if (m_mode == conv2d_mode::winograd) {
+                // One out_channels x in_channels matrix per element of the transformed tile.
+                std::size_t size = m_out_channels * m_in_channels;
+                std::vector<U> transformed(winograd::elements * size);
+                for (std::size_t out = 0; out < m_out_channels; ++out)
                     for (std::size_t in = 0; in < m_in_channels; ++in)
+                        winograd::transform_weight(m_weight.get_raw(out, in, 0, 0), &transformed[out * m_in_channels + in], size);
+                m_winograd_weight.resize(winograd::elements);
+                for (std::size_t e = 0; e < winograd::elements; ++e)
+                    m_winograd_weight[e].pack(m_out_channels, m_in_channels, &transformed[e * size], m_in_channels, 1);
+            } else if (m_mode == conv2d_mode::fft) {
+                // Per bin, an out_channels x in_channels matrix of the real parts of the spectra of the kernels,
+                // then one of the imaginary parts, conjugated so that the products of spectra correlate rather
+                // than convolve, like the layer.
+                m_fft = fft::transform<U>(fft::tile_size(m_kernel_size));
+                std::size_t n = m_fft.size(), bins = m_fft.bins(), size = m_out_channels * m_in_channels;
+                std::vector<U> tile(n * n), re(bins * size), im(bins * size);
+                for (std::size_t out = 0; out < m_out_channels; ++out)
+                    for (std::size_t in = 0; in < m_in_channels; ++in) {
                         for (std::size_t kh = 0; kh < m_kernel_size; ++kh)
-                            for (std::size_t kw = 0; kw < m_kernel_size; ++kw) {
-                                sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(m_weight.at(out, in, kh, kw)), _mm256_set_ps(
-                                        x.at(i, in, hs + kh, ws + kw + m_stride * 7),
-                                        x.at(i, in, hs + kh, ws + kw + m_stride * 6),
-                                        x.at(i, in, hs + kh, ws + kw + m_stride * 5),
-                                        x.at(i, in, hs + kh, ws + kw + m_stride * 4),
-                                        x.at(i, in, hs + kh, ws + kw + m_stride * 3),
-                                        x.at(i, in, hs + kh, ws + kw + m_stride * 2),
-                                        x.at(i, in, hs + kh, ws + kw + m_stride * 1),
-                                        x.at(i, in, hs + kh, ws + kw + m_stride * 0)
-                                )));
-                            }
-                    if (m_has_bias)
-                        sum = _mm256_add_ps(sum, _mm256_set1_ps(m_bias.at(out)));
-                    _mm256_storeu_ps(y.get_raw(i, out, h, w), sum);
+                            std::copy(m_weight.get_raw(out, in, kh, 0), m_weight.get_raw(out, in, kh, 0) + m_kernel_size,
+                                      &tile[kh * n]);
+                        m_fft.forward_real(&tile[0], 1, &re[out * m_in_channels + in], &im[out * m_in_channels + in], size);
+                    }
+                for (U &value: im)
+                    value = -value;
+                m_fft_weight.resize(2 * bins);
+                for (std::size_t b = 0; b < bins; ++b) {
+                    m_fft_weight[2 * b].pack(m_out_channels, m_in_channels, &re[b * size], m_in_channels, 1);
+                    m_fft_weight[2 * b + 1].pack(m_out_channels, m_in_channels, &im[b * size], m_in_channels, 1);
                 }
-                for (; w < width; ++w) {
-                    float sum = 0;
-                    std::size_t ws = m_stride * w;
+            } else if (m_mode == conv2d_mode::blocked) {
+                // A vector of the output channels of a block per (in, kh, kw), zero past the last channel.
+                std::size_t b = layout::preferred_block(), blocks = (m_out_channels + b - 1) / b, k = m_kernel_size;
+                m_blocked_weight.resize({blocks, m_in_channels, k, k, b});
+                m_blocked_bias.resize({blocks, b});
+                std::fill(m_blocked_weight.get_raw(), m_blocked_weight.get_raw() + m_blocked_weight.size(), U());
+                std::fill(m_blocked_bias.get_raw(), m_blocked_bias.get_raw() + m_blocked_bias.size(), U());
+                for (std::size_t out = 0; out < m_out_channels; ++out) {
                     for (std::size_t in = 0; in < m_in_channels; ++in)
-                        for (std::size_t kh = 0; kh < m_kernel_size; ++kh)
-                            for (std::size_t kw = 0; kw < m_kernel_size; ++kw)
-                                sum += x.at(i, in, hs + kh, ws + kw) * m_weight.at(out, in, kh, kw);
+                        for (std::size_t kh = 0; kh < k; ++kh)
+                            for (std::size_t kw = 0; kw < k; ++kw)
+                                m_blocked_weight.at(out / b, in, kh, kw, out % b) = m_weight.at(out, in, kh, kw);
                     if (m_has_bias)
-                        sum += m_bias.at(out);
-                    y.at(i, out, h, w) = sum;
+                        m_blocked_bias.at(out / b, out % b) = m_bias.at(out);
+                }
+            } else if (m_mode == conv2d_mode::space_to_depth) {
+                // Input channel (in, dh, dw) of the rearranged input holds the pixels (s h + dh, s w + dw) of
+                // channel in, so element (kh, kw) of its kernel is (s kh + dh, s kw + dw), or zero past the end.
+                std::size_t s = m_stride, k = (m_kernel_size + s - 1) / s;
+                m_space_to_depth = std::make_shared<conv2d>(m_in_channels * s * s, m_out_channels, k, 1, 0, m_has_bias,
+                                                            conv2d_mode::automatic);
+                std::vector<tensor_type *> tensors = m_space_to_depth->parameters();
+                tensor_type &weight = *tensors[0];
+                for (std::size_t out = 0; out < m_out_channels; ++out)
+                    for (std::size_t in = 0; in < m_in_channels * s * s; ++in)
+                        for (std::size_t kh = 0; kh < k; ++kh)
+                            for (std::size_t kw = 0; kw < k; ++kw) {
+                                std::size_t h = kh * s + in / s % s, w = kw * s + in % s;
+                                weight.at(out, in, kh, kw) = h < m_kernel_size && w < m_kernel_size
+                                                             ? m_weight.at(out, in / (s * s), h, w) : U();
+                            }
+                if (m_has_bias)
+                    std::copy(m_bias.get_raw(), m_bias.get_raw() + m_out_channels, tensors[1]->get_raw());
+                m_space_to_depth->prepare();
+                if (m_relu)
+                    m_space_to_depth->fuse_relu();
+            }
+        }
+        // The mode and the state quantize() leaves, then what prepare() packed for them. The space_to_depth mode
+        // saves the parameters of its stride 1 convolution too, which are rearranged rather than loaded.
+        void save_packed(std::ostream &out) const {
+            packed_state state {static_cast<std::uint32_t>(m_mode), m_quantized, m_input_range.scale,
+                                m_input_range.zero_point};
+            out.write(reinterpret_cast<const char *>(&state), sizeof(state));
+            if (m_quantized)
+                m_quantized_weight.save(out);
+            else if (m_mode == conv2d_mode::gemm)
+                m_packed_weight.save(out);
+            else if (m_mode == conv2d_mode::winograd || m_mode == conv2d_mode::fft) {
+                const std::vector<gemm::packed_operand<gemm::mr, U> > &weights =
+                        m_mode == conv2d_mode::winograd ? m_winograd_weight : m_fft_weight;
+                for (std::size_t i = 0; i < weights.size(); ++i)
+                    weights[i].save(out);
+            } else if (m_mode == conv2d_mode::blocked) {
+                packed_cache::pad(out);
+                m_blocked_weight.save(out);
+                packed_cache::pad(out);
+                m_blocked_bias.save(out);
+            } else if (m_mode == conv2d_mode::space_to_depth) {
+                std::vector<tensor_type *> tensors = m_space_to_depth->parameters();
+                for (std::size_t i = 0; i < tensors.size(); ++i) {
+                    packed_cache::pad(out);
+                    tensors[i]->save(out);
                 }
+                m_space_to_depth->save_packed(out);
             }
         }
+        bool load_packed(mapped_file &in) {
+            packed_state state;
+            const char *header = in.read(sizeof(state));
+            if (!header)
+                return false;
+            std::memcpy(&state, header, sizeof(state));
+            if (state.mode != static_cast<std::uint32_t>(m_mode))
+                return false;
+            m_quantized = state.quantized;
+            m_input_range = qgemm::range(state.scale, state.zero_point);
+            std::size_t depth = m_in_channels * m_kernel_size * m_kernel_size;
+            if (m_quantized)
+                return m_quantized_weight.map(in, m_out_channels, depth);
+            if (m_mode == conv2d_mode::gemm)
+                return m_packed_weight.map(in, m_out_channels, depth);
+            if (m_mode == conv2d_mode::winograd || m_mode == conv2d_mode::fft) {
+                std::vector<gemm::packed_operand<gemm::mr, U> > &weights =
+                        m_mode == conv2d_mode::winograd ? m_winograd_weight : m_fft_weight;
+                if (m_mode == conv2d_mode::fft)
+                    m_fft = fft::transform<U>(fft::tile_size(m_kernel_size));
+                weights.resize(m_mode == conv2d_mode::winograd ? winograd::elements : 2 * m_fft.bins());
+                for (std::size_t i = 0; i < weights.size(); ++i)
+                    if (!weights[i].map(in, m_out_channels, m_in_channels))
+                        return false;
+            } else if (m_mode == conv2d_mode::blocked) {
+                std::size_t b = layout::preferred_block(), blocks = (m_out_channels + b - 1) / b, k = m_kernel_size;
+                return map_blocked(in, {blocks, m_in_channels, k, k, b}, m_blocked_weight) &&
+                       map_blocked(in, {blocks, b}, m_blocked_bias);
+            } else if (m_mode == conv2d_mode::space_to_depth) {
+                std::size_t s = m_stride;
+                m_space_to_depth = std::make_shared<conv2d>(m_in_channels * s * s, m_out_channels,
+                                                            (m_kernel_size + s - 1) / s, 1, 0, m_has_bias,
+                                                            conv2d_mode::automatic);
+                std::vector<tensor_type *> tensors = m_space_to_depth->parameters();
+                for (std::size_t i = 0; i < tensors.size(); ++i) {
+                    in.align(packed_cache::alignment);
+                    tensors[i]->map(in);
+                }
+                if (m_relu)
+                    m_space_to_depth->fuse_relu();
+                return in && m_space_to_depth->load_packed(in);
+            }
+            return true;
+        }
+        // Runs the layer in INT8 from now on, with inputs quantized by `input` and weights per output channel.
+        // The float weights stay loaded but are no longer read, and the mode no longer matters.
+        void quantize(const qgemm::range &input) {
+            m_quantized = true;
+            m_input_range = input;
+            prepare();
+        }
+        bool quantized() const {
+            return m_quantized;
+        }
+        // Parameters read by the INT8 path, in bytes.
+        std::size_t quantized_bytes() const {
+            return m_quantized_weight.bytes() + m_bias.size() * sizeof(U);
+        }
+    private:
+        struct packed_state {
+            std::uint32_t mode, quantized;
+            float scale;
+            std::int32_t zero_point;
+        };
+        typedef tensor<U, aligned_allocator<U> > aligned_tensor;
+
+        // Points `t` at a tensor of `shape` saved by save_packed(), without allocating it first.
+        static bool map_blocked(mapped_file &in, std::initializer_list<std::size_t> shape, aligned_tensor &t) {
+            std::size_t size = 1;
+            for (std::size_t d: shape)
+                size *= d;
+            in.align(packed_cache::alignment);
+            char *data = in.read(size * sizeof(U));
+            if (!data)
+                return false;
+            typename aligned_tensor::storage_pointer storage = std::make_shared<typename aligned_tensor::storage>();
+            storage->map(reinterpret_cast<U *>(data), size, in.owner());
+            t = aligned_tensor(storage, shape.begin(), shape.end());
+            return true;
+        }
+        // The shapes whose direct kernels are compiled for their kernel size and stride, see
+        // single_conv_fixed_avx2(): 1 to 4 for 1x1, 3x3 and 5x5 with stride 1 and 11x11 with stride 4, 0 for the
+        // others, which run the generic kernels.
+        static std::size_t fixed_shape(std::size_t kernel, std::size_t stride) {
+            const std::size_t shapes[][2] = {{1, 1}, {3, 1}, {5, 1}, {11, 4}};
+            for (std::size_t j = 0; j < 4; ++j)
+                if (kernel == shapes[j][0] && stride == shapes[j][1])
+                    return j + 1;
+            return 0;
+        }
+        // An output as stored, through the relu if one is fused.
+        U activate(U value) const {
+            return m_relu && value < 0 ? U() : value;
+        }
+        // Quantized input, one byte per element.
+        tensor_type plan_quantized(const tensor_type &x, workspace_type &ws) const {
+            return ws.acquire({(x.size() + sizeof(U) - 1) / sizeof(U)});
+        }
+        // Input of the space_to_depth mode, padded: rows and columns enough for the outputs of this layer.
+        tensor_type plan_space_to_depth(const tensor_type &x, workspace_type &ws) const {
+            std::size_t k = (m_kernel_size + m_stride - 1) / m_stride;
+            return ws.acquire({x.shape(0), m_in_channels * m_stride * m_stride, rows(x).output + k - 1,
+                               cols(x).output + k - 1});
+        }
+        void single_space_to_depth(const tensor_type &x, tensor_type &y, std::size_t i, std::size_t c) const {
+            std::size_t s = m_stride, in = c / (s * s), height = x.shape(2), width = x.shape(3);
+            for (std::size_t h = 0; h < y.shape(2); ++h) {
+                U *dst = y.get_raw(i, c, h, 0);
+                // Wraps around within the padding.
+                std::size_t row = h * s + c / s % s - m_padding;
+                if (row >= height) {
+                    std::fill(dst, dst + y.shape(3), U());
+                    continue;
+                }
+                const U *src = x.get_raw(i, in, row, 0);
+                for (std::size_t w = 0, col = c % s - m_padding; w < y.shape(3); ++w, col += s)
+                    dst[w] = col < width ? src[col] : U();
+            }
+        }
+        tensor_type plan_plain(const tensor_type &x, workspace_type &ws) const {
+            return ws.acquire({x.shape(0), m_in_channels, x.shape(2), x.shape(3)});
+        }
+        // The padding is never stored: kernels read it as zeros through these.
+        window_axis rows(const tensor_type &x) const {
+            return window_axis(x.shape(2), m_kernel_size, m_stride, m_padding);
+        }
+        window_axis cols(const tensor_type &x) const {
+            return window_axis(x.shape(3), m_kernel_size, m_stride, m_padding);
+        }
+        tensor_type plan_output(const tensor_type &x, workspace_type &ws) const {
+            std::size_t height = rows(x).output, width = cols(x).output;
+            if (m_mode == conv2d_mode::blocked && !m_quantized)
+                return ws.acquire(layout::blocked_shape(x.shape(0), m_out_channels, height, width, m_blocked_bias.shape(1)));
+            return ws.acquire({x.shape(0), m_out_channels, height, width});
+        }
+        // Column panels of the im2col matrix of one image, packed straight from the input. Row p = (in, kh, kw)
+        // and column j = (h, w) hold x(in, h * stride + kh - padding, w * stride + kw - padding), zero within the
+        // padding. Only the few columns whose windows reach into the padding are checked element by element.
+        class im2col_operand {
+        public:
+            im2col_operand(const conv2d &layer, const U *x, const window_axis &rows, const window_axis &cols,
+                           std::size_t first)
+                    : m_layer(layer), m_x(x), m_rows(rows), m_cols(cols), m_first(first),
+                      m_from(2 * rows.kernel), m_to(2 * rows.kernel) {
+                for (std::size_t e = 0; e < rows.kernel; ++e) {
+                    m_from[e] = rows.from(e);
+                    m_to[e] = rows.to(e);
+                    m_from[rows.kernel + e] = cols.from(e);
+                    m_to[rows.kernel + e] = cols.to(e);
+                }
+            }
+            const U *panels(std::size_t j0, std::size_t count, std::size_t p0, std::size_t depth, U *buffer) const {
+                std::size_t kernel = m_layer.m_kernel_size, stride = m_layer.m_stride, padding = m_layer.m_padding,
+                            height = m_rows.input, width = m_cols.input, out_width = m_cols.output;
+                U *dst = buffer;
+                for (std::size_t js = m_first + j0; js < m_first + j0 + count; js += gemm::nr) {
+                    std::size_t cols = std::min(gemm::nr, m_first + j0 + count - js), inner = 0, outer = 0,
+                                column[gemm::nr], offset[gemm::nr], h[gemm::nr], w[gemm::nr];
+                    for (std::size_t q = 0; q < cols; ++q) {
+                        std::size_t j = js + q, oh = j / out_width, ow = j % out_width;
+                        // Wraps around within the padding, and back once the kernel element is added.
+                        std::size_t at = (oh * stride - padding) * width + ow * stride - padding;
+                        if (m_rows.interior(oh) && m_cols.interior(ow)) {
+                            column[inner] = q;
+                            offset[inner++] = at;
+                        } else {
+                            column[gemm::nr - ++outer] = q;
+                            offset[gemm::nr - outer] = at;
+                            h[gemm::nr - outer] = oh;
+                            w[gemm::nr - outer] = ow;
+                        }
+                    }
+                    std::size_t in = p0 / (kernel * kernel), kh = p0 / kernel % kernel, kw = p0 % kernel;
+                    for (std::size_t p = p0; p < p0 + depth; ++p, dst += gemm::nr) {
+                        std::size_t base = (in * height + kh) * width + kw;
+                        for (std::size_t q = 0; q < inner; ++q)
+                            dst[column[q]] = m_x[base + offset[q]];
+                        for (std::size_t q = gemm::nr - outer; q < gemm::nr; ++q)
+                            dst[column[q]] = h[q] >= m_from[kh] && h[q] < m_to[kh] && w[q] >= m_from[kernel + kw] &&
+                                             w[q] < m_to[kernel + kw] ? m_x[base + offset[q]] : 0;
+                        for (std::size_t q = cols; q < gemm::nr; ++q)
+                            dst[q] = 0;
+                        if (++kw == kernel) {
+                            kw = 0;
+                            if (++kh == kernel) {
+                                kh = 0;
+                                ++in;
+                            }
+                        }
+                    }
+                }
+                return buffer;
+            }
+        private:
+            const conv2d &m_layer;
+            const U *m_x;
+            window_axis m_rows, m_cols;
+            std::size_t m_first;
+            // Output rows, then columns, reading kernel element e from the input: [from[e], to[e]).
+            std::vector<std::size_t> m_from, m_to;
+        };
+
+        void forward_int8(const tensor_type &x, tensor_type &q, tensor_type &y, thread_pool &threads) const {
+            std::uint8_t *input = reinterpret_cast<std::uint8_t *>(q.get_raw());
+            threads.parallel_for(0, x.size(), 1 << 16, [this, &x, input](std::size_t s, std::size_t e) {
+                qgemm::quantize(x.get_raw() + s, e - s, m_input_range, input + s);
+            });
+            // Every task lowers a block of output pixels of one image to im2row form, one row of
+            // in_channels x kernel_size x kernel_size bytes per pixel, and multiplies it with all weights.
+            std::size_t n = y.shape(0), pixels = y.shape(2) * y.shape(3);
+            std::size_t blocks = (pixels + qgemm::mc - 1) / qgemm::mc;
+            threads.parallel_for(0, n * blocks, 1, [this, &x, &y, input, pixels, blocks](std::size_t s, std::size_t e) {
+                std::size_t depth = m_quantized_weight.depth(), height = x.shape(2), width = x.shape(3);
+                std::size_t out_width = y.shape(3), k = m_kernel_size;
+                window_axis rows = this->rows(x), cols = this->cols(x);
+                // The padding holds zeros, which quantize to the zero point.
+                std::uint8_t zero = m_input_range.quantize(U());
+                aligned_vector<std::uint8_t> &lowered = qgemm::thread_buffer<std::uint8_t>(0);
+                aligned_vector<std::int32_t> &c = qgemm::thread_buffer<std::int32_t>(0);
+                lowered.resize(std::max(lowered.size(), qgemm::mc * depth));
+                c.resize(std::max(c.size(), qgemm::mc * m_out_channels));
+                for (std::size_t j = s; j < e; ++j) {
+                    std::size_t i = j / blocks, first = j % blocks * qgemm::mc, count = std::min(qgemm::mc, pixels - first);
+                    const std::uint8_t *image = input + i * m_in_channels * height * width;
+                    for (std::size_t r = 0; r < count; ++r) {
+                        std::size_t oh = (first + r) / out_width, ow = (first + r) % out_width;
+                        std::size_t h = oh * m_stride - m_padding, w = ow * m_stride - m_padding;
+                        std::uint8_t *row = &lowered[r * depth];
+                        if (rows.interior(oh) && cols.interior(ow))
+                            for (std::size_t in = 0; in < m_in_channels; ++in)
+                                for (std::size_t kh = 0; kh < k; ++kh, row += k)
+                                    memcpy(row, image + (in * height + h + kh) * width + w, k);
+                        else {
+                            std::size_t kh_first = rows.begin(oh), kh_last = rows.end(oh), kw_first = cols.begin(ow),
+                                        kw_last = cols.end(ow);
+                            for (std::size_t in = 0; in < m_in_channels; ++in)
+                                for (std::size_t kh = 0; kh < k; ++kh, row += k) {
+                                    if (kh < kh_first || kh >= kh_last) {
+                                        std::fill(row, row + k, zero);
+                                        continue;
+                                    }
+                                    std::fill(row, row + kw_first, zero);
+                                    memcpy(row + kw_first, image + (in * height + h + kh) * width + w + kw_first,
+                                           kw_last - kw_first);
+                                    std::fill(row + kw_last, row + k, zero);
+                                }
+                        }
+                        std::fill(row, &lowered[(r + 1) * depth], 0);
+                    }
+                    qgemm::multiply(count, m_out_channels, &lowered[0], depth, m_quantized_weight, 0, &c[0], m_out_channels);
+                    for (std::size_t out = 0; out < m_out_channels; ++out) {
+                        U scale = m_input_range.scale * m_quantized_weight.scale(out);
+                        std::int32_t offset = m_input_range.zero_point * m_quantized_weight.sum(out);
+                        U b = m_has_bias ? m_bias.at(out) : U();
+                        U *dst = y.get_raw(i, out, 0, 0) + first;
+                        for (std::size_t r = 0; r < count; ++r)
+                            dst[r] = activate(scale * (c[r * m_out_channels + out] - offset) + b);
+                    }
+                }
+            });
+        }
+        void forward_gemm(const tensor_type &x, tensor_type &y, thread_pool &threads) const {
+            // Every task multiplies the weights with a column block of one image. Small batches are split along
+            // the columns, so that all threads have work.
+            std::size_t n = y.shape(0), columns = y.shape(2) * y.shape(3);
+            std::size_t blocks = (std::max<std::size_t>(threads.get_thread_num(), 1) + n - 1) / n;
+            std::size_t block = gemm::round_up((columns + blocks - 1) / blocks, gemm::nr);
+            blocks = (columns + block - 1) / block;
+            threads.parallel_for(0, n * blocks, 1, [this, &x, &y, columns, blocks, block](std::size_t s, std::size_t e) {
+                for (std::size_t j = s; j < e; ++j) {
+                    std::size_t i = j / blocks, first = j % blocks * block, count = std::min(block, columns - first);
+                    im2col_operand col(*this, x.get_raw(i, 0, 0, 0), rows(x), cols(x), first);
+                    U *out = y.get_raw(i, 0, 0, 0) + first;
+                    gemm::multiply(m_out_channels, count, m_in_channels * m_kernel_size * m_kernel_size,
+                                   m_packed_weight, col, out, columns);
+                    for (std::size_t o = 0; o < m_out_channels && (m_has_bias || m_relu); ++o) {
+                        U *dst = out + o * columns;
+                        if (m_has_bias)
+                            for (std::size_t k = 0; k < count; ++k)
+                                dst[k] += m_bias.at(o);
+                        for (std::size_t k = 0; k < count && m_relu; ++k)
+                            dst[k] = activate(dst[k]);
+                    }
+                }
+            });
+        }
+        void forward_winograd(const tensor_type &x, tensor_type &y, thread_pool &threads) const {
+            // Tiles of the whole batch are transformed in blocks. For every block, the 36 elements of the
+            // transformed tiles are 36 independent (out_channels x in_channels) * (in_channels x block) products.
+            // Small batches are also split along the output channels, so that all threads have work.
+            std::size_t rows = (y.shape(2) + winograd::output_tile - 1) / winograd::output_tile,
+                        cols = (y.shape(3) + winograd::output_tile - 1) / winograd::output_tile,
+                        tiles = y.shape(0) * rows * cols, threads_n = std::max<std::size_t>(threads.get_thread_num(), 1);
+            std::size_t block = std::min(winograd::max_block, gemm::round_up((tiles + threads_n - 1) / threads_n, gemm::nr));
+            std::size_t blocks = (tiles + block - 1) / block;
+            std::size_t groups = (threads_n + blocks - 1) / blocks;
+            std::size_t group = (m_out_channels + groups - 1) / groups;
+            group = std::min(m_out_channels, gemm::round_up(std::max<std::size_t>(group, 32), gemm::mr));
+            groups = (m_out_channels + group - 1) / group;
+            threads.parallel_for(0, blocks * groups, 1, [this, &x, &y, rows, cols, tiles, block, groups, group](std::size_t s, std::size_t e) {
+                for (std::size_t j = s; j < e; ++j) {
+                    std::size_t first = j / groups * block, count = std::min(block, tiles - first),
+                                out = j % groups * group;
+                    single_winograd(x, y, rows, cols, first, count, out, std::min(group, m_out_channels - out));
+                }
+            });
+        }
+        void single_winograd(const tensor_type &x, tensor_type &y, std::size_t rows, std::size_t cols,
+                             std::size_t first, std::size_t count, std::size_t out, std::size_t outs) const {
+            const std::size_t n = winograd::input_tile;
+            std::size_t height = x.shape(2), width = x.shape(3);
+            aligned_vector<U> &v = winograd::thread_buffer<U>(0), &m = winograd::thread_buffer<U>(1),
+                              &d = winograd::thread_buffer<U>(2), &t = winograd::thread_buffer<U>(3);
+            v.resize(std::max(v.size(), winograd::elements * m_in_channels * count));
+            m.resize(std::max(m.size(), winograd::elements * outs * count));
+            d.resize(std::max(d.size(), winograd::elements * count));
+            t.resize(std::max(t.size(), winograd::elements * count));
+            // Image and first pixel of every tile. Tiles start within the padding at the top and left, and may
+            // reach past the input at the bottom and right; the elements outside the input are zeros either way.
+            std::size_t image[winograd::max_block], h[winograd::max_block], w[winograd::max_block];
+            bool inside[winograd::max_block];
+            assert(count <= winograd::max_block);
+            for (std::size_t k = 0; k < count; ++k) {
+                image[k] = (first + k) / (rows * cols);
+                h[k] = (first + k) / cols % rows * winograd::output_tile;
+                w[k] = (first + k) % cols * winograd::output_tile;
+                inside[k] = h[k] >= m_padding && h[k] - m_padding + n <= height &&
+                            w[k] >= m_padding && w[k] - m_padding + n <= width;
+            }
+            for (std::size_t in = 0; in < m_in_channels; ++in) {
+                for (std::size_t k = 0; k < count; ++k) {
+                    const U *src = x.get_raw(image[k], in, 0, 0);
+                    std::size_t top = h[k] - m_padding, left = w[k] - m_padding;
+                    if (inside[k]) {
+                        for (std::size_t r = 0; r < n; ++r)
+                            for (std::size_t c = 0; c < n; ++c)
+                                d[(r * n + c) * count + k] = src[(top + r) * width + left + c];
+                    } else {
+                        for (std::size_t r = 0; r < n; ++r)
+                            for (std::size_t c = 0; c < n; ++c)
+                                d[(r * n + c) * count + k] = top + r < height && left + c < width
+                                                             ? src[(top + r) * width + left + c] : 0;
+                    }
+                }
+                winograd::transform_input(&d[0], &t[0], count, &v[in * count], m_in_channels * count);
+            }
+            for (std::size_t e = 0; e < winograd::elements; ++e)
+                gemm::multiply(outs, count, m_in_channels,
+                               gemm::operand_slice<gemm::packed_operand<gemm::mr, U> >(m_winograd_weight[e], out),
+                               gemm::strided_operand<gemm::nr, U>(&v[e * m_in_channels * count], 1, count),
+                               &m[e * outs * count], count);
+            for (std::size_t o = 0; o < outs; ++o) {
+                winograd::transform_output(&m[o * count], outs * count, &t[0], count, &d[0]);
+                U bias = m_has_bias ? m_bias.at(out + o) : 0;
+                for (std::size_t k = 0; k < count; ++k) {
+                    U *dst = y.get_raw(image[k], out + o, 0, 0);
+                    for (std::size_t r = 0; r < winograd::output_tile && h[k] + r < y.shape(2); ++r)
+                        for (std::size_t c = 0; c < winograd::output_tile && w[k] + c < y.shape(3); ++c)
+                            dst[(h[k] + r) * y.shape(3) + w[k] + c] =
+                                    activate(d[(r * winograd::output_tile + c) * count + k] + bias);
+                }
+            }
+        }
+
+        void forward_fft(const tensor_type &x, tensor_type &y, thread_pool &threads) const {
+            // As in the winograd mode, tiles of the whole batch are transformed in blocks, and small batches are
+            // also split along the output channels. For every block, each bin is an (out_channels x in_channels)
+            // * (in_channels x 2 block) product per part of the weights, the real and imaginary parts of the
+            // inputs side by side.
+            std::size_t tile = m_fft.size() - m_kernel_size + 1, rows = (y.shape(2) + tile - 1) / tile,
+                        cols = (y.shape(3) + tile - 1) / tile, tiles = y.shape(0) * rows * cols,
+                        threads_n = std::max<std::size_t>(threads.get_thread_num(), 1);
+            std::size_t block = std::min<std::size_t>(16, gemm::round_up((tiles + threads_n - 1) / threads_n, gemm::nr / 2));
+            std::size_t blocks = (tiles + block - 1) / block;
+            std::size_t groups = (threads_n + blocks - 1) / blocks;
+            std::size_t group = (m_out_channels + groups - 1) / groups;
+            group = std::min(m_out_channels, gemm::round_up(std::max<std::size_t>(group, 32), gemm::mr));
+            groups = (m_out_channels + group - 1) / group;
+            threads.parallel_for(0, blocks * groups, 1, [this, &x, &y, rows, cols, tiles, block, groups, group](std::size_t s, std::size_t e) {
+                for (std::size_t j = s; j < e; ++j) {
+                    std::size_t first = j / groups * block, count = std::min(block, tiles - first),
+                                out = j % groups * group;
+                    single_fft(x, y, rows, cols, first, count, out, std::min(group, m_out_channels - out));
+                }
+            });
+        }
+        void single_fft(const tensor_type &x, tensor_type &y, std::size_t rows, std::size_t cols,
+                        std::size_t first, std::size_t count, std::size_t out, std::size_t outs) const {
+            std::size_t n = m_fft.size(), bins = m_fft.bins(), tile = n - m_kernel_size + 1, depth = 2 * count,
+                        height = x.shape(2), width = x.shape(3);
+            aligned_vector<U> &v = fft::thread_buffer<U>(0), &m = fft::thread_buffer<U>(1),
+                              &d = fft::thread_buffer<U>(2), &spectra = fft::thread_buffer<U>(3);
+            v.resize(std::max(v.size(), bins * m_in_channels * depth));
+            m.resize(std::max(m.size(), 2 * bins * outs * depth));
+            d.resize(std::max(d.size(), n * n * count));
+            spectra.resize(std::max(spectra.size(), 2 * bins * count));
+            // The tiles of the block are transformed together, one input channel at a time. Like Winograd tiles,
+            // they start within the padding and may reach past the input.
+            for (std::size_t in = 0; in < m_in_channels; ++in) {
+                for (std::size_t t = 0; t < count; ++t) {
+                    std::size_t i = (first + t) / (rows * cols), top = (first + t) / cols % rows * tile - m_padding,
+                                left = (first + t) % cols * tile - m_padding;
+                    const U *src = x.get_raw(i, in, 0, 0);
+                    for (std::size_t r = 0; r < n; ++r)
+                        for (std::size_t c = 0; c < n; ++c)
+                            d[(r * n + c) * count + t] = top + r < height && left + c < width
+                                                         ? src[(top + r) * width + left + c] : 0;
+                }
+                m_fft.forward_real(&d[0], count, &v[in * depth], &v[in * depth + count], m_in_channels * depth);
+            }
+            for (std::size_t b = 0; b < 2 * bins; ++b)
+                gemm::multiply(outs, depth, m_in_channels,
+                               gemm::operand_slice<gemm::packed_operand<gemm::mr, U> >(m_fft_weight[b], out),
+                               gemm::strided_operand<gemm::nr, U>(&v[b / 2 * m_in_channels * depth], 1, depth),
+                               &m[b * outs * depth], depth);
+            U *re = &spectra[0], *im = re + bins * count;
+            for (std::size_t o = 0; o < outs; ++o) {
+                // (p + i q) (u + i v) = p u - q v + i (p v + q u): `real` holds p u and p v, `imaginary` q u and
+                // q v.
+                for (std::size_t b = 0; b < bins; ++b) {
+                    const U *real = &m[(2 * b * outs + o) * depth], *imaginary = &m[((2 * b + 1) * outs + o) * depth];
+                    for (std::size_t t = 0; t < count; ++t) {
+                        re[b * count + t] = real[t] - imaginary[count + t];
+                        im[b * count + t] = real[count + t] + imaginary[t];
+                    }
+                }
+                m_fft.inverse_real(re, im, count, count, &d[0]);
+                U bias = m_has_bias ? m_bias.at(out + o) : 0;
+                for (std::size_t t = 0; t < count; ++t) {
+                    std::size_t i = (first + t) / (rows * cols), h = (first + t) / cols % rows * tile,
+                                w = (first + t) % cols * tile;
+                    for (std::size_t r = 0; r < tile && h + r < y.shape(2); ++r)
+                        for (std::size_t c = 0; c < tile && w + c < y.shape(3); ++c)
+                            y.at(i, out + o, h + r, w + c) = activate(d[(r * n + c) * count + t] + bias);
+                }
+            }
+        }
+
+        // Where a task of the blocked mode reads and writes: output row h of `blocks` consecutive blocks of
+        // output channels, with their weights, biases and outputs the given strides apart, from image `x`, which
+        // is plain if `block` is 1 and padded by `padding` on every side. Only kernel rows [kh_first, kh_last)
+        // of the windows of the row lie within the input.
+        struct blocked_row {
+            const U *x, *weight, *bias;
+            U *y;
+            std::size_t blocks, weight_stride, output_stride, block, height, width, padding, h, out_width,
+                        kh_first, kh_last;
+            // Channel `in` under element (kh, kw) of the window of output pixel w, which must be within the input.
+            const U *input(std::size_t in, std::size_t stride, std::size_t w, std::size_t kh, std::size_t kw) const {
+                // Wraps around within the padding, and back once kh and kw are added.
+                std::size_t top = stride * h - padding, left = stride * w - padding;
+                return x + (in / block * height * width + (top + kh) * width + left + kw) * block + in % block;
+            }
+        };
+
+        // Tasks take two blocks of output channels where there are, so that every input broadcast feeds two
+        // multiply-adds.
+        void forward_blocked(const tensor_type &x, tensor_type &y, thread_pool &threads) const {
+            std::size_t blocks = y.shape(1), pairs = (blocks + 1) / 2, height = y.shape(2);
+            window_axis rows = this->rows(x), cols = this->cols(x);
+            threads.parallel_for(0, y.shape(0) * pairs * height, 1, [this, &x, &y, &rows, &cols, blocks, pairs, height](std::size_t s, std::size_t e) {
+                for (std::size_t j = s; j < e; ++j) {
+                    std::size_t i = j / (pairs * height), out = j / height % pairs * 2, h = j % height;
+                    blocked_row row {x.get_raw() + i * (x.size() / x.shape(0)), m_blocked_weight.get_raw(out, 0, 0, 0, 0),
+                                     m_blocked_bias.get_raw(out, 0), y.get_raw(i, out, h, 0, 0), std::min<std::size_t>(2, blocks - out),
+                                     m_blocked_weight.size() / m_blocked_weight.shape(0), y.shape(2) * y.shape(3) * y.shape(4),
+                                     x.ndim() == 5 ? x.shape(4) : 1, x.shape(2), x.shape(3), m_padding, h, y.shape(3),
+                                     rows.begin(h), rows.end(h)};
+                    single_blocked(row, cols);
+                }
+            });
+        }
+
+        template<typename T = U>
+        typename std::enable_if<!std::is_same<T, float>::value>::type
+            single_blocked(const blocked_row &row, const window_axis &cols) const {
+            single_blocked_scalar(row, cols);
+        }
+        // The kernels hold a vector register of output channels per pixel, so they need blocks of that size,
+        // which prepare() picks for the path selected.
+        template<typename T = U>
+        typename std::enable_if<std::is_same<T, float>::value>::type
+            single_blocked(const blocked_row &row, const window_axis &cols) const {
+#if TNN_X86
+            std::size_t b = m_blocked_bias.shape(1);
+            simd::isa level = simd::current();
+            if (level == simd::avx512 && b == 16)
+                return row.blocks == 2 ? single_blocked_avx512<2>(row, cols) : single_blocked_avx512<1>(row, cols);
+            if (level >= simd::avx2 && b == 8)
+                return row.blocks == 2 ? single_blocked_avx2<2>(row, cols) : single_blocked_avx2<1>(row, cols);
+            if (level >= simd::sse41 && b == 8)
+                return single_blocked_sse41(row, cols);
 #endif
-        template<bool ForceDisableAVX = false>
-        typename std::enable_if<!(std::is_same<U, float>::value && AVX_ENABLED && !ForceDisableAVX)>::type
-            single_conv(const tensor_type &x, tensor_type &y, std::size_t i, std::size_t out) const {
-            std::size_t height = y.shape(2), width = y.shape(3);
-            for (std::size_t h = 0; h < height; ++h) {
-                std::size_t hs = m_stride * h;
-                for (std::size_t w = 0; w < width; ++w) {
-                    typename tensor_type::data_type sum = 0;
-                    std::size_t ws = m_stride * w;
+            single_blocked_scalar(row, cols);
+        }
+
+        void single_blocked_scalar(const blocked_row &row, const window_axis &cols) const {
+            std::size_t b = m_blocked_bias.shape(1), k = m_kernel_size;
+            for (std::size_t o = 0; o < row.blocks; ++o)
+                for (std::size_t w = 0; w < row.out_width; ++w) {
+                    U *sum = row.y + o * row.output_stride + w * b;
+                    std::copy(row.bias + o * b, row.bias + (o + 1) * b, sum);
+                    std::size_t kw_first = cols.begin(w), kw_last = cols.end(w);
                     for (std::size_t in = 0; in < m_in_channels; ++in)
-                        for (std::size_t kh = 0; kh < m_kernel_size; ++kh)
-                            for (std::size_t kw = 0; kw < m_kernel_size; ++kw)
-                                sum += x.at(i, in, hs + kh, ws + kw) * m_weight.at(out, in, kh, kw);
-                    y.at(i, out, h, w) = m_has_bias ? m_bias.at(out) + sum : sum;
+                        for (std::size_t kh = row.kh_first; kh < row.kh_last; ++kh)
+                            for (std::size_t kw = kw_first; kw < kw_last; ++kw) {
+                                U value = *row.input(in, m_stride, w, kh, kw);
+                                const U *weight = row.weight + o * row.weight_stride + ((in * k + kh) * k + kw) * b;
+                                for (std::size_t c = 0; c < b; ++c)
+                                    sum[c] += value * weight[c];
+                            }
+                    for (std::size_t c = 0; c < b; ++c)
+                        sum[c] = activate(sum[c]);
+                }
+        }
+#if TNN_X86
+        // Tiles of Blocks x Pixels registers: every input broadcast is multiplied with the weight vectors of the
+        // blocks, and every weight vector with the inputs of the pixels. The pixels whose windows lie within the
+        // input take wide tiles over whole windows, the few at the ends of the row single pixel tiles over
+        // columns [kw_first, kw_last) of theirs.
+        template<std::size_t Blocks, std::size_t Pixels>
+        TNN_TARGET_AVX512 void blocked_tile_avx512(const blocked_row &row, std::size_t w, std::size_t kw_first,
+                                                   std::size_t kw_last) const {
+            std::size_t k = m_kernel_size, step = m_stride * row.block;
+            __m512 sum[Blocks][Pixels];
+            for (std::size_t o = 0; o < Blocks; ++o)
+                for (std::size_t t = 0; t < Pixels; ++t)
+                    sum[o][t] = _mm512_load_ps(row.bias + o * 16);
+            for (std::size_t in = 0; in < m_in_channels; ++in)
+                for (std::size_t kh = row.kh_first; kh < row.kh_last; ++kh) {
+                    const float *p = row.input(in, m_stride, w, kh, kw_first),
+                                *weight = row.weight + ((in * k + kh) * k + kw_first) * 16;
+                    for (std::size_t kw = kw_first; kw < kw_last; ++kw, p += row.block, weight += 16) {
+                        __m512 v[Blocks];
+                        for (std::size_t o = 0; o < Blocks; ++o)
+                            v[o] = _mm512_load_ps(weight + o * row.weight_stride);
+                        for (std::size_t t = 0; t < Pixels; ++t) {
+                            __m512 a = _mm512_set1_ps(p[t * step]);
+                            for (std::size_t o = 0; o < Blocks; ++o)
+                                sum[o][t] = _mm512_fmadd_ps(a, v[o], sum[o][t]);
+                        }
+                    }
                 }
+            for (std::size_t o = 0; o < Blocks; ++o)
+                for (std::size_t t = 0; t < Pixels; ++t)
+                    _mm512_storeu_ps(row.y + o * row.output_stride + (w + t) * 16,
+                                     m_relu ? _mm512_max_ps(_mm512_setzero_ps(), sum[o][t]) : sum[o][t]);
+        }
+        // One tile of the `count` pixels left, at most Pixels, e.g. the 11 of the interior of a 13 pixel row.
+        template<std::size_t Blocks, std::size_t Pixels>
+        TNN_TARGET_AVX512 void blocked_rest_avx512(const blocked_row &row, std::size_t w, std::size_t count,
+                                                   std::integral_constant<std::size_t, Pixels>) const {
+            if (count == Pixels)
+                return blocked_tile_avx512<Blocks, Pixels>(row, w, 0, m_kernel_size);
+            blocked_rest_avx512<Blocks>(row, w, count, std::integral_constant<std::size_t, Pixels - 1>());
+        }
+        template<std::size_t Blocks>
+        void blocked_rest_avx512(const blocked_row &, std::size_t, std::size_t, std::integral_constant<std::size_t, 0>) const {}
+        template<std::size_t Blocks>
+        TNN_TARGET_AVX512 void single_blocked_avx512(const blocked_row &row, const window_axis &cols) const {
+            std::size_t w = 0;
+            for (; w < cols.first; ++w)
+                blocked_tile_avx512<Blocks, 1>(row, w, cols.begin(w), cols.end(w));
+            for (; w + 12 <= cols.last; w += 12)
+                blocked_tile_avx512<Blocks, 12>(row, w, 0, m_kernel_size);
+            blocked_rest_avx512<Blocks>(row, w, cols.last - w, std::integral_constant<std::size_t, 11>());
+            for (w = cols.last; w < row.out_width; ++w)
+                blocked_tile_avx512<Blocks, 1>(row, w, cols.begin(w), cols.end(w));
+        }
+        template<std::size_t Blocks, std::size_t Pixels>
+        TNN_TARGET_AVX2 void blocked_tile_avx2(const blocked_row &row, std::size_t w, std::size_t kw_first,
+                                               std::size_t kw_last) const {
+            std::size_t k = m_kernel_size, step = m_stride * row.block;
+            __m256 sum[Blocks][Pixels];
+            for (std::size_t o = 0; o < Blocks; ++o)
+                for (std::size_t t = 0; t < Pixels; ++t)
+                    sum[o][t] = _mm256_load_ps(row.bias + o * 8);
+            for (std::size_t in = 0; in < m_in_channels; ++in)
+                for (std::size_t kh = row.kh_first; kh < row.kh_last; ++kh) {
+                    const float *p = row.input(in, m_stride, w, kh, kw_first),
+                                *weight = row.weight + ((in * k + kh) * k + kw_first) * 8;
+                    for (std::size_t kw = kw_first; kw < kw_last; ++kw, p += row.block, weight += 8) {
+                        __m256 v[Blocks];
+                        for (std::size_t o = 0; o < Blocks; ++o)
+                            v[o] = _mm256_load_ps(weight + o * row.weight_stride);
+                        for (std::size_t t = 0; t < Pixels; ++t) {
+                            __m256 a = _mm256_set1_ps(p[t * step]);
+                            for (std::size_t o = 0; o < Blocks; ++o)
+                                sum[o][t] = _mm256_fmadd_ps(a, v[o], sum[o][t]);
+                        }
+                    }
+                }
+            for (std::size_t o = 0; o < Blocks; ++o)
+                for (std::size_t t = 0; t < Pixels; ++t)
+                    _mm256_storeu_ps(row.y + o * row.output_stride + (w + t) * 8,
+                                     m_relu ? _mm256_max_ps(_mm256_setzero_ps(), sum[o][t]) : sum[o][t]);
+        }
+        template<std::size_t Blocks, std::size_t Pixels>
+        TNN_TARGET_AVX2 void blocked_rest_avx2(const blocked_row &row, std::size_t w, std::size_t count,
+                                               std::integral_constant<std::size_t, Pixels>) const {
+            if (count == Pixels)
+                return blocked_tile_avx2<Blocks, Pixels>(row, w, 0, m_kernel_size);
+            blocked_rest_avx2<Blocks>(row, w, count, std::integral_constant<std::size_t, Pixels - 1>());
+        }
+        template<std::size_t Blocks>
+        void blocked_rest_avx2(const blocked_row &, std::size_t, std::size_t, std::integral_constant<std::size_t, 0>) const {}
+        // Twelve accumulators of the sixteen registers, whether for one block or two.
+        template<std::size_t Blocks>
+        TNN_TARGET_AVX2 void single_blocked_avx2(const blocked_row &row, const window_axis &cols) const {
+            std::size_t w = 0;
+            for (; w < cols.first; ++w)
+                blocked_tile_avx2<Blocks, 1>(row, w, cols.begin(w), cols.end(w));
+            for (; w + 12 / Blocks <= cols.last; w += 12 / Blocks)
+                blocked_tile_avx2<Blocks, 12 / Blocks>(row, w, 0, m_kernel_size);
+            blocked_rest_avx2<Blocks>(row, w, cols.last - w, std::integral_constant<std::size_t, 12 / Blocks - 1>());
+            for (w = cols.last; w < row.out_width; ++w)
+                blocked_tile_avx2<Blocks, 1>(row, w, cols.begin(w), cols.end(w));
+        }
+        // A block of 8 channels is two registers, so tiles are of one block and half as wide.
+        template<std::size_t Pixels>
+        TNN_TARGET_SSE41 void blocked_tile_sse41(const blocked_row &row, std::size_t o, std::size_t w,
+                                                 std::size_t kw_first, std::size_t kw_last) const {
+            std::size_t k = m_kernel_size, step = m_stride * row.block;
+            __m128 low[Pixels], high[Pixels];
+            for (std::size_t t = 0; t < Pixels; ++t) {
+                low[t] = _mm_load_ps(row.bias + o * 8);
+                high[t] = _mm_load_ps(row.bias + o * 8 + 4);
+            }
+            for (std::size_t in = 0; in < m_in_channels; ++in)
+                for (std::size_t kh = row.kh_first; kh < row.kh_last; ++kh) {
+                    const float *p = row.input(in, m_stride, w, kh, kw_first),
+                                *weight = row.weight + o * row.weight_stride + ((in * k + kh) * k + kw_first) * 8;
+                    for (std::size_t kw = kw_first; kw < kw_last; ++kw, p += row.block, weight += 8) {
+                        __m128 v0 = _mm_load_ps(weight), v1 = _mm_load_ps(weight + 4);
+                        for (std::size_t t = 0; t < Pixels; ++t) {
+                            __m128 a = _mm_set1_ps(p[t * step]);
+                            low[t] = _mm_add_ps(low[t], _mm_mul_ps(a, v0));
+                            high[t] = _mm_add_ps(high[t], _mm_mul_ps(a, v1));
+                        }
+                    }
+                }
+            float *dst = row.y + o * row.output_stride + w * 8;
+            for (std::size_t t = 0; t < Pixels; ++t) {
+                if (m_relu) {
+                    low[t] = _mm_max_ps(_mm_setzero_ps(), low[t]);
+                    high[t] = _mm_max_ps(_mm_setzero_ps(), high[t]);
+                }
+                _mm_storeu_ps(dst + t * 8, low[t]);
+                _mm_storeu_ps(dst + t * 8 + 4, high[t]);
+            }
+        }
+        template<std::size_t Pixels>
+        TNN_TARGET_SSE41 void blocked_rest_sse41(const blocked_row &row, std::size_t o, std::size_t w, std::size_t count,
+                                                 std::integral_constant<std::size_t, Pixels>) const {
+            if (count == Pixels)
+                return blocked_tile_sse41<Pixels>(row, o, w, 0, m_kernel_size);
+            blocked_rest_sse41(row, o, w, count, std::integral_constant<std::size_t, Pixels - 1>());
+        }
+        void blocked_rest_sse41(const blocked_row &, std::size_t, std::size_t, std::size_t,
+                                std::integral_constant<std::size_t, 0>) const {}
+        TNN_TARGET_SSE41 void single_blocked_sse41(const blocked_row &row, const window_axis &cols) const {
+            for (std::size_t o = 0; o < row.blocks; ++o) {
+                std::size_t w = 0;
+                for (; w < cols.first; ++w)
+                    blocked_tile_sse41<1>(row, o, w, cols.begin(w), cols.end(w));
+                for (; w + 6 <= cols.last; w += 6)
+                    blocked_tile_sse41<6>(row, o, w, 0, m_kernel_size);
+                blocked_rest_sse41(row, o, w, cols.last - w, std::integral_constant<std::size_t, 5>());
+                for (w = cols.last; w < row.out_width; ++w)
+                    blocked_tile_sse41<1>(row, o, w, cols.begin(w), cols.end(w));
+            }
+        }
+#endif
+
+        template<typename T = U>
+        typename std::enable_if<!std::is_same<T, float>::value>::type
+            single_conv(const tensor_type &x, tensor_type &y, std::size_t i, std::size_t out) const {
+            single_conv_scalar(x, y, i, out);
+        }
+        template<typename T = U>
+        typename std::enable_if<std::is_same<T, float>::value>::type
+            single_conv(const tensor_type &x, tensor_type &y, std::size_t i, std::size_t out) const {
+#if TNN_X86
+            switch (simd::current()) {
+                case simd::avx512: return single_conv_avx512(x, y, i, out);
+                case simd::avx2: return single_conv_avx2(x, y, i, out);
+                case simd::sse41: return single_conv_sse41(x, y, i, out);
+                default: break;
             }
+#endif
+            single_conv_scalar(x, y, i, out);
         }
 
+        // Output pixel (h, w), over the part of its window within the input.
+        U conv_pixel(const tensor_type &x, const window_axis &rows, const window_axis &cols, std::size_t i,
+                     std::size_t out, std::size_t h, std::size_t w) const {
+            U sum = 0;
+            // Wrap around within the padding, and back once kh and kw are added.
+            std::size_t top = m_stride * h - m_padding, left = m_stride * w - m_padding, kh_first = rows.begin(h),
+                        kh_last = rows.end(h), kw_first = cols.begin(w), kw_last = cols.end(w);
+            for (std::size_t in = 0; in < m_in_channels; ++in)
+                for (std::size_t kh = kh_first; kh < kh_last; ++kh)
+                    for (std::size_t kw = kw_first; kw < kw_last; ++kw)
+                        sum += x.at(i, in, top + kh, left + kw) * m_weight.at(out, in, kh, kw);
+            return activate(m_has_bias ? m_bias.at(out) + sum : sum);
+        }
+        // Pixels of row h outside [first, last): the border, whose windows are clipped, and the remainder of the
+        // SIMD kernels.
+        void conv_border(const tensor_type &x, tensor_type &y, const window_axis &rows, const window_axis &cols,
+                         std::size_t i, std::size_t out, std::size_t h, std::size_t first, std::size_t last) const {
+            for (std::size_t w = 0; w < first; ++w)
+                y.at(i, out, h, w) = conv_pixel(x, rows, cols, i, out, h, w);
+            for (std::size_t w = last; w < y.shape(3); ++w)
+                y.at(i, out, h, w) = conv_pixel(x, rows, cols, i, out, h, w);
+        }
+        void single_conv_scalar(const tensor_type &x, tensor_type &y, std::size_t i, std::size_t out) const {
+            window_axis rows = this->rows(x), cols = this->cols(x);
+            for (std::size_t h = 0; h < y.shape(2); ++h)
+                conv_border(x, y, rows, cols, i, out, h, 0, 0);
+        }
+#if TNN_X86
+        // The SIMD kernels compute consecutive pixels of a row at once, reading the inputs m_stride apart: with
+        // plain loads for a stride of 1 and gathers otherwise. They leave out the rows of the windows within the
+        // padding; this one also the columns whose windows reach into it, to conv_pixel.
+        TNN_TARGET_SSE41 void single_conv_sse41(const tensor_type &x, tensor_type &y, std::size_t i, std::size_t out) const {
+            window_axis rows = this->rows(x), cols = this->cols(x);
+            for (std::size_t h = 0; h < y.shape(2); ++h) {
+                std::size_t top = m_stride * h - m_padding, kh_first = rows.begin(h), kh_last = rows.end(h), w = cols.first;
+                for (; w + 4 <= cols.last; w += 4) {
+                    __m128 sum = _mm_setzero_ps();
+                    for (std::size_t in = 0; in < m_in_channels; ++in)
+                        for (std::size_t kh = kh_first; kh < kh_last; ++kh) {
+                            const float *row = x.get_raw(i, in, top + kh, m_stride * w - m_padding);
+                            for (std::size_t kw = 0; kw < m_kernel_size; ++kw, ++row)
+                                sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(m_weight.at(out, in, kh, kw)), m_stride == 1 ? _mm_loadu_ps(row)
+                                        : _mm_setr_ps(row[0], row[m_stride], row[2 * m_stride], row[3 * m_stride])));
+                        }
+                    if (m_has_bias)
+                        sum = _mm_add_ps(sum, _mm_set1_ps(m_bias.at(out)));
+                    if (m_relu)
+                        sum = _mm_max_ps(_mm_setzero_ps(), sum);
+                    _mm_storeu_ps(y.get_raw(i, out, h, w), sum);
+                }
+                conv_border(x, y, rows, cols, i, out, h, cols.first, w);
+            }
+        }
+        // Vectors reaching into the padding on the left or right gather the row, with the lanes over the padding
+        // masked off, which read as zeros.
+        TNN_TARGET_AVX2 void single_conv_avx2(const tensor_type &x, tensor_type &y, std::size_t i, std::size_t out) const {
+            switch (m_fixed_shape) {
+                case 1: return single_conv_fixed_avx2<1, 1>(x, y, i, out);
+                case 2: return single_conv_fixed_avx2<3, 1>(x, y, i, out);
+                case 3: return single_conv_fixed_avx2<5, 1>(x, y, i, out);
+                case 4: return single_conv_fixed_avx2<11, 4>(x, y, i, out);
+                default: break;
+            }
+            window_axis rows = this->rows(x), cols = this->cols(x);
+            for (std::size_t h = 0; h < y.shape(2); ++h)
+                conv_row_avx2(x, y, rows, cols, i, out, h);
+        }
+        TNN_TARGET_AVX2 void conv_row_avx2(const tensor_type &x, tensor_type &y, const window_axis &rows,
+                                           const window_axis &cols, std::size_t i, std::size_t out, std::size_t h) const {
+            const __m256i offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                                                       _mm256_set1_epi32(static_cast<int>(m_stride))),
+                          zero = _mm256_setzero_si256(), limit = _mm256_set1_epi32(static_cast<int>(x.shape(3)));
+            std::size_t width = y.shape(3), top = m_stride * h - m_padding, kh_first = rows.begin(h), kh_last = rows.end(h),
+                        w = 0;
+            for (; w + 8 <= width; w += 8) {
+                bool border = w < cols.first || w + 8 > cols.last;
+                __m256i column = _mm256_add_epi32(offsets, _mm256_set1_epi32(static_cast<int>(m_stride * w) -
+                                                                             static_cast<int>(m_padding)));
+                __m256 sum = _mm256_setzero_ps(), value;
+                for (std::size_t in = 0; in < m_in_channels; ++in)
+                    for (std::size_t kh = kh_first; kh < kh_last; ++kh) {
+                        const float *line = x.get_raw(i, in, top + kh, 0),
+                                    *row = border ? line : line + m_stride * w - m_padding;
+                        for (std::size_t kw = 0; kw < m_kernel_size; ++kw, ++row) {
+                            if (border) {
+                                __m256i at = _mm256_add_epi32(column, _mm256_set1_epi32(static_cast<int>(kw)));
+                                __m256i valid = _mm256_andnot_si256(_mm256_cmpgt_epi32(zero, at), _mm256_cmpgt_epi32(limit, at));
+                                value = _mm256_mask_i32gather_ps(_mm256_setzero_ps(), line, at, _mm256_castsi256_ps(valid), 4);
+                            } else
+                                value = m_stride == 1 ? _mm256_loadu_ps(row) : _mm256_i32gather_ps(row, offsets, 4);
+                            sum = _mm256_fmadd_ps(_mm256_set1_ps(m_weight.at(out, in, kh, kw)), value, sum);
+                        }
+                    }
+                if (m_has_bias)
+                    sum = _mm256_add_ps(sum, _mm256_set1_ps(m_bias.at(out)));
+                if (m_relu)
+                    sum = _mm256_max_ps(_mm256_setzero_ps(), sum);
+                _mm256_storeu_ps(y.get_raw(i, out, h, w), sum);
+            }
+            conv_border(x, y, rows, cols, i, out, h, 0, w);
+        }
+        // The direct kernels of the fixed shapes. Rows whose windows lie within the input go Rows at a time:
+        // with the kernel size and the stride known, the window loops unroll, and every weight, broadcast once,
+        // feeds Rows independent chains of FMAs. The other rows go to the generic row kernel.
+        template<std::size_t K, std::size_t S>
+        TNN_TARGET_AVX2 void single_conv_fixed_avx2(const tensor_type &x, tensor_type &y, std::size_t i, std::size_t out) const {
+            window_axis rows = this->rows(x), cols = this->cols(x);
+            std::size_t h = 0;
+            for (; h < rows.first; ++h)
+                conv_row_avx2(x, y, rows, cols, i, out, h);
+            for (; h + 4 <= rows.last; h += 4)
+                conv_rows_fixed_avx2<K, S, 4>(x, y, i, out, h);
+            for (; h < rows.last; ++h)
+                conv_rows_fixed_avx2<K, S, 1>(x, y, i, out, h);
+            for (; h < y.shape(2); ++h)
+                conv_row_avx2(x, y, rows, cols, i, out, h);
+        }
+        template<std::size_t K, std::size_t S, std::size_t Rows>
+        TNN_TARGET_AVX2 void conv_rows_fixed_avx2(const tensor_type &x, tensor_type &y, std::size_t i, std::size_t out,
+                                                  std::size_t h) const {
+            const __m256i index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                          offsets = _mm256_setr_epi32(0, S, 2 * S, 3 * S, 4 * S, 5 * S, 6 * S, 7 * S),
+                          zero = _mm256_setzero_si256(), limit = _mm256_set1_epi32(static_cast<int>(x.shape(3)));
+            std::size_t width = y.shape(3), line = x.shape(3);
+            for (std::size_t w = 0; w < width; w += 8) {
+                // The lanes within the row, and for every column of the windows those within the input: the
+                // others, at the border and past the end of the row, read as zeros. Only a vector starting
+                // within the left padding gathers with a stride of 1.
+                __m256i lanes = _mm256_cmpgt_epi32(_mm256_set1_epi32(static_cast<int>(std::min<std::size_t>(8, width - w))), index);
+                int left = static_cast<int>(S * w) - static_cast<int>(m_padding);
+                __m256 valid[K];
+                for (std::size_t kw = 0; kw < K; ++kw) {
+                    __m256i at = _mm256_add_epi32(offsets, _mm256_set1_epi32(left + static_cast<int>(kw)));
+                    valid[kw] = _mm256_castsi256_ps(_mm256_and_si256(lanes, _mm256_andnot_si256(_mm256_cmpgt_epi32(zero, at),
+                                                                                                _mm256_cmpgt_epi32(limit, at))));
+                }
+                __m256 sum[Rows];
+                for (std::size_t r = 0; r < Rows; ++r)
+                    sum[r] = _mm256_setzero_ps();
+                for (std::size_t in = 0; in < m_in_channels; ++in) {
+                    const float *plane = x.get_raw(i, in, S * h - m_padding, 0), *weight = m_weight.get_raw(out, in, 0, 0);
+                    for (std::size_t kh = 0; kh < K; ++kh)
+                        for (std::size_t kw = 0; kw < K; ++kw) {
+                            __m256 scale = _mm256_set1_ps(weight[kh * K + kw]);
+                            int start = left + static_cast<int>(kw);
+                            for (std::size_t r = 0; r < Rows; ++r) {
+                                const float *src = plane + (S * r + kh) * line;
+                                __m256 value = S == 1 && start >= 0
+                                               ? _mm256_maskload_ps(src + start, _mm256_castps_si256(valid[kw]))
+                                               : _mm256_mask_i32gather_ps(_mm256_setzero_ps(), src,
+                                                                          _mm256_add_epi32(offsets, _mm256_set1_epi32(start)),
+                                                                          valid[kw], 4);
+                                sum[r] = _mm256_fmadd_ps(scale, value, sum[r]);
+                            }
+                        }
+                }
+                for (std::size_t r = 0; r < Rows; ++r) {
+                    if (m_has_bias)
+                        sum[r] = _mm256_add_ps(sum[r], _mm256_set1_ps(m_bias.at(out)));
+                    if (m_relu)
+                        sum[r] = _mm256_max_ps(_mm256_setzero_ps(), sum[r]);
+                    _mm256_maskstore_ps(y.get_raw(i, out, h + r, w), lanes, sum[r]);
+                }
+            }
+        }
+        TNN_TARGET_AVX512 void single_conv_avx512(const tensor_type &x, tensor_type &y, std::size_t i, std::size_t out) const {
+            switch (m_fixed_shape) {
+                case 1: return single_conv_fixed_avx512<1, 1>(x, y, i, out);
+                case 2: return single_conv_fixed_avx512<3, 1>(x, y, i, out);
+                case 3: return single_conv_fixed_avx512<5, 1>(x, y, i, out);
+                case 4: return single_conv_fixed_avx512<11, 4>(x, y, i, out);
+                default: break;
+            }
+            window_axis rows = this->rows(x), cols = this->cols(x);
+            for (std::size_t h = 0; h < y.shape(2); ++h)
+                conv_row_avx512(x, y, rows, cols, i, out, h);
+        }
+        TNN_TARGET_AVX512 void conv_row_avx512(const tensor_type &x, tensor_type &y, const window_axis &rows,
+                                               const window_axis &cols, std::size_t i, std::size_t out, std::size_t h) const {
+            const __m512i offsets = _mm512_mullo_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+                                                       _mm512_set1_epi32(static_cast<int>(m_stride))),
+                          limit = _mm512_set1_epi32(static_cast<int>(x.shape(3)));
+            std::size_t width = y.shape(3), top = m_stride * h - m_padding, kh_first = rows.begin(h), kh_last = rows.end(h);
+            for (std::size_t w = 0; w < width; w += 16) {
+                // Rows narrower than a register, such as the 13 pixels of conv3, only use some of the lanes.
+                __mmask16 lanes = simd::mask16(width - w);
+                bool border = w < cols.first || std::min(w + 16, width) > cols.last;
+                std::ptrdiff_t left = static_cast<std::ptrdiff_t>(m_stride * w) - static_cast<std::ptrdiff_t>(m_padding);
+                __m512i column = _mm512_add_epi32(offsets, _mm512_set1_epi32(static_cast<int>(left)));
+                __m512 sum = _mm512_setzero_ps(), value;
+                for (std::size_t in = 0; in < m_in_channels; ++in)
+                    for (std::size_t kh = kh_first; kh < kh_last; ++kh) {
+                        const float *line = x.get_raw(i, in, top + kh, 0),
+                                    *row = border ? line : line + m_stride * w - m_padding;
+                        for (std::size_t kw = 0; kw < m_kernel_size; ++kw, ++row) {
+                            if (border) {
+                                // Negative columns compare as large unsigned ones. With a stride of 1, the lanes
+                                // left read consecutive elements: from the start of the row on if some lanes are
+                                // over the left padding, which the expanding load skips.
+                                __m512i at = _mm512_add_epi32(column, _mm512_set1_epi32(static_cast<int>(kw)));
+                                __mmask16 valid = lanes & _mm512_cmplt_epu32_mask(at, limit);
+                                std::ptrdiff_t start = left + static_cast<std::ptrdiff_t>(kw);
+                                if (m_stride != 1)
+                                    value = _mm512_mask_i32gather_ps(_mm512_setzero_ps(), valid, at, line, 4);
+                                else if (start < 0)
+                                    value = _mm512_maskz_expandloadu_ps(valid, line);
+                                else
+                                    value = _mm512_maskz_loadu_ps(valid, line + start);
+                            } else
+                                value = m_stride == 1 ? _mm512_maskz_loadu_ps(lanes, row)
+                                                      : _mm512_mask_i32gather_ps(_mm512_setzero_ps(), lanes, offsets, row, 4);
+                            sum = _mm512_fmadd_ps(_mm512_set1_ps(m_weight.at(out, in, kh, kw)), value, sum);
+                        }
+                    }
+                if (m_has_bias)
+                    sum = _mm512_add_ps(sum, _mm512_set1_ps(m_bias.at(out)));
+                if (m_relu)
+                    sum = _mm512_max_ps(_mm512_setzero_ps(), sum);
+                _mm512_mask_storeu_ps(y.get_raw(i, out, h, w), lanes, sum);
+            }
+        }
+        // See single_conv_fixed_avx2().
+        template<std::size_t K, std::size_t S>
+        TNN_TARGET_AVX512 void single_conv_fixed_avx512(const tensor_type &x, tensor_type &y, std::size_t i, std::size_t out) const {
+            window_axis rows = this->rows(x), cols = this->cols(x);
+            std::size_t h = 0;
+            for (; h < rows.first; ++h)
+                conv_row_avx512(x, y, rows, cols, i, out, h);
+            for (; h + 4 <= rows.last; h += 4)
+                conv_rows_fixed_avx512<K, S, 4>(x, y, cols, i, out, h);
+            for (; h < rows.last; ++h)
+                conv_rows_fixed_avx512<K, S, 1>(x, y, cols, i, out, h);
+            for (; h < y.shape(2); ++h)
+                conv_row_avx512(x, y, rows, cols, i, out, h);
+        }
+        template<std::size_t K, std::size_t S, std::size_t Rows>
+        TNN_TARGET_AVX512 void conv_rows_fixed_avx512(const tensor_type &x, tensor_type &y, const window_axis &cols,
+                                                      std::size_t i, std::size_t out, std::size_t h) const {
+            const __m512i offsets = _mm512_setr_epi32(0, S, 2 * S, 3 * S, 4 * S, 5 * S, 6 * S, 7 * S, 8 * S, 9 * S,
+                                                      10 * S, 11 * S, 12 * S, 13 * S, 14 * S, 15 * S),
+                          limit = _mm512_set1_epi32(static_cast<int>(x.shape(3)));
+            std::size_t width = y.shape(3), line = x.shape(3);
+            for (std::size_t w = 0; w < width; w += 16) {
+                // As in conv_row_avx512(), but the lanes and start of every column of the windows are worked out
+                // once for all the channels.
+                __mmask16 lanes = simd::mask16(width - w), valid[K];
+                std::ptrdiff_t left = static_cast<std::ptrdiff_t>(S * w) - static_cast<std::ptrdiff_t>(m_padding);
+                bool border = w < cols.first || std::min(w + 16, width) > cols.last;
+                for (std::size_t kw = 0; kw < K; ++kw)
+                    valid[kw] = lanes & _mm512_cmplt_epu32_mask(_mm512_add_epi32(offsets,
+                            _mm512_set1_epi32(static_cast<int>(left + static_cast<std::ptrdiff_t>(kw)))), limit);
+                __m512 sum[Rows];
+                for (std::size_t r = 0; r < Rows; ++r)
+                    sum[r] = _mm512_setzero_ps();
+                for (std::size_t in = 0; in < m_in_channels; ++in) {
+                    const float *plane = x.get_raw(i, in, S * h - m_padding, 0), *weight = m_weight.get_raw(out, in, 0, 0);
+                    for (std::size_t kh = 0; kh < K; ++kh)
+                        for (std::size_t kw = 0; kw < K; ++kw) {
+                            __m512 scale = _mm512_set1_ps(weight[kh * K + kw]);
+                            std::ptrdiff_t start = left + static_cast<std::ptrdiff_t>(kw);
+                            for (std::size_t r = 0; r < Rows; ++r) {
+                                const float *src = plane + (S * r + kh) * line;
+                                __m512 value = S != 1 ? _mm512_mask_i32gather_ps(_mm512_setzero_ps(), valid[kw],
+                                                                                 _mm512_add_epi32(offsets, _mm512_set1_epi32(static_cast<int>(start))), src, 4)
+                                               : border && start < 0 ? _mm512_maskz_expandloadu_ps(valid[kw], src)
+                                               : _mm512_maskz_loadu_ps(valid[kw], src + start);
+                                sum[r] = _mm512_fmadd_ps(scale, value, sum[r]);
+                            }
+                        }
+                }
+                for (std::size_t r = 0; r < Rows; ++r) {
+                    if (m_has_bias)
+                        sum[r] = _mm512_add_ps(sum[r], _mm512_set1_ps(m_bias.at(out)));
+                    if (m_relu)
+                        sum[r] = _mm512_max_ps(_mm512_setzero_ps(), sum[r]);
+                    _mm512_mask_storeu_ps(y.get_raw(i, out, h + r, w), lanes, sum[r]);
+                }
+            }
+        }
+#endif
 
         std::size_t m_in_channels, m_out_channels, m_kernel_size, m_stride, m_padding;
-        bool m_has_bias;
+        bool m_has_bias, m_quantized, m_relu;
+        // Picked by fixed_shape() at construction, 0 if set_fixed_kernels() disabled them.
+        std::size_t m_fixed_shape;
+        conv2d_mode m_mode;
         tensor_type m_weight, m_bias;
+        gemm::packed_operand<gemm::mr, U> m_packed_weight;
+        std::vector<gemm::packed_operand<gemm::mr, U> > m_winograd_weight;
+        // Two per bin of the spectra: the real parts, then the imaginary ones.
+        std::vector<gemm::packed_operand<gemm::mr, U> > m_fft_weight;
+        fft::transform<U> m_fft;
+        // {blocks, in_channels, kernel_size, kernel_size, block} and {blocks, block}, whatever the allocator of the
+        // layer 64-byte aligned, so that every vector of a block is loaded aligned.
+        aligned_tensor m_blocked_weight, m_blocked_bias;
+        // The stride 1 convolution of the space_to_depth mode.
+        std::shared_ptr<conv2d> m_space_to_depth;
+        qgemm::packed_weight m_quantized_weight;
+        qgemm::range m_input_range;
     };
 }
 
@@ -2,39 +2,147 @@
 #define LAYER_H
 
 
+#include <string>
+#include <ostream>
+
 #include "threadpool.h"
+#include "workspace.h"
+#include "profiler.h"
+#include "packed_cache.h"
 #include "tensor/tensor.h"
 
 namespace tnn {
-    template <typename U = float, typename Allocator = std::allocator<U> >
+    template <typename U = float, typename Allocator = aligned_allocator<U> >
     class layer {
     public:
         typedef tensor<U, Allocator> tensor_type;
-        virtual tensor_type forward(tensor_type &&tensor, thread_pool &threads) const = 0;
-        virtual void load(std::istream &in) {}
+        typedef workspace<U, Allocator> workspace_type;
+        // Outputs and temporaries are acquired from `ws`.
+        virtual tensor_type forward(tensor_type &&tensor, thread_pool &threads, workspace_type &ws) const = 0;
+        // Acquires exactly what forward() would from `ws` and returns a tensor of the output shape, without
+        // computing anything. Layers working in place need not override it.
+        virtual tensor_type plan(tensor_type &&tensor, workspace_type &ws) const {
+            return std::move(tensor);
+        }
+        // Reads the parameters() one after another.
+        virtual void load(std::istream &in) {
+            std::vector<tensor_type *> tensors = parameters();
+            for (std::size_t i = 0; i < tensors.size(); ++i)
+                tensors[i]->load(in);
+            prepare();
+        }
+        // Same as load(std::istream &), but parameters point into the mapping instead of being read.
+        virtual void load(mapped_file &in) {
+            std::vector<tensor_type *> tensors = parameters();
+            for (std::size_t i = 0; i < tensors.size(); ++i)
+                tensors[i]->map(in);
+            prepare();
+        }
+        // Tensors stored in data files, in file order.
+        virtual std::vector<tensor_type *> parameters() {
+            return {};
+        }
+        // Called once the parameters are loaded, e.g. to pack them. Packing is left to load_packed() while
+        // packed_cache::deferred().
+        virtual void prepare() {}
+        // What prepare() and the setup since made of the parameters, for a packed cache (see packed_cache.h).
+        // load_packed() maps what save_packed() wrote for a layer loaded and set up the same way, with packing
+        // deferred, and returns false if `in` does not hold that.
+        virtual void save_packed(std::ostream &out) const {}
+        virtual bool load_packed(mapped_file &in) {
+            return true;
+        }
+        // Makes the layer apply the relu following it to its outputs as it stores them, so that the relu needs no
+        // pass of its own. Returns false if the layer cannot. See fuse().
+        virtual bool fuse_relu() {
+            return false;
+        }
+        // Type name, as in model files.
+        virtual const char *type() const {
+            return "layer";
+        }
+        // Operations of a forward pass between these shapes: multiply-adds count twice, comparisons and
+        // additions once.
+        virtual double flops(const std::vector<std::size_t> &input, const std::vector<std::size_t> &output) const {
+            return 0;
+        }
         virtual ~layer() {};
+    protected:
+        static double elements(const std::vector<std::size_t> &shape) {
+            double result = 1;
+            for (std::size_t i = 0; i < shape.size(); ++i)
+                result *= shape[i];
+            return result;
+        }
     };
 
-    template <typename U = float, typename Allocator = std::allocator<U> >
+    template <typename U = float, typename Allocator = aligned_allocator<U> >
     class layers: public layer<U, Allocator> {
     public:
         typedef layer<U, Allocator> layer_type;
         typedef typename layer_type::tensor_type tensor_type;
+        typedef typename layer_type::workspace_type workspace_type;
         layers(std::initializer_list<std::shared_ptr<layer_type> > layers)
                 : m_layers(layers) {}
-        tensor_type forward(tensor_type &&x, thread_pool &threads) const {
+        explicit layers(std::vector<std::shared_ptr<layer_type> > layers)
+                : m_layers(std::move(layers)) {}
+        tensor_type forward(tensor_type &&x, thread_pool &threads, workspace_type &ws) const {
+            for (std::size_t i = 0; i < m_layers.size(); ++i)
+                if (profiler::enabled())
+                    x = profile_forward(i, std::move(x), threads, ws);
+                else
+                    x = m_layers[i]->forward(std::move(x), threads, ws);
+            return std::move(x);
+        }
+        tensor_type plan(tensor_type &&x, workspace_type &ws) const {
             for (std::size_t i = 0; i < m_layers.size(); ++i)
-                x = m_layers[i]->forward(std::move(x), threads);
-            return x;
+                x = m_layers[i]->plan(std::move(x), ws);
+            return std::move(x);
         }
         void load(std::istream &in) {
             for (std::size_t i = 0; i < m_layers.size(); ++i)
                 m_layers[i]->load(in);
         }
+        void load(mapped_file &in) {
+            for (std::size_t i = 0; i < m_layers.size(); ++i)
+                m_layers[i]->load(in);
+        }
+        void save_packed(std::ostream &out) const {
+            for (std::size_t i = 0; i < m_layers.size(); ++i)
+                m_layers[i]->save_packed(out);
+        }
+        bool load_packed(mapped_file &in) {
+            for (std::size_t i = 0; i < m_layers.size(); ++i)
+                if (!m_layers[i]->load_packed(in))
+                    return false;
+            return true;
+        }
+        const std::vector<std::shared_ptr<layer_type> > &get_layers() const {
+            return m_layers;
+        }
+        std::vector<std::shared_ptr<layer_type> > &get_layers() {
+            return m_layers;
+        }
+        const char *type() const {
+            return "layers";
+        }
 
     private:
+        tensor_type profile_forward(std::size_t i, tensor_type &&x, thread_pool &threads, workspace_type &ws) const {
+            std::vector<std::size_t> shape = x.shape();
+            std::size_t size = ws.size();
+            profiler::clock::time_point begin = profiler::clock::now();
+            x = m_layers[i]->forward(std::move(x), threads, ws);
+            profiler::clock::time_point end = profiler::clock::now();
+            profiler::instance().record(profiler::event{
+                    profiler::layer_event, m_layers[i]->type() + ("[" + std::to_string(i) + "]"), m_layers[i].get(), 0,
+                    begin, end, profiler::clock::duration(), m_layers[i]->flops(shape, x.shape()), ws.size() - size
+            });
+            return std::move(x);
+        }
+
         std::vector<std::shared_ptr<layer_type> > m_layers;
     };
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -1,85 +1,187 @@
 #ifndef LINEAR_H
 #define LINEAR_H
 
-#include <type_traits>
-
 #include "layer.h"
-#include "avx.h"
+#include "gemm.h"
+#include "qgemm.h"
 
 namespace tnn {
-    template <typename U = float, typename Allocator = std::allocator<U> >
+    template <typename U = float, typename Allocator = aligned_allocator<U> >
     class linear: public layer<U, Allocator> {
     public:
         typedef typename layer<U, Allocator>::tensor_type tensor_type;
+        typedef typename layer<U, Allocator>::workspace_type workspace_type;
         linear(std::size_t in_features, std::size_t out_features, bool bias = true)
-                : m_in_features(in_features), m_out_features(out_features), m_has_bias(bias),
+                : m_in_features(in_features), m_out_features(out_features), m_has_bias(bias), m_quantized(false), m_relu(false),
                   m_weight({out_features, in_features}) {
             if (bias)
                 m_bias.resize({out_features});
         }
 
-        tensor_type forward(tensor_type &&x, thread_pool &threads) const {
+        tensor_type forward(tensor_type &&x, thread_pool &threads, workspace_type &ws) const {
             assert(x.ndim() == 2 && x.shape(1) == m_in_features);
-            tensor_type y{x.shape(0), m_out_features};
-            std::size_t start = 0;
-            std::vector<std::future<void> > sync;
-            sync.reserve(threads.get_thread_num());
-            double step = (double) y.size() / threads.get_thread_num();
-            for (std::size_t i = 0; i < threads.get_thread_num(); ++i) {
-                std::size_t end = (int) (step * (i + 1) + 0.5);
-                if (start != end)
-                    sync.emplace_back(threads.enqueue([this, &x, &y](std::size_t s, std::size_t e) {
-                        for (; s < e; ++s) {
-                            std::size_t i = s / m_out_features, j = s % m_out_features;
-                            single_linear(x, y, i, j);
-                        }
-                    }, start, end));
-                start = end;
+            // y = x W^T. Every task takes a block of output features for the whole batch, so each panel of the
+            // packed weights is read once per forward and reused for all rows of x.
+            if (m_quantized) {
+                tensor_type q = plan_quantized(x, ws);
+                tensor_type y = plan_output(x, ws);
+                forward_int8(x, q, y, threads);
+                return y;
             }
-            for (std::size_t i = 0; i < sync.size(); ++i)
-                sync[i].get();
+            tensor_type y = plan_output(x, ws);
+            std::size_t panels = (m_out_features + gemm::nr - 1) / gemm::nr;
+            std::size_t grain = (panels + threads.get_thread_num()) / (threads.get_thread_num() + 1);
+            threads.parallel_for(0, panels, grain, [this, &x, &y](std::size_t s, std::size_t e) {
+                single_linear(x, y, s * gemm::nr, std::min(e * gemm::nr, m_out_features));
+            });
             return y;
         }
-        void load(std::istream &in) {
-            m_weight.load(in);
+        tensor_type plan(tensor_type &&x, workspace_type &ws) const {
+            tensor_type q = m_quantized ? plan_quantized(x, ws) : tensor_type();
+            return plan_output(x, ws);
+        }
+        std::vector<tensor_type *> parameters() {
             if (m_has_bias)
-                m_bias.load(in);
+                return {&m_weight, &m_bias};
+            return {&m_weight};
         }
-    protected:
-#if AVX_ENABLED
-        template<bool ForceDisableAVX = false>
-        typename std::enable_if<std::is_same<U, float>::value && AVX_ENABLED && !ForceDisableAVX>::type
-            single_linear(const tensor_type &x, tensor_type &y, std::size_t i, std::size_t j) const {
-            __m256 acc = _mm256_setzero_ps();
-            std::size_t k;
-            for (k = 0; k + 7 < x.shape(1); k += 8) {
-                __m256 a = _mm256_loadu_ps(x.get_raw(i, k));
-                __m256 b = _mm256_loadu_ps(m_weight.get_raw(j, k));
-                __m256 prod = _mm256_mul_ps(a, b);
-                acc = _mm256_add_ps(acc, prod);
+        const char *type() const {
+            return "linear";
+        }
+        double flops(const std::vector<std::size_t> &input, const std::vector<std::size_t> &output) const {
+            return (2 * m_in_features + m_relu) * this->elements(output);
+        }
+        bool fuse_relu() {
+            m_relu = true;
+            return true;
+        }
+        bool relu_fused() const {
+            return m_relu;
+        }
+        // Mapped weights are not packed but read from the mapping, so that all processes share one copy of them.
+        // A packed cache gives them packed weights to share instead, see save_packed().
+        void prepare() {
+            m_packed_weight = gemm::packed_operand<gemm::nr, U>();
+            if (packed_cache::deferred())
+                return;
+            if (m_quantized)
+                m_quantized_weight.pack(m_out_features, m_in_features, m_weight.get_raw(), m_in_features, 1);
+            else if (!m_weight.mapped())
+                m_packed_weight.pack(m_out_features, m_in_features, m_weight.get_raw(), m_in_features, 1);
+        }
+        // The state quantize() leaves, then the packed weights, packed here if they are mapped.
+        void save_packed(std::ostream &out) const {
+            packed_state state {m_quantized, m_input_range.scale, m_input_range.zero_point};
+            out.write(reinterpret_cast<const char *>(&state), sizeof(state));
+            if (m_quantized)
+                m_quantized_weight.save(out);
+            else if (!m_packed_weight.empty())
+                m_packed_weight.save(out);
+            else {
+                gemm::packed_operand<gemm::nr, U> packed;
+                packed.pack(m_out_features, m_in_features, m_weight.get_raw(), m_in_features, 1);
+                packed.save(out);
             }
-            float sum = mm256_sum(acc);
-            for (; k < x.shape(1); ++k)
-                sum += x.at(i, k) * m_weight.at(j, k);
-            if (m_has_bias)
-                sum += m_bias.at(j);
-            y.at(i, j) = sum;
         }
-#endif
-        template<bool ForceDisableAVX = false>
-        typename std::enable_if<!(std::is_same<U, float>::value && AVX_ENABLED && !ForceDisableAVX)>::type
-            single_linear(const tensor_type &x, tensor_type &y, std::size_t i, std::size_t j) const {
-            typename tensor_type::data_type sum = 0;
-            for (std::size_t k = 0; k < x.shape(1); ++k)
-                sum += x.at(i, k) * m_weight.at(j, k);
+        bool load_packed(mapped_file &in) {
+            packed_state state;
+            const char *header = in.read(sizeof(state));
+            if (!header)
+                return false;
+            std::memcpy(&state, header, sizeof(state));
+            m_quantized = state.quantized;
+            m_input_range = qgemm::range(state.scale, state.zero_point);
+            return m_quantized ? m_quantized_weight.map(in, m_out_features, m_in_features)
+                               : m_packed_weight.map(in, m_out_features, m_in_features);
+        }
+        // Runs the layer in INT8 from now on, with inputs quantized by `input` and weights per output feature.
+        // The float weights stay loaded but are no longer read.
+        void quantize(const qgemm::range &input) {
+            m_quantized = true;
+            m_input_range = input;
+            prepare();
+        }
+        bool quantized() const {
+            return m_quantized;
+        }
+        // Parameters read by the INT8 path, in bytes.
+        std::size_t quantized_bytes() const {
+            return m_quantized_weight.bytes() + m_bias.size() * sizeof(U);
+        }
+    protected:
+        // An output as stored, through the relu if one is fused.
+        U activate(U value) const {
+            return m_relu && value < 0 ? U() : value;
+        }
+        // Quantized rows of x, padded to the depth of the quantized weights.
+        tensor_type plan_quantized(const tensor_type &x, workspace_type &ws) const {
+            return ws.acquire({x.shape(0), (m_quantized_weight.depth() + sizeof(U) - 1) / sizeof(U)});
+        }
+        tensor_type plan_output(const tensor_type &x, workspace_type &ws) const {
+            return ws.acquire({x.shape(0), m_out_features});
+        }
+        void single_linear(const tensor_type &x, tensor_type &y, std::size_t s, std::size_t e) const {
+            std::size_t n = x.shape(0);
+            gemm::strided_operand<gemm::mr, U> a(x.get_raw(0, 0), m_in_features, 1);
+            if (m_packed_weight.empty())
+                gemm::multiply(n, e - s, m_in_features, a,
+                               gemm::strided_operand<gemm::nr, U>(m_weight.get_raw(s, 0), m_in_features, 1),
+                               y.get_raw(0, s), m_out_features);
+            else
+                gemm::multiply(n, e - s, m_in_features, a,
+                               gemm::operand_slice<gemm::packed_operand<gemm::nr, U> >(m_packed_weight, s),
+                               y.get_raw(0, s), m_out_features);
             if (m_has_bias)
-                sum += m_bias.at(j);
-            y.at(i, j) = sum;
+                for (std::size_t i = 0; i < n; ++i)
+                    for (std::size_t j = s; j < e; ++j)
+                        y.at(i, j) += m_bias.at(j);
+            if (m_relu)
+                for (std::size_t i = 0; i < n; ++i)
+                    for (std::size_t j = s; j < e; ++j)
+                        y.at(i, j) = activate(y.at(i, j));
+        }
+        void forward_int8(const tensor_type &x, tensor_type &q, tensor_type &y, thread_pool &threads) const {
+            std::size_t n = x.shape(0), depth = m_quantized_weight.depth();
+            std::uint8_t *rows = reinterpret_cast<std::uint8_t *>(q.get_raw());
+            threads.parallel_for(0, n, 1, [this, &x, rows, depth](std::size_t s, std::size_t e) {
+                for (; s < e; ++s) {
+                    qgemm::quantize(x.get_raw(s, 0), m_in_features, m_input_range, rows + s * depth);
+                    std::fill(rows + s * depth + m_in_features, rows + (s + 1) * depth, 0);
+                }
+            });
+            // As in the float path, every task takes a block of output features for the whole batch.
+            std::size_t panels = (m_out_features + qgemm::nr - 1) / qgemm::nr;
+            std::size_t grain = (panels + threads.get_thread_num()) / (threads.get_thread_num() + 1);
+            threads.parallel_for(0, panels, grain, [this, &y, rows, n, depth](std::size_t s, std::size_t e) {
+                aligned_vector<std::int32_t> &c = qgemm::thread_buffer<std::int32_t>(0);
+                s *= qgemm::nr;
+                e = std::min(e * qgemm::nr, m_out_features);
+                for (std::size_t j0 = s; j0 < e; j0 += qgemm::nc) {
+                    std::size_t cols = std::min(qgemm::nc, e - j0);
+                    c.resize(std::max(c.size(), n * cols));
+                    qgemm::multiply(n, cols, rows, depth, m_quantized_weight, j0, &c[0], cols);
+                    for (std::size_t j = 0; j < cols; ++j) {
+                        U scale = m_input_range.scale * m_quantized_weight.scale(j0 + j);
+                        std::int32_t offset = m_input_range.zero_point * m_quantized_weight.sum(j0 + j);
+                        U b = m_has_bias ? m_bias.at(j0 + j) : U();
+                        for (std::size_t i = 0; i < n; ++i)
+                            y.at(i, j0 + j) = activate(scale * (c[i * cols + j] - offset) + b);
+                    }
+                }
+            });
         }
     private:
+        struct packed_state {
+            std::uint32_t quantized;
+            float scale;
+            std::int32_t zero_point;
+        };
         std::size_t m_in_features, m_out_features;
-        bool m_has_bias;
+        bool m_has_bias, m_quantized, m_relu;
         tensor_type m_weight, m_bias;
+        gemm::packed_operand<gemm::nr, U> m_packed_weight;
+        qgemm::packed_weight m_quantized_weight;
+        qgemm::range m_input_range;
     };
 }
 
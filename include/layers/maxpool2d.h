@@ -2,80 +2,325 @@
 #define MAXPOOL2D_H
 
 #include <limits>
+#include <cstring>
+#include <algorithm>
+#include <type_traits>
 #include "layer.h"
+#include "simd.h"
+#include "window.h"
+#include "aligned_allocator.h"
 
 namespace tnn {
-    template <typename U = float, typename Allocator = std::allocator<U> >
+    template <typename U = float, typename Allocator = aligned_allocator<U> >
     class maxpool2d: public layer<U, Allocator> {
     public:
         typedef typename layer<U, Allocator>::tensor_type tensor_type;
+        typedef typename layer<U, Allocator>::workspace_type workspace_type;
         maxpool2d(std::size_t kernel_size, std::size_t stride = 0, std::size_t padding = 0)
-                : m_kernel_size(kernel_size), m_stride(stride), m_padding(padding) {
-            if (stride == 0)
-                stride = kernel_size;
-        }
-        tensor_type forward(tensor_type &&x, thread_pool &threads) const {
-            assert(x.ndim() == 4);
-            std::size_t n = x.shape(0), channels = x.shape(1), start = 0;
-            std::vector<std::future<void> > sync;
-            double step;
-            if (m_padding) {
-                sync.reserve(threads.get_thread_num());
-                tensor_type temp{n, x.shape(1), x.shape(2) + 2 * m_padding, x.shape(3) + 2 * m_padding};
-                step = (double) n * x.shape(1) * x.shape(2) / threads.get_thread_num();
-                for (std::size_t i = 0; i < threads.get_thread_num(); ++i) {
-                    std::size_t end = (int) (step * (i + 1) + 0.5);
-                    if (start != end)
-                        sync.emplace_back(threads.enqueue([this, &temp, &x](std::size_t s, std::size_t e) {
-                            for (std::size_t j = s; j < e; ++j) {
-                                std::size_t c = j / x.shape(2), h = j % x.shape(2);
-                                memcpy(temp.get_raw(c, h + m_padding, m_padding), x.get_raw(c, h, 0), x.shape(3) * sizeof(float));
-                            }
-                        }, start, end));
-                    start = end;
+                : m_kernel_size(kernel_size), m_stride(stride ? stride : kernel_size), m_padding(padding), m_relu(false) {}
+        tensor_type forward(tensor_type &&x, thread_pool &threads, workspace_type &ws) const {
+            assert(x.ndim() == 4 || x.layout() != tensor_layout::nchw);
+            std::size_t n = x.shape(0), channels = x.shape(1);
+            tensor_type y = plan_output(x, ws);
+            // Blocked tensors are pooled a block of channels at a time, and stay blocked.
+            planes p {x, y, x.layout() == tensor_layout::nchw ? 1 : x.shape(4), rows(x), cols(x), nullptr, nullptr};
+            select(p.b, p.pool_row, p.pool_column);
+            threads.parallel_for(0, n * channels, 1, [this, &p](std::size_t s, std::size_t e) {
+                for (std::size_t j = s; j < e; ++j)
+                    single_maxpool2d(p, j);
+            });
+            return y;
+        }
+        tensor_type plan(tensor_type &&x, workspace_type &ws) const {
+            return plan_output(x, ws);
+        }
+        const char *type() const {
+            return "maxpool2d";
+        }
+        double flops(const std::vector<std::size_t> &input, const std::vector<std::size_t> &output) const {
+            return this->elements(output) * m_kernel_size * m_kernel_size;
+        }
+        // The maximum is then taken with zero as well, like that of a clipped window.
+        bool fuse_relu() {
+            m_relu = true;
+            return true;
+        }
+        bool relu_fused() const {
+            return m_relu;
+        }
+    private:
+        // Maximum along a row: out[w] = max(row[s w], ..., row[s w + k - 1]) for count outputs, of b channels
+        // each, b consecutive elements per pixel.
+        typedef void (maxpool2d::*row_kernel)(const U *row, std::size_t count, std::size_t b, U *out) const;
+        // Maximum across rows: out[j] = max(start, rows[0][j], ..., rows[count - 1][j]) for n elements.
+        typedef void (maxpool2d::*column_kernel)(const U *const *rows, std::size_t count, std::size_t n, U start,
+                                                 U *out) const;
+
+        // What single_maxpool2d() needs of x and y, the same for all their planes, with b channels per pixel.
+        struct planes {
+            const tensor_type &x;
+            tensor_type &y;
+            std::size_t b;
+            window_axis rows, cols;
+            row_kernel pool_row;
+            column_kernel pool_column;
+        };
+
+        // The padding is never stored: kernels clip the windows to the input through these, and take the
+        // maximum with zero, the value of the padding, where they do.
+        window_axis rows(const tensor_type &x) const {
+            return window_axis(x.shape(2), m_kernel_size, m_stride, m_padding);
+        }
+        window_axis cols(const tensor_type &x) const {
+            return window_axis(x.shape(3), m_kernel_size, m_stride, m_padding);
+        }
+        // Value the maximum of a window starts from.
+        U initial(bool clipped) const {
+            return clipped || m_relu ? U() : -std::numeric_limits<U>::max();
+        }
+        tensor_type plan_output(const tensor_type &x, workspace_type &ws) const {
+            std::vector<std::size_t> shape = x.shape();
+            shape[2] = rows(x).output;
+            shape[3] = cols(x).output;
+            return ws.acquire(shape);
+        }
+        // Rows pooled along, m_kernel_size of them, the input row r in row r % m_kernel_size, each padded to a
+        // multiple of 16 elements so that vectors may run past the outputs. Then the pointers to those under a
+        // window.
+        static aligned_vector<U> &ring() {
+            static thread_local aligned_vector<U> buffer;
+            return buffer;
+        }
+        static std::vector<const U *> &sources() {
+            static thread_local std::vector<const U *> buffer;
+            return buffer;
+        }
+
+        template<typename T = U>
+        typename std::enable_if<!std::is_same<T, float>::value>::type
+            select(std::size_t b, row_kernel &pool_row, column_kernel &pool_column) const {
+            pool_row = &maxpool2d::pool_row_scalar;
+            pool_column = &maxpool2d::pool_column_scalar;
+        }
+        // Blocks of 8 channels under AVX-512 are pooled along rows by the AVX2 kernels.
+        template<typename T = U>
+        typename std::enable_if<std::is_same<T, float>::value>::type
+            select(std::size_t b, row_kernel &pool_row, column_kernel &pool_column) const {
+            pool_row = &maxpool2d::pool_row_scalar;
+            pool_column = &maxpool2d::pool_column_scalar;
+#if TNN_X86
+            switch (simd::current()) {
+                case simd::avx512:
+                    pool_row = b == 1 ? &maxpool2d::pool_row_avx512 : b == 16 ? &maxpool2d::pool_blocked_row_avx512
+                                                                               : &maxpool2d::pool_blocked_row_avx2;
+                    pool_column = &maxpool2d::pool_column_avx512;
+                    break;
+                case simd::avx2:
+                    pool_row = b == 1 ? &maxpool2d::pool_row_avx2 : &maxpool2d::pool_blocked_row_avx2;
+                    pool_column = &maxpool2d::pool_column_avx2;
+                    break;
+                case simd::sse41:
+                    pool_row = b == 1 ? &maxpool2d::pool_row_sse41 : &maxpool2d::pool_blocked_row_sse41;
+                    pool_column = &maxpool2d::pool_column_sse41;
+                    break;
+                default: break;
+            }
+#endif
+        }
+
+        // Plane j of x, channel j % channels of image j / channels, or a block of channels of a blocked image.
+        // The pooling is separable: every input row some window reaches is pooled along the row once, for the
+        // outputs whose windows lie within it, into ring(), and an output row is then the maximum of the ring
+        // rows under its window. Overlapping windows, e.g. 3x3 with stride 2, thus read every input element once
+        // instead of up to 4 times, and both passes are vector loads and maxima over the outputs, or over the
+        // channels of blocked pixels. The outputs whose windows are clipped at the left and right are pooled
+        // pixel by pixel.
+        void single_maxpool2d(const planes &p, std::size_t j) const {
+            const window_axis &rows = p.rows, &cols = p.cols;
+            std::size_t b = p.b, width = p.x.shape(3) * b, out_width = p.y.shape(3) * b, count = cols.last - cols.first,
+                        ld = (count * b + 15) / 16 * 16, next = 0;
+            const U *input = p.x.get_raw() + j * p.x.shape(2) * width;
+            U *output = p.y.get_raw() + j * p.y.shape(2) * out_width;
+            aligned_vector<U> &ring = this->ring();
+            std::vector<const U *> &sources = this->sources();
+            ring.resize(std::max(ring.size(), m_kernel_size * ld));
+            sources.resize(m_kernel_size);
+            for (std::size_t h = 0; h < p.y.shape(2); ++h) {
+                // Input rows [first, last) under the window.
+                std::size_t first = rows.start(h) + static_cast<std::ptrdiff_t>(rows.begin(h)),
+                            last = first + rows.end(h) - rows.begin(h);
+                if (count) {
+                    for (std::size_t r = std::max(next, first); r < last; ++r)
+                        (this->*p.pool_row)(input + r * width + (m_stride * cols.first - m_padding) * b, count, b,
+                                            &ring[r % m_kernel_size * ld]);
+                    next = std::max(next, last);
+                    for (std::size_t r = first; r < last; ++r)
+                        sources[r - first] = &ring[r % m_kernel_size * ld];
+                    (this->*p.pool_column)(&sources[0], last - first, count * b, initial(rows.clipped(h)),
+                                           output + h * out_width + cols.first * b);
                 }
-                for (std::size_t i = 0; i < sync.size(); ++i)
-                    sync[i].get();
-                sync.clear();
-                start = 0;
-                x = std::move(temp);
+                for (std::size_t w = 0; w < cols.first; ++w)
+                    pool_pixel(input, width, rows, cols, b, h, w, output + h * out_width + w * b);
+                for (std::size_t w = cols.last; w < p.y.shape(3); ++w)
+                    pool_pixel(input, width, rows, cols, b, h, w, output + h * out_width + w * b);
             }
-            tensor_type y{n, channels, (x.shape(2) - m_kernel_size) / m_stride + 1,
-                          (x.shape(3) - m_kernel_size) / m_stride + 1};
-            sync.reserve(threads.get_thread_num());
-            step = (double) n * channels / threads.get_thread_num();
-            for (std::size_t i = 0; i < threads.get_thread_num(); ++i) {
-                std::size_t end = (int) (step * (i + 1) + 0.5);
-                sync.emplace_back(threads.enqueue([this, &x, &y, channels](std::size_t s, std::size_t e) {
-                    for (std::size_t j = s; j < e; ++j)
-                        single_maxpool2d(x, y, j / channels, j % channels);
-                }, start, end));
-                start = end;
+        }
+        // Output pixel (h, w) of a plane `width` elements wide, over the part of its window within the input.
+        void pool_pixel(const U *input, std::size_t width, const window_axis &rows, const window_axis &cols,
+                        std::size_t b, std::size_t h, std::size_t w, U *out) const {
+            // Wrap around within the padding, and back once kh and kw are added.
+            std::size_t top = m_stride * h - m_padding, left = m_stride * w - m_padding;
+            std::fill(out, out + b, initial(rows.clipped(h) || cols.clipped(w)));
+            for (std::size_t kh = rows.begin(h); kh < rows.end(h); ++kh)
+                for (std::size_t kw = cols.begin(w); kw < cols.end(w); ++kw) {
+                    const U *pixel = input + (top + kh) * width + (left + kw) * b;
+                    for (std::size_t k = 0; k < b; ++k)
+                        out[k] = std::max(out[k], pixel[k]);
+                }
+        }
+
+        void pool_row_scalar(const U *row, std::size_t count, std::size_t b, U *out) const {
+            for (std::size_t w = 0; w < count; ++w, row += m_stride * b)
+                for (std::size_t k = 0; k < b; ++k) {
+                    U max = row[k];
+                    for (std::size_t kw = 1; kw < m_kernel_size; ++kw)
+                        max = std::max(max, row[kw * b + k]);
+                    *out++ = max;
+                }
+        }
+        void pool_column_scalar(const U *const *rows, std::size_t count, std::size_t n, U start, U *out) const {
+            for (std::size_t j = 0; j < n; ++j) {
+                U max = start;
+                for (std::size_t r = 0; r < count; ++r)
+                    max = std::max(max, rows[r][j]);
+                out[j] = max;
             }
-            for (std::size_t i = 0; i < sync.size(); ++i)
-                sync[i].get();
-            return y;
         }
-    private:
-        void single_maxpool2d(const tensor_type &x, tensor_type &y, std::size_t i, std::size_t c) const {
-            std::size_t height = y.shape(2), width = y.shape(3);
-            for (std::size_t h = 0; h < height; ++h) {
-                for (std::size_t w = 0; w < width; ++w) {
-                    typename tensor_type::data_type max = -std::numeric_limits<typename tensor_type::data_type>::max(), value;
-                    std::size_t hs = m_stride * h, ws = m_stride * w;
-                    for (std::size_t kh = 0; kh < m_kernel_size; ++kh)
-                        for (std::size_t kw = 0; kw < m_kernel_size; ++kw) {
-                            value = x.at(i, c, hs + kh, ws + kw);
-                            if (value > max)
-                                max = value;
-                        }
-                    y.at(i, c, h, w) = max;
+#if TNN_X86
+        // As the direct convolution, consecutive outputs at once, with the inputs m_stride apart.
+        TNN_TARGET_SSE41 void pool_row_sse41(const float *row, std::size_t count, std::size_t b, float *out) const {
+            std::size_t w = 0;
+            for (; w + 4 <= count; w += 4, row += 4 * m_stride) {
+                __m128 max = _mm_set1_ps(-std::numeric_limits<float>::max());
+                for (std::size_t kw = 0; kw < m_kernel_size; ++kw)
+                    max = _mm_max_ps(max, m_stride == 1 ? _mm_loadu_ps(row + kw)
+                            : _mm_setr_ps(row[kw], row[m_stride + kw], row[2 * m_stride + kw], row[3 * m_stride + kw]));
+                _mm_storeu_ps(out + w, max);
+            }
+            pool_row_scalar(row, count - w, 1, out + w);
+        }
+        TNN_TARGET_SSE41 void pool_blocked_row_sse41(const float *row, std::size_t count, std::size_t b, float *out) const {
+            for (std::size_t w = 0; w < count; ++w, row += m_stride * b)
+                for (std::size_t k = 0; k < b; k += 4, out += 4) {
+                    __m128 max = _mm_loadu_ps(row + k);
+                    for (std::size_t kw = 1; kw < m_kernel_size; ++kw)
+                        max = _mm_max_ps(max, _mm_loadu_ps(row + kw * b + k));
+                    _mm_storeu_ps(out, max);
+                }
+        }
+        TNN_TARGET_SSE41 void pool_column_sse41(const float *const *rows, std::size_t count, std::size_t n, float start,
+                                                float *out) const {
+            // Ring rows are padded to a multiple of 16 elements.
+            for (std::size_t j = 0; j < n; j += 4) {
+                __m128 max = _mm_set1_ps(start);
+                for (std::size_t r = 0; r < count; ++r)
+                    max = _mm_max_ps(max, _mm_load_ps(rows[r] + j));
+                if (j + 4 <= n)
+                    _mm_storeu_ps(out + j, max);
+                else {
+                    float tail[4];
+                    _mm_storeu_ps(tail, max);
+                    std::copy(tail, tail + (n - j), out + j);
+                }
+            }
+        }
+        TNN_TARGET_AVX2 void pool_row_avx2(const float *row, std::size_t count, std::size_t b, float *out) const {
+            const __m256i offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                                                       _mm256_set1_epi32(static_cast<int>(m_stride)));
+            std::size_t w = 0;
+            for (; w + 8 <= count; w += 8, row += 8 * m_stride) {
+                __m256 max = _mm256_set1_ps(-std::numeric_limits<float>::max());
+                for (std::size_t kw = 0; kw < m_kernel_size; ++kw)
+                    max = _mm256_max_ps(max, m_stride == 1 ? _mm256_loadu_ps(row + kw)
+                                                           : _mm256_i32gather_ps(row + kw, offsets, 4));
+                _mm256_storeu_ps(out + w, max);
+            }
+            pool_row_scalar(row, count - w, 1, out + w);
+        }
+        TNN_TARGET_AVX2 void pool_blocked_row_avx2(const float *row, std::size_t count, std::size_t b, float *out) const {
+            for (std::size_t w = 0; w < count; ++w, row += m_stride * b)
+                for (std::size_t k = 0; k < b; k += 8, out += 8) {
+                    __m256 max = _mm256_loadu_ps(row + k);
+                    for (std::size_t kw = 1; kw < m_kernel_size; ++kw)
+                        max = _mm256_max_ps(max, _mm256_loadu_ps(row + kw * b + k));
+                    _mm256_storeu_ps(out, max);
                 }
+        }
+        TNN_TARGET_AVX2 void pool_column_avx2(const float *const *rows, std::size_t count, std::size_t n, float start,
+                                              float *out) const {
+            for (std::size_t j = 0; j < n; j += 8) {
+                __m256 max = _mm256_set1_ps(start);
+                for (std::size_t r = 0; r < count; ++r)
+                    max = _mm256_max_ps(max, _mm256_load_ps(rows[r] + j));
+                if (j + 8 <= n)
+                    _mm256_storeu_ps(out + j, max);
+                else
+                    _mm256_maskstore_ps(out + j, _mm256_cmpgt_epi32(_mm256_set1_epi32(static_cast<int>(n - j)),
+                                                                    _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)), max);
+            }
+        }
+        // A stride of 2, the usual one, takes the even and odd elements of two loads, the window elements kw and
+        // kw + 1 of 16 outputs, instead of gathers. Only the elements actually pooled are loaded, which stay
+        // within the row.
+        TNN_TARGET_AVX512 void pool_row_avx512(const float *row, std::size_t count, std::size_t b, float *out) const {
+            const __m512i lanes_index = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+                          offsets = _mm512_mullo_epi32(lanes_index, _mm512_set1_epi32(static_cast<int>(m_stride))),
+                          even = _mm512_add_epi32(lanes_index, lanes_index),
+                          odd = _mm512_add_epi32(even, _mm512_set1_epi32(1));
+            for (std::size_t w = 0; w < count; w += 16, row += 16 * m_stride) {
+                std::size_t n = std::min<std::size_t>(count - w, 16);
+                __mmask16 lanes = simd::mask16(n);
+                __m512 max = _mm512_set1_ps(-std::numeric_limits<float>::max());
+                if (m_stride == 2) {
+                    for (std::size_t kw = 0; kw < m_kernel_size; kw += 2) {
+                        std::size_t elements = kw + 1 < m_kernel_size ? 2 * n : 2 * n - 1;
+                        __m512 low = _mm512_maskz_loadu_ps(simd::mask16(elements), row + kw),
+                               high = _mm512_maskz_loadu_ps(simd::mask16(elements - std::min<std::size_t>(elements, 16)),
+                                                            row + kw + 16);
+                        max = _mm512_max_ps(max, _mm512_permutex2var_ps(low, even, high));
+                        if (kw + 1 < m_kernel_size)
+                            max = _mm512_max_ps(max, _mm512_permutex2var_ps(low, odd, high));
+                    }
+                } else
+                    for (std::size_t kw = 0; kw < m_kernel_size; ++kw)
+                        max = _mm512_max_ps(max, m_stride == 1 ? _mm512_maskz_loadu_ps(lanes, row + kw)
+                                                 : _mm512_mask_i32gather_ps(_mm512_setzero_ps(), lanes, offsets, row + kw, 4));
+                _mm512_storeu_ps(out + w, max);
+            }
+        }
+        TNN_TARGET_AVX512 void pool_blocked_row_avx512(const float *row, std::size_t count, std::size_t b,
+                                                       float *out) const {
+            for (std::size_t w = 0; w < count; ++w, row += m_stride * 16, out += 16) {
+                __m512 max = _mm512_loadu_ps(row);
+                for (std::size_t kw = 1; kw < m_kernel_size; ++kw)
+                    max = _mm512_max_ps(max, _mm512_loadu_ps(row + kw * 16));
+                _mm512_store_ps(out, max);
+            }
+        }
+        TNN_TARGET_AVX512 void pool_column_avx512(const float *const *rows, std::size_t count, std::size_t n,
+                                                  float start, float *out) const {
+            for (std::size_t j = 0; j < n; j += 16) {
+                __m512 max = _mm512_set1_ps(start);
+                for (std::size_t r = 0; r < count; ++r)
+                    max = _mm512_max_ps(max, _mm512_load_ps(rows[r] + j));
+                _mm512_mask_storeu_ps(out + j, simd::mask16(n - j), max);
             }
         }
+#endif
         std::size_t m_kernel_size, m_stride, m_padding;
+        bool m_relu;
     };
 
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -4,48 +4,72 @@
 #include <type_traits>
 
 #include "layer.h"
-#include "avx.h"
+#include "simd.h"
 
 namespace tnn {
-    template <typename U = float, typename Allocator = std::allocator<U> >
+    template <typename U = float, typename Allocator = aligned_allocator<U> >
     class relu: public layer<U, Allocator> {
     public:
         typedef typename layer<U, Allocator>::tensor_type tensor_type;
-        tensor_type forward(tensor_type &&x, thread_pool &threads) const {
-            std::vector<std::future<void> > sync;
-            sync.reserve(threads.get_thread_num());
-            std::size_t start = 0;
-            double step = (double) x.size() / threads.get_thread_num();
-            for (std::size_t i = 0; i < threads.get_thread_num(); ++i) {
-                std::size_t end = (int) (step * (i + 1) + 0.5);
-                if (start != end)
-                    sync.emplace_back(threads.enqueue([this, &x](std::size_t s, std::size_t e) {
-                        single_relu(x, s, e);
-                    }, start, end));
-                start = end;
-            }
-            for (std::size_t i = 0; i < sync.size(); ++i)
-                sync[i].get();
-            return x;
+        typedef typename layer<U, Allocator>::workspace_type workspace_type;
+        tensor_type forward(tensor_type &&x, thread_pool &threads, workspace_type &ws) const {
+            threads.parallel_for(0, x.size(), 1 << 14, [this, &x](std::size_t s, std::size_t e) {
+                single_relu(x, s, e);
+            });
+            return std::move(x);
+        }
+        const char *type() const {
+            return "relu";
+        }
+        double flops(const std::vector<std::size_t> &input, const std::vector<std::size_t> &output) const {
+            return this->elements(output);
         }
     protected:
-#if AVX_ENABLED
-        template<bool ForceDisableAVX = false>
-        typename std::enable_if<std::is_same<U, float>::value && AVX_ENABLED && !ForceDisableAVX>::type
+        template<typename T = U>
+        typename std::enable_if<!std::is_same<T, float>::value>::type
             single_relu(tensor_type &x, std::size_t s, std::size_t e) const {
-            __m256 zeros = _mm256_setzero_ps();
-            for (; s + 7 < e; s += 8)
-                _mm256_storeu_ps(x.get_raw(s), _mm256_max_ps(zeros, _mm256_loadu_ps(x.get_raw(s))));
-            single_relu<true>(x, s, e);
+            relu_scalar(x.get_raw(s), e - s);
         }
-#endif
-        template<bool ForceDisableAVX = false>
-        typename std::enable_if<!(std::is_same<U, float>::value && AVX_ENABLED && !ForceDisableAVX)>::type
+        template<typename T = U>
+        typename std::enable_if<std::is_same<T, float>::value>::type
             single_relu(tensor_type &x, std::size_t s, std::size_t e) const {
-            for (; s < e; ++s)
-                if (x.at(s) < 0)
-                    x.at(s) = 0;
+#if TNN_X86
+            switch (simd::current()) {
+                case simd::avx512: return relu_avx512(x.get_raw(s), e - s);
+                case simd::avx2: return relu_avx2(x.get_raw(s), e - s);
+                case simd::sse41: return relu_sse41(x.get_raw(s), e - s);
+                default: break;
+            }
+#endif
+            relu_scalar(x.get_raw(s), e - s);
         }
+
+        static void relu_scalar(U *x, std::size_t n) {
+            for (std::size_t i = 0; i < n; ++i)
+                if (x[i] < 0)
+                    x[i] = 0;
+        }
+#if TNN_X86
+        TNN_TARGET_SSE41 static void relu_sse41(float *x, std::size_t n) {
+            std::size_t i = 0;
+            for (__m128 zeros = _mm_setzero_ps(); i + 4 <= n; i += 4)
+                _mm_storeu_ps(x + i, _mm_max_ps(zeros, _mm_loadu_ps(x + i)));
+            relu_scalar(x + i, n - i);
+        }
+        TNN_TARGET_AVX2 static void relu_avx2(float *x, std::size_t n) {
+            std::size_t i = 0;
+            for (__m256 zeros = _mm256_setzero_ps(); i + 8 <= n; i += 8)
+                _mm256_storeu_ps(x + i, _mm256_max_ps(zeros, _mm256_loadu_ps(x + i)));
+            relu_scalar(x + i, n - i);
+        }
+        TNN_TARGET_AVX512 static void relu_avx512(float *x, std::size_t n) {
+            __m512 zeros = _mm512_setzero_ps();
+            for (std::size_t i = 0; i < n; i += 16) {
+                __mmask16 lanes = simd::mask16(n - i);
+                _mm512_mask_storeu_ps(x + i, lanes, _mm512_max_ps(zeros, _mm512_maskz_loadu_ps(lanes, x + i)));
+            }
+        }
+#endif
     };
 }
 
@@ -2,26 +2,56 @@
 #define RESHAPE_H
 
 #include "layer.h"
+#include "tensor/layout.h"
 
 namespace tnn {
-    template <typename U = float, typename Allocator = std::allocator<U> >
+    template <typename U = float, typename Allocator = aligned_allocator<U> >
     class reshape: public layer<U, Allocator> {
     public:
         typedef typename layer<U, Allocator>::tensor_type tensor_type;
+        typedef typename layer<U, Allocator>::workspace_type workspace_type;
         reshape(std::initializer_list<std::size_t> shape): m_shape(shape), m_size(1) {
             for (std::size_t i = 0; i < m_shape.size(); ++i)
                 m_size *= m_shape[i];
         }
-        tensor_type forward(tensor_type &&x, thread_pool &threads) const {
+        explicit reshape(const std::vector<std::size_t> &shape): m_shape(shape), m_size(1) {
+            for (std::size_t i = 0; i < m_shape.size(); ++i)
+                m_size *= m_shape[i];
+        }
+        // Channel blocked images are taken back to plain NCHW first, so that the result is laid out as in a
+        // network without blocked layers.
+        tensor_type forward(tensor_type &&x, thread_pool &threads, workspace_type &ws) const {
+            if (x.layout() != tensor_layout::nchw) {
+                tensor_type temp = plan_plain(x, ws);
+                threads.parallel_for(0, temp.shape(0) * temp.shape(1), 16, [&x, &temp](std::size_t s, std::size_t e) {
+                    layout::to_plain(x, temp, s, e);
+                });
+                x = std::move(temp);
+            }
+            return plan(std::move(x), ws);
+        }
+        tensor_type plan(tensor_type &&x, workspace_type &ws) const {
+            if (x.layout() != tensor_layout::nchw)
+                x = plan_plain(x, ws);
             std::vector<std::size_t> shape;
             shape.reserve(m_shape.size() + 1);
             shape.emplace_back(x.size() / m_size);
             shape.insert(shape.end(), m_shape.begin(), m_shape.end());
             x.reshape(shape.begin(), shape.end());
-            return x;
+            return std::move(x);
+        }
+        const char *type() const {
+            return "reshape";
+        }
+        // Shape of one sample, without the batch.
+        const std::vector<std::size_t> &shape() const {
+            return m_shape;
         }
 
     private:
+        tensor_type plan_plain(const tensor_type &x, workspace_type &ws) const {
+            return ws.acquire({x.shape(0), m_size / (x.shape(2) * x.shape(3)), x.shape(2), x.shape(3)});
+        }
         std::vector<std::size_t> m_shape;
         std::size_t m_size;
     };
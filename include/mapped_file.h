@@ -0,0 +1,106 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <memory>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace tnn {
+
+    // Read-only view of a whole file through mmap, read sequentially like an istream. Tensors mapped from it
+    // point straight into the mapping and keep it alive, so the data is never copied and every process mapping
+    // the same file shares its page cache. The mapping is read-only, so that a stray write to a mapped tensor
+    // faults instead of quietly giving the process its own copy of the page; code that rearranges mapped values
+    // copies them into storage of its own first.
+    class mapped_file {
+    public:
+        // populate: fault in all pages up front (MAP_POPULATE).
+        // willneed: start asynchronous read-ahead of the whole file (MADV_WILLNEED).
+        enum hint { none, populate, willneed };
+        mapped_file() : m_position(0), m_fail(true) {}
+        explicit mapped_file(const char *filename, hint h = none) : m_position(0), m_fail(true) {
+            open(filename, h);
+        }
+        void open(const char *filename, hint h = none) {
+            m_region.reset();
+            m_position = 0;
+            m_fail = true;
+            int fd = ::open(filename, O_RDONLY);
+            if (fd == -1)
+                return;
+            struct stat st;
+            if (fstat(fd, &st) == 0 && st.st_size > 0) {
+                int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+                if (h == populate)
+                    flags |= MAP_POPULATE;
+#endif
+                void *address = mmap(nullptr, st.st_size, PROT_READ, flags, fd, 0);
+                if (address != MAP_FAILED) {
+                    if (h == willneed)
+                        madvise(address, st.st_size, MADV_WILLNEED);
+                    m_region = std::make_shared<region>(address, st.st_size);
+                    m_fail = false;
+                }
+            }
+            close(fd);
+        }
+        // Returns the next `bytes` bytes and moves past them, or nullptr and sets the fail state if the file is
+        // too short.
+        char *read(std::size_t bytes) {
+            if (m_fail || bytes > size() - m_position) {
+                m_fail = true;
+                return nullptr;
+            }
+            char *result = data() + m_position;
+            m_position += bytes;
+            return result;
+        }
+        // Moves to the next multiple of `alignment` bytes from the start of the file.
+        void align(std::size_t alignment) {
+            m_position = std::min(size(), (m_position + alignment - 1) / alignment * alignment);
+        }
+        void seek(std::size_t position) {
+            m_position = position;
+        }
+        std::size_t tell() const {
+            return m_position;
+        }
+        std::size_t size() const {
+            return m_region ? m_region->size : 0;
+        }
+        char *data() const {
+            return m_region ? static_cast<char *>(m_region->address) : nullptr;
+        }
+        // Shared owner of the mapping, for objects pointing into it.
+        std::shared_ptr<const void> owner() const {
+            return m_region;
+        }
+        bool operator!() const {
+            return m_fail;
+        }
+        explicit operator bool() const {
+            return !m_fail;
+        }
+    private:
+        struct region {
+            region(void *address, std::size_t size) : address(address), size(size) {}
+            region(const region &) = delete;
+            region &operator=(const region &) = delete;
+            ~region() {
+                munmap(address, size);
+            }
+            void *address;
+            std::size_t size;
+        };
+        std::shared_ptr<region> m_region;
+        std::size_t m_position;
+        bool m_fail;
+    };
+
+}
+
+#endif
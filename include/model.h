@@ -0,0 +1,282 @@
+#ifndef MODEL_H
+#define MODEL_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <map>
+#include <functional>
+#include <istream>
+#include <type_traits>
+
+#include "mapped_file.h"
+#include "layers/layer.h"
+#include "layers/conv2d.h"
+#include "layers/relu.h"
+#include "layers/maxpool2d.h"
+#include "layers/linear.h"
+#include "layers/reshape.h"
+#include "layers/bias.h"
+
+namespace tnn {
+
+    // Self-describing model file. All integers are little-endian.
+    //
+    //   header   char magic[8] = "TNNMODEL", u32 version, u32 layers, u32 tensors,
+    //            u32 input_ndim, u64 input_shape[input_ndim]      (shape of one sample, without the batch)
+    //   layers   char type[16] (NUL padded), u32 params, i64 param[params], u32 count, u32 tensor[count]
+    //   tensors  u32 dtype, u32 ndim, u64 offset, u64 shape[ndim]
+    //   data     every tensor at its offset from the start of the file, a multiple of 64
+    //
+    // The layers form a chain, run in file order. Their parameters by type:
+    //
+    //   conv2d     in_channels, out_channels, kernel_size, stride, padding, bias    tensors: weight[, bias]
+    //   maxpool2d  kernel_size, stride, padding                                   tensors: -
+    //   relu       -                                                              tensors: -
+    //   reshape    shape...                                                       tensors: -
+    //   linear     in_features, out_features, bias                                tensors: weight[, bias]
+    //   bias       features                                                       tensors: bias
+    //
+    // Since the data is aligned, a mapped model can be used in place by SIMD kernels. scripts/tnn_model.py
+    // writes this format.
+    template <typename U = float, typename Allocator = aligned_allocator<U> >
+    class model {
+    public:
+        typedef layer<U, Allocator> layer_type;
+        typedef layers<U, Allocator> layers_type;
+        typedef typename layer_type::tensor_type tensor_type;
+        // Returns nullptr if the parameters are invalid.
+        typedef std::function<std::shared_ptr<layer_type> (const std::vector<std::int64_t> &)> creator;
+        enum dtype : std::uint32_t { float32 = 0 };
+        static const std::uint32_t version = 1;
+        static const std::size_t alignment = 64;
+
+        // Whether `in` starts with the magic of a model file. The position of `in` is left unchanged.
+        static bool detect(std::istream &in) {
+            char magic[8];
+            std::streampos position = in.tellg();
+            bool result = in.read(magic, sizeof(magic)) && !std::memcmp(magic, s_magic, sizeof(magic));
+            in.clear();
+            in.seekg(position);
+            return result;
+        }
+        static bool detect(const mapped_file &in) {
+            return in.size() >= sizeof(s_magic) && !std::memcmp(in.data(), s_magic, sizeof(s_magic));
+        }
+        // Layer types by name. Registering more types lets model files use them.
+        static std::map<std::string, creator> &factory() {
+            static std::map<std::string, creator> types = builtin_types();
+            return types;
+        }
+
+        // Both return false and set error() if the file is invalid.
+        bool load(std::istream &in) {
+            in.seekg(0, std::ios::end);
+            stream_source source{in, static_cast<std::size_t>(in.tellg())};
+            in.seekg(0);
+            return parse(source);
+        }
+        // Parameters point into the mapping, see layer::load(mapped_file &).
+        bool load(mapped_file &in) {
+            in.seek(0);
+            mapped_source source{in};
+            return parse(source);
+        }
+        const std::shared_ptr<layers_type> &network() const {
+            return m_network;
+        }
+        const std::vector<std::size_t> &input_shape() const {
+            return m_input_shape;
+        }
+        const std::string &error() const {
+            return m_error;
+        }
+
+    private:
+        struct stream_source {
+            bool read(void *data, std::size_t bytes) {
+                return static_cast<bool>(in.read(static_cast<char *>(data), bytes));
+            }
+            bool load(tensor_type &t, std::size_t offset) {
+                in.seekg(offset);
+                t.load(in);
+                return static_cast<bool>(in);
+            }
+            std::istream &in;
+            std::size_t size;
+        };
+        struct mapped_source {
+            bool read(void *data, std::size_t bytes) {
+                const char *p = in.read(bytes);
+                if (p)
+                    std::memcpy(data, p, bytes);
+                return p != nullptr;
+            }
+            bool load(tensor_type &t, std::size_t offset) {
+                in.seek(offset);
+                t.map(in);
+                return static_cast<bool>(in);
+            }
+            mapped_file &in;
+            std::size_t size;
+            explicit mapped_source(mapped_file &in) : in(in), size(in.size()) {}
+        };
+        struct tensor_entry {
+            std::uint32_t dtype;
+            std::uint64_t offset;
+            std::vector<std::size_t> shape;
+        };
+        // Bounds for counts read from the file, so that a corrupt file fails instead of allocating too much.
+        static const std::uint32_t max_count = 1 << 16, max_params = 64, max_ndim = 8;
+        static const char s_magic[8];
+
+        bool fail(const std::string &message) {
+            m_network.reset();
+            m_error = message;
+            return false;
+        }
+        template<typename Source>
+        bool parse(Source &source) {
+            m_network.reset();
+            m_input_shape.clear();
+            m_error.clear();
+            char magic[8];
+            std::uint32_t header[4];
+            if (!source.read(magic, sizeof(magic)) || std::memcmp(magic, s_magic, sizeof(magic)))
+                return fail("not a model file");
+            if (!source.read(header, sizeof(header)))
+                return fail("truncated header");
+            if (header[0] != version)
+                return fail("unsupported version " + std::to_string(header[0]));
+            std::uint32_t layer_count = header[1], tensor_count = header[2], input_ndim = header[3];
+            if (layer_count > max_count || tensor_count > max_count || input_ndim > max_ndim)
+                return fail("invalid header");
+            std::vector<std::uint64_t> input(input_ndim);
+            if (input_ndim && !source.read(&input[0], input_ndim * sizeof(std::uint64_t)))
+                return fail("truncated header");
+            m_input_shape.assign(input.begin(), input.end());
+
+            std::vector<std::shared_ptr<layer_type> > layers(layer_count);
+            std::vector<std::vector<std::uint32_t> > layer_tensors(layer_count);
+            for (std::uint32_t i = 0; i < layer_count; ++i) {
+                char type[17] = {};
+                std::uint32_t count;
+                if (!source.read(type, 16) || !source.read(&count, sizeof(count)) || count > max_params)
+                    return fail("invalid layer " + std::to_string(i));
+                std::vector<std::int64_t> params(count);
+                if (count && !source.read(&params[0], count * sizeof(std::int64_t)))
+                    return fail("invalid layer " + std::to_string(i));
+                if (!source.read(&count, sizeof(count)) || count > max_count)
+                    return fail("invalid layer " + std::to_string(i));
+                layer_tensors[i].resize(count);
+                if (count && !source.read(&layer_tensors[i][0], count * sizeof(std::uint32_t)))
+                    return fail("invalid layer " + std::to_string(i));
+                typename std::map<std::string, creator>::const_iterator it = factory().find(type);
+                if (it == factory().end())
+                    return fail("unknown layer type \"" + std::string(type) + "\"");
+                if (!(layers[i] = it->second(params)))
+                    return fail("invalid parameters of layer " + std::to_string(i) + " (" + type + ")");
+            }
+
+            std::vector<tensor_entry> tensors(tensor_count);
+            for (std::uint32_t i = 0; i < tensor_count; ++i) {
+                std::uint32_t info[2];
+                std::uint64_t offset;
+                if (!source.read(info, sizeof(info)) || info[1] > max_ndim || !source.read(&offset, sizeof(offset)))
+                    return fail("invalid tensor " + std::to_string(i));
+                std::vector<std::uint64_t> shape(info[1]);
+                if (info[1] && !source.read(&shape[0], info[1] * sizeof(std::uint64_t)))
+                    return fail("invalid tensor " + std::to_string(i));
+                std::uint64_t bytes = sizeof(U);
+                for (std::size_t j = 0; j < shape.size(); ++j) {
+                    if (shape[j] && bytes > source.size / shape[j])
+                        return fail("tensor " + std::to_string(i) + " exceeds the file");
+                    bytes *= shape[j];
+                }
+                if (info[0] != float32 || !std::is_same<U, float>::value)
+                    return fail("unsupported dtype of tensor " + std::to_string(i));
+                if (offset % alignment)
+                    return fail("misaligned tensor " + std::to_string(i));
+                if (offset > source.size || bytes > source.size - offset)
+                    return fail("tensor " + std::to_string(i) + " exceeds the file");
+                tensors[i].dtype = info[0];
+                tensors[i].offset = offset;
+                tensors[i].shape.assign(shape.begin(), shape.end());
+            }
+
+            for (std::uint32_t i = 0; i < layer_count; ++i) {
+                std::vector<tensor_type *> parameters = layers[i]->parameters();
+                if (parameters.size() != layer_tensors[i].size())
+                    return fail("layer " + std::to_string(i) + " expects " + std::to_string(parameters.size()) + " tensors");
+                for (std::size_t j = 0; j < parameters.size(); ++j) {
+                    std::uint32_t index = layer_tensors[i][j];
+                    if (index >= tensor_count || tensors[index].shape != parameters[j]->shape())
+                        return fail("tensor " + std::to_string(j) + " of layer " + std::to_string(i) + " has the wrong shape");
+                    if (!source.load(*parameters[j], tensors[index].offset))
+                        return fail("failed to read tensor " + std::to_string(index));
+                }
+                layers[i]->prepare();
+            }
+            m_network = std::make_shared<layers_type>(std::move(layers));
+            return true;
+        }
+
+        // Every parameter must be positive, except for the flags and paddings listed in `zero`.
+        static bool valid(const std::vector<std::int64_t> &params, std::size_t count, std::initializer_list<std::size_t> zero = {}) {
+            if (params.size() != count)
+                return false;
+            for (std::size_t i = 0; i < count; ++i)
+                if (params[i] < 0 || (!params[i] && std::find(zero.begin(), zero.end(), i) == zero.end()))
+                    return false;
+            return true;
+        }
+        static std::map<std::string, creator> builtin_types() {
+            std::map<std::string, creator> types;
+            types["conv2d"] = [](const std::vector<std::int64_t> &p) -> std::shared_ptr<layer_type> {
+                if (!valid(p, 6, {4, 5}))
+                    return nullptr;
+                return std::make_shared<conv2d<U, Allocator> >(p[0], p[1], p[2], p[3], p[4], p[5] != 0);
+            };
+            types["maxpool2d"] = [](const std::vector<std::int64_t> &p) -> std::shared_ptr<layer_type> {
+                if (!valid(p, 3, {2}))
+                    return nullptr;
+                return std::make_shared<maxpool2d<U, Allocator> >(p[0], p[1], p[2]);
+            };
+            types["relu"] = [](const std::vector<std::int64_t> &p) -> std::shared_ptr<layer_type> {
+                if (!valid(p, 0))
+                    return nullptr;
+                return std::make_shared<relu<U, Allocator> >();
+            };
+            types["reshape"] = [](const std::vector<std::int64_t> &p) -> std::shared_ptr<layer_type> {
+                if (p.empty() || !valid(p, p.size()))
+                    return nullptr;
+                return std::make_shared<reshape<U, Allocator> >(std::vector<std::size_t>(p.begin(), p.end()));
+            };
+            types["linear"] = [](const std::vector<std::int64_t> &p) -> std::shared_ptr<layer_type> {
+                if (!valid(p, 3, {2}))
+                    return nullptr;
+                return std::make_shared<linear<U, Allocator> >(p[0], p[1], p[2] != 0);
+            };
+            types["bias"] = [](const std::vector<std::int64_t> &p) -> std::shared_ptr<layer_type> {
+                if (!valid(p, 1))
+                    return nullptr;
+                return std::make_shared<bias<U, Allocator> >(p[0]);
+            };
+            return types;
+        }
+
+        std::shared_ptr<layers_type> m_network;
+        std::vector<std::size_t> m_input_shape;
+        std::string m_error;
+    };
+
+    template <typename U, typename Allocator>
+    const char model<U, Allocator>::s_magic[8] = {'T', 'N', 'N', 'M', 'O', 'D', 'E', 'L'};
+    template <typename U, typename Allocator>
+    const std::uint32_t model<U, Allocator>::version;
+    template <typename U, typename Allocator>
+    const std::size_t model<U, Allocator>::alignment;
+
+}
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef PACKED_CACHE_H
+#define PACKED_CACHE_H
+
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <string>
+#include <ostream>
+#include <fstream>
+
+#include "simd.h"
+#include "mapped_file.h"
+
+namespace tnn {
+
+    // What layer::prepare() makes of the parameters of a network, saved once and mapped by later processes in
+    // place of packing them again. In native byte order, since a cache belongs to one machine:
+    //
+    //   header   char magic[8] = "TNNPACK1", u64 key
+    //   layers   what layer::save_packed() writes for every layer in turn, each buffer of packed values at a
+    //            multiple of 64 bytes from the start of the file
+    //
+    // The key is a hash of the model file, of the SIMD path in use, which decides the layout of some of the
+    // packed weights, and of whatever else the network went through after loading, e.g. modes, folding and
+    // calibration. A network loaded and set up the same way with packing deferred then maps its packed
+    // parameters with layer::load_packed(). The magic changes with the format.
+    namespace packed_cache {
+        const std::size_t alignment = 64;
+        const char magic[8] = {'T', 'N', 'N', 'P', 'A', 'C', 'K', '1'};
+
+        // Set while a network whose packed parameters come from a cache is loaded and set up, so that
+        // layer::prepare() leaves them to layer::load_packed() instead of packing them.
+        inline bool &deferred() {
+            static bool value = false;
+            return value;
+        }
+
+        // Defers packing for its lifetime.
+        class defer {
+        public:
+            defer() : m_previous(deferred()) {
+                deferred() = true;
+            }
+            defer(const defer &) = delete;
+            defer &operator=(const defer &) = delete;
+            ~defer() {
+                deferred() = m_previous;
+            }
+        private:
+            bool m_previous;
+        };
+
+        // Zeros up to the next multiple of `alignment` bytes from the start of `out`, where the next buffer goes.
+        // mapped_file::align() skips them.
+        inline void pad(std::ostream &out) {
+            static const char zeros[alignment] = {};
+            std::streamoff position = out.tellp();
+            if (position > 0 && position % alignment)
+                out.write(zeros, alignment - position % alignment);
+        }
+
+        // 64-bit hash of `size` bytes, four words at a time in independent lanes so that hashing a model file
+        // of hundreds of MB runs at memory speed. Not meant to resist forged collisions.
+        inline std::uint64_t hash(const void *data, std::size_t size, std::uint64_t seed = 0) {
+            const std::uint64_t prime = 0x9e3779b97f4a7c15ull;
+            const char *bytes = static_cast<const char *>(data);
+            std::uint64_t lanes[4] = {seed ^ size, seed + prime, ~seed, seed - prime};
+            std::size_t i = 0;
+            for (; i + sizeof(lanes) <= size; i += sizeof(lanes))
+                for (std::size_t l = 0; l < 4; ++l) {
+                    std::uint64_t word;
+                    std::memcpy(&word, bytes + i + l * sizeof(word), sizeof(word));
+                    lanes[l] = (lanes[l] ^ word) * prime;
+                    lanes[l] ^= lanes[l] >> 29;
+                }
+            std::uint64_t result = seed;
+            for (std::size_t l = 0; l < 4; ++l)
+                result = (result ^ lanes[l]) * prime;
+            for (; i < size; ++i)
+                result = (result ^ static_cast<unsigned char>(bytes[i])) * prime;
+            return result ^ (result >> 32);
+        }
+
+        // Key of the packed parameters of a network loaded from `model` and set up as `setup` describes, on the
+        // SIMD path in use.
+        inline std::uint64_t key(const mapped_file &model, const std::string &setup) {
+            std::string isa = simd::name(simd::current());
+            std::uint64_t result = hash(model.data(), model.size());
+            result = hash(isa.data(), isa.size(), result);
+            return hash(setup.data(), setup.size(), result);
+        }
+
+        // File of the cache in `directory` for `key`.
+        inline std::string filename(const std::string &directory, std::uint64_t key) {
+            char name[32];
+            std::snprintf(name, sizeof(name), "%016llx.packed", static_cast<unsigned long long>(key));
+            return directory + "/" + name;
+        }
+
+        // Maps the cache `filename` and moves past its header, to the packed parameters layer::load_packed() maps
+        // for a network loaded and set up with packing deferred. Returns false if there is no cache for `key`.
+        inline bool open(mapped_file &file, const std::string &filename, std::uint64_t key) {
+            file.open(filename.c_str());
+            const char *header = file.read(sizeof(magic) + sizeof(key));
+            return header && !std::memcmp(header, magic, sizeof(magic)) &&
+                   !std::memcmp(header + sizeof(magic), &key, sizeof(key));
+        }
+
+        // Saves the packed parameters of `network` as the cache `filename` for `key`. The file is written under
+        // another name first and renamed, so that no process ever maps half of it.
+        template <typename Layer>
+        bool save(const Layer &network, const std::string &filename, std::uint64_t key) {
+            std::string temporary = filename + ".tmp";
+            std::ofstream out(temporary.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+            out.write(magic, sizeof(magic));
+            out.write(reinterpret_cast<const char *>(&key), sizeof(key));
+            network.save_packed(out);
+            out.close();
+            if (!out || std::rename(temporary.c_str(), filename.c_str())) {
+                std::remove(temporary.c_str());
+                return false;
+            }
+            return true;
+        }
+    }
+
+}
+
+#endif
@@ -0,0 +1,159 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+
+namespace tnn {
+
+    // FIFO with a fixed capacity. push() blocks while it is full, which is what applies back-pressure to the
+    // producer, and pop() blocks while it is empty.
+    template<typename T>
+    class bounded_queue {
+    public:
+        explicit bounded_queue(std::size_t capacity) : m_capacity(std::max<std::size_t>(capacity, 1)), m_closed(false) {}
+        bounded_queue(const bounded_queue &) = delete;
+        bounded_queue &operator = (const bounded_queue &) = delete;
+        // Returns false, dropping the item, if the queue has been closed.
+        bool push(T &&item) {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_not_full.wait(lock, [this]{ return m_closed || m_items.size() < m_capacity; });
+            if (m_closed)
+                return false;
+            m_items.push_back(std::move(item));
+            lock.unlock();
+            m_not_empty.notify_one();
+            return true;
+        }
+        // Returns false once the queue is closed and empty.
+        bool pop(T &item) {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_not_empty.wait(lock, [this]{ return m_closed || !m_items.empty(); });
+            if (m_items.empty())
+                return false;
+            item = std::move(m_items.front());
+            m_items.pop_front();
+            lock.unlock();
+            m_not_full.notify_one();
+            return true;
+        }
+        // Items already queued can still be popped.
+        void close() {
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_closed = true;
+            }
+            m_not_full.notify_all();
+            m_not_empty.notify_all();
+        }
+    private:
+        std::size_t m_capacity;
+        bool m_closed;
+        std::deque<T> m_items;
+        std::mutex m_mutex;
+        std::condition_variable m_not_full, m_not_empty;
+    };
+
+    // Stages connected by bounded queues, each running on threads of its own, so that consecutive items are
+    // processed by different stages at the same time. A stage with several threads works on several items at
+    // once and may finish them out of order; the sink still receives them in the order of the source. At most
+    // window() items are between the source and the sink at any time, those waiting for their turn included.
+    template<typename T>
+    class pipeline {
+    public:
+        // Called with the item and the index of the thread of the stage, e.g. to pick per-thread state.
+        typedef std::function<void (T &, std::size_t)> stage_function;
+        // `capacity` items may wait between two stages.
+        explicit pipeline(std::size_t capacity) : m_capacity(capacity) {}
+        pipeline &stage(stage_function function, std::size_t threads = 1) {
+            m_stages.push_back(stage_type{std::move(function), std::max<std::size_t>(threads, 1)});
+            return *this;
+        }
+        // As many items as the queues and the threads of the stages hold, so that it never holds the source back
+        // while the items come in order.
+        std::size_t window() const {
+            std::size_t result = m_capacity * (m_stages.size() + 1);
+            for (const stage_type &stage: m_stages)
+                result += stage.threads;
+            return result;
+        }
+        // Takes items from `source` until it returns false, passes them through the stages, and hands them to
+        // `sink` on the calling thread. Returns when the last item has been sunk.
+        void run(const std::function<bool (T &)> &source, const std::function<void (T &)> &sink) {
+            typedef std::pair<std::size_t, T> item;
+            std::vector<std::unique_ptr<bounded_queue<item> > > queues;
+            for (std::size_t i = 0; i <= m_stages.size(); ++i)
+                queues.emplace_back(new bounded_queue<item>(m_capacity));
+            // Item i leaves the source once item i - window() has been sunk. Full queues alone do not bound the
+            // items: while a slow thread of a stage holds one back, the items after it drain into the sink's
+            // reorder map and free room in the queues.
+            std::mutex mutex;
+            std::condition_variable sunk;
+            std::size_t next = 0, window = this->window();
+            std::vector<std::thread> threads;
+            threads.emplace_back([&source, &queues, &mutex, &sunk, &next, window] {
+                for (std::size_t i = 0; ; ++i) {
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        sunk.wait(lock, [&next, i, window]{ return i < next + window; });
+                    }
+                    item produced(i, T());
+                    if (!source(produced.second))
+                        break;
+                    queues.front()->push(std::move(produced));
+                }
+                queues.front()->close();
+            });
+            // The last thread of a stage to run out of input closes the queue behind it.
+            std::vector<std::unique_ptr<std::atomic<std::size_t> > > running;
+            for (std::size_t s = 0; s < m_stages.size(); ++s) {
+                running.emplace_back(new std::atomic<std::size_t>(m_stages[s].threads));
+                for (std::size_t t = 0; t < m_stages[s].threads; ++t)
+                    threads.emplace_back([this, &queues, &running, s, t] {
+                        item current;
+                        while (queues[s]->pop(current)) {
+                            m_stages[s].function(current.second, t);
+                            queues[s + 1]->push(std::move(current));
+                        }
+                        if (--*running[s] == 0)
+                            queues[s + 1]->close();
+                    });
+            }
+            // Items finished ahead of their turn wait here, fewer than window() of them.
+            std::map<std::size_t, T> early;
+            item current;
+            while (queues.back()->pop(current)) {
+                early.insert(std::make_pair(current.first, std::move(current.second)));
+                while (!early.empty() && early.begin()->first == next) {
+                    sink(early.begin()->second);
+                    early.erase(early.begin());
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        ++next;
+                    }
+                    sunk.notify_one();
+                }
+            }
+            for (std::thread &thread: threads)
+                thread.join();
+        }
+    private:
+        struct stage_type {
+            stage_function function;
+            std::size_t threads;
+        };
+        std::size_t m_capacity;
+        std::vector<stage_type> m_stages;
+    };
+
+}
+
+#endif
@@ -0,0 +1,234 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <vector>
+#include <map>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <iomanip>
+#include <algorithm>
+
+namespace tnn {
+
+    // Opt-in instrumentation. While disabled, the default, every hook costs one relaxed atomic load. While
+    // enabled, layers::forward() records every layer with its FLOPs and the workspace bytes it allocated,
+    // thread_pool records every task with the time it waited in a queue, and scope records whatever the
+    // application marks. Events are kept per thread, and can be saved as Chrome trace events (chrome://tracing
+    // or Perfetto) or summarized.
+    class profiler {
+    public:
+        typedef std::chrono::steady_clock clock;
+        enum category { layer_event, task_event, scope_event };
+        struct event {
+            category type;
+            std::string name;
+            // Events of one layer share the key, which is the layer.
+            const void *key;
+            std::size_t thread;
+            clock::time_point begin, end;
+            // Tasks only: from being queued to being started.
+            clock::duration wait;
+            // Layers only.
+            double flops;
+            std::size_t bytes;
+        };
+
+        // Records what happens between its construction and destruction, if the profiler is enabled.
+        class scope {
+        public:
+            explicit scope(const char *name) : m_name(name), m_enabled(enabled()) {
+                if (m_enabled)
+                    m_begin = clock::now();
+            }
+            scope(const scope &) = delete;
+            scope &operator = (const scope &) = delete;
+            ~scope() {
+                if (m_enabled)
+                    instance().record(event{scope_event, m_name, nullptr, 0, m_begin, clock::now(), clock::duration(), 0, 0});
+            }
+        private:
+            const char *m_name;
+            bool m_enabled;
+            clock::time_point m_begin;
+        };
+
+        static profiler &instance() {
+            static profiler p;
+            return p;
+        }
+        static bool enabled() {
+            return flag().load(std::memory_order_relaxed);
+        }
+        void enable() {
+            if (!enabled())
+                m_start = clock::now();
+            flag() = true;
+        }
+        void disable() {
+            flag() = false;
+        }
+        // Names the calling thread in traces, e.g. "worker" 3. Costs nothing until the thread records an event.
+        static void name_thread(const char *name, std::size_t index) {
+            local().name = name;
+            local().index = index;
+        }
+        void record(event e) {
+            thread_state &state = local();
+            if (!state.buffer) {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                state.buffer = std::make_shared<thread_buffer>();
+                state.buffer->id = m_threads.size();
+                state.buffer->name = state.name ? state.name + std::string(" ") + std::to_string(state.index)
+                                                : "thread " + std::to_string(m_threads.size());
+                m_threads.push_back(state.buffer);
+            }
+            e.thread = state.buffer->id;
+            std::unique_lock<std::mutex> lock(state.buffer->mutex);
+            state.buffer->events.push_back(std::move(e));
+        }
+        void record_task(clock::time_point queued, clock::time_point begin, clock::time_point end) {
+            record(event{task_event, "task", nullptr, 0, begin, end, begin - queued, 0, 0});
+        }
+        // Events of all threads, by start time.
+        std::vector<event> events() const {
+            std::vector<event> result;
+            std::unique_lock<std::mutex> lock(m_mutex);
+            for (std::size_t i = 0; i < m_threads.size(); ++i) {
+                std::unique_lock<std::mutex> thread_lock(m_threads[i]->mutex);
+                result.insert(result.end(), m_threads[i]->events.begin(), m_threads[i]->events.end());
+            }
+            std::stable_sort(result.begin(), result.end(), [](const event &a, const event &b) { return a.begin < b.begin; });
+            return result;
+        }
+        void clear() {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            for (std::size_t i = 0; i < m_threads.size(); ++i) {
+                std::unique_lock<std::mutex> thread_lock(m_threads[i]->mutex);
+                m_threads[i]->events.clear();
+            }
+        }
+
+        // Chrome trace event format, in microseconds since the profiler was enabled.
+        void save_trace(std::ostream &out) const {
+            const char *categories[] = {"layer", "task", "scope"};
+            std::vector<event> all = events();
+            out << "{\"traceEvents\": [\n";
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                for (std::size_t i = 0; i < m_threads.size(); ++i)
+                    out << "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": " << i
+                        << ", \"args\": {\"name\": \"" << m_threads[i]->name << "\"}},\n";
+            }
+            out << std::fixed << std::setprecision(3);
+            for (std::size_t i = 0; i < all.size(); ++i) {
+                const event &e = all[i];
+                out << "  {\"name\": \"" << e.name << "\", \"cat\": \"" << categories[e.type] << "\", \"ph\": \"X\", \"pid\": 0, \"tid\": "
+                    << e.thread << ", \"ts\": " << microseconds(e.begin - m_start) << ", \"dur\": "
+                    << microseconds(e.end - e.begin) << ", \"args\": {";
+                if (e.type == layer_event)
+                    out << "\"flops\": " << e.flops << ", \"allocated\": " << e.bytes;
+                else if (e.type == task_event)
+                    out << "\"wait_us\": " << microseconds(e.wait);
+                out << "}}" << (i + 1 < all.size() ? ",\n" : "\n");
+            }
+            out << "]}\n";
+        }
+
+        // Time, GFLOPS and allocations of every layer in order of first use, then the tasks of the thread pool
+        // and the scopes.
+        void print_summary(std::ostream &out) const {
+            struct total {
+                std::string name;
+                std::size_t calls = 0, bytes = 0;
+                double seconds = 0, wait = 0, flops = 0;
+            };
+            std::vector<event> all = events();
+            std::vector<total> layers, scopes;
+            std::map<const void *, std::size_t> layer_index;
+            std::map<std::string, std::size_t> scope_index;
+            total tasks;
+            double layer_seconds = 0;
+            for (const event &e: all) {
+                total *t = &tasks;
+                if (e.type == layer_event) {
+                    if (!layer_index.count(e.key)) {
+                        layer_index[e.key] = layers.size();
+                        layers.push_back(total());
+                        layers.back().name = e.name;
+                    }
+                    t = &layers[layer_index[e.key]];
+                    layer_seconds += seconds(e.end - e.begin);
+                } else if (e.type == scope_event) {
+                    if (!scope_index.count(e.name)) {
+                        scope_index[e.name] = scopes.size();
+                        scopes.push_back(total());
+                        scopes.back().name = e.name;
+                    }
+                    t = &scopes[scope_index[e.name]];
+                }
+                ++t->calls;
+                t->seconds += seconds(e.end - e.begin);
+                t->wait += seconds(e.wait);
+                t->flops += e.flops;
+                t->bytes += e.bytes;
+            }
+            std::ios::fmtflags flags = out.flags();
+            std::streamsize precision = out.precision();
+            out << std::fixed << std::setprecision(3) << std::left << std::setw(16) << "  layer" << std::right
+                << std::setw(8) << "calls" << std::setw(12) << "total" << std::setw(12) << "mean" << std::setw(8) << "share"
+                << std::setw(10) << "GFLOPS" << std::setw(12) << "allocated" << "\n";
+            for (const total &t: layers)
+                out << "  " << std::left << std::setw(14) << t.name << std::right << std::setw(8) << t.calls
+                    << std::setw(10) << t.seconds * 1e3 << "ms" << std::setw(10) << t.seconds / t.calls * 1e3 << "ms"
+                    << std::setprecision(1) << std::setw(7) << 100 * t.seconds / layer_seconds << "%" << std::setprecision(2)
+                    << std::setw(10) << (t.seconds ? t.flops / t.seconds / 1e9 : 0) << std::setw(10) << t.bytes / 1048576.0
+                    << "MB" << std::setprecision(3) << "\n";
+            if (tasks.calls)
+                out << "  Thread pool: " << tasks.calls << " tasks, waited " << tasks.wait * 1e3 << "ms ("
+                    << tasks.wait / tasks.calls * 1e6 << "us each), ran " << tasks.seconds * 1e3 << "ms ("
+                    << tasks.seconds / tasks.calls * 1e6 << "us each)\n";
+            for (const total &t: scopes)
+                out << "  " << std::left << std::setw(14) << t.name << std::right << std::setw(8) << t.calls
+                    << std::setw(10) << t.seconds * 1e3 << "ms" << std::setw(10) << t.seconds / t.calls * 1e3 << "ms\n";
+            out.flags(flags);
+            out.precision(precision);
+        }
+    private:
+        struct thread_buffer {
+            std::mutex mutex;
+            std::vector<event> events;
+            std::size_t id;
+            std::string name;
+        };
+        struct thread_state {
+            std::shared_ptr<thread_buffer> buffer;
+            const char *name = nullptr;
+            std::size_t index = 0;
+        };
+        profiler() : m_start(clock::now()) {}
+        static std::atomic<bool> &flag() {
+            static std::atomic<bool> enabled(false);
+            return enabled;
+        }
+        static thread_state &local() {
+            static thread_local thread_state state;
+            return state;
+        }
+        static double seconds(clock::duration duration) {
+            return std::chrono::duration<double>(duration).count();
+        }
+        static double microseconds(clock::duration duration) {
+            return std::chrono::duration<double, std::micro>(duration).count();
+        }
+        mutable std::mutex m_mutex;
+        std::vector<std::shared_ptr<thread_buffer> > m_threads;
+        clock::time_point m_start;
+    };
+
+}
+
+#endif
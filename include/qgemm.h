@@ -0,0 +1,370 @@
+#ifndef QGEMM_H
+#define QGEMM_H
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+
+#include "simd.h"
+#include "gemm.h"
+
+namespace tnn {
+    namespace qgemm {
+        // C (m x n, int32) = A (m x k, uint8) * B (k x n, int8), the INT8 counterpart of gemm.h.
+        //
+        // A holds activations quantized to 7 bits. vpmaddubsw adds two u8 x s8 products in int16, which cannot
+        // saturate for 127 * 127 * 2, and vpmaddwd then adds pairs of these into int32. Rows of A are read in
+        // place: the microkernel broadcasts 4 consecutive bytes of a row against a group of B.
+        //
+        // B, the weights, are packed once into nr-column panels of groups: for every 4 rows of k, the 4 bytes
+        // of each of the nr columns in turn. k is padded to a multiple of 4 with zero weights, so whatever A
+        // holds in its padding does not count.
+        const std::size_t mr = 6, nr = 16, group = 4, kc = 1024;
+        // Rows and columns of C a caller should compute at once, which bounds its buffers for A and C.
+        const std::size_t mc = 96, nc = 256;
+
+        // Quantization of activations: q = round(x / scale) + zero_point, clamped to [0, 127].
+        struct range {
+            float scale;
+            int zero_point;
+            range() : scale(1), zero_point(0) {}
+            range(float scale, int zero_point) : scale(scale), zero_point(zero_point) {}
+            // Non-negative inputs, e.g. after a relu, use all 7 bits. Others are centered at 64.
+            static range from_bounds(float min, float max) {
+                if (min >= 0)
+                    return range(max > 0 ? max / 127 : 1, 0);
+                float bound = std::max(-min, max);
+                return range(bound / 63, 64);
+            }
+            template<typename U>
+            std::uint8_t quantize(U x) const {
+                int q = static_cast<int>(std::nearbyint(std::min(std::max(x / scale, U(-256)), U(256))));
+                return static_cast<std::uint8_t>(std::min(std::max(q + zero_point, 0), 127));
+            }
+        };
+
+        template<typename U>
+        void quantize_scalar(const U *x, std::size_t n, const range &r, std::uint8_t *q) {
+            for (std::size_t i = 0; i < n; ++i)
+                q[i] = r.quantize(x[i]);
+        }
+
+#if TNN_X86
+        // Clamped before the conversions, which turn out of range values into INT_MIN.
+        TNN_TARGET_SSE41 inline void quantize_sse41(const float *x, std::size_t n, const range &r, std::uint8_t *q) {
+            const __m128 inv = _mm_set1_ps(1 / r.scale), min = _mm_set1_ps(-256), max = _mm_set1_ps(256);
+            const __m128i zero_point = _mm_set1_epi32(r.zero_point), low = _mm_setzero_si128(), high = _mm_set1_epi32(127);
+            std::size_t i = 0;
+            for (; i + 16 <= n; i += 16) {
+                __m128i v[4];
+                for (std::size_t j = 0; j < 4; ++j) {
+                    __m128 scaled = _mm_mul_ps(_mm_loadu_ps(x + i + 4 * j), inv);
+                    v[j] = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(scaled, min), max));
+                    v[j] = _mm_min_epi32(_mm_max_epi32(_mm_add_epi32(v[j], zero_point), low), high);
+                }
+                __m128i packed = _mm_packus_epi16(_mm_packs_epi32(v[0], v[1]), _mm_packs_epi32(v[2], v[3]));
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(q + i), packed);
+            }
+            quantize_scalar(x + i, n - i, r, q + i);
+        }
+
+        TNN_TARGET_AVX2 inline void quantize_avx2(const float *x, std::size_t n, const range &r, std::uint8_t *q) {
+            const __m256 inv = _mm256_set1_ps(1 / r.scale), min = _mm256_set1_ps(-256), max = _mm256_set1_ps(256);
+            const __m256i zero_point = _mm256_set1_epi32(r.zero_point), low = _mm256_setzero_si256(),
+                          high = _mm256_set1_epi32(127), order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+            std::size_t i = 0;
+            for (; i + 32 <= n; i += 32) {
+                __m256i v[4];
+                for (std::size_t j = 0; j < 4; ++j) {
+                    __m256 scaled = _mm256_mul_ps(_mm256_loadu_ps(x + i + 8 * j), inv);
+                    v[j] = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(scaled, min), max));
+                    v[j] = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(v[j], zero_point), low), high);
+                }
+                // The packs interleave the 128-bit lanes, which the permutation undoes.
+                __m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(v[0], v[1]), _mm256_packs_epi32(v[2], v[3]));
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(q + i), _mm256_permutevar8x32_epi32(packed, order));
+            }
+            quantize_scalar(x + i, n - i, r, q + i);
+        }
+
+        // Masked for the last values, and narrowed to bytes by vpmovusdb on the way to memory.
+        TNN_TARGET_AVX512 inline void quantize_avx512(const float *x, std::size_t n, const range &r, std::uint8_t *q) {
+            const __m512 inv = _mm512_set1_ps(1 / r.scale), min = _mm512_set1_ps(-256), max = _mm512_set1_ps(256);
+            const __m512i zero_point = _mm512_set1_epi32(r.zero_point), low = _mm512_setzero_si512(),
+                          high = _mm512_set1_epi32(127);
+            for (std::size_t i = 0; i < n; i += 16) {
+                __mmask16 lanes = simd::mask16(n - i);
+                __m512 scaled = _mm512_mul_ps(_mm512_maskz_loadu_ps(lanes, x + i), inv);
+                __m512i v = _mm512_cvtps_epi32(_mm512_min_ps(_mm512_max_ps(scaled, min), max));
+                v = _mm512_min_epi32(_mm512_max_epi32(_mm512_add_epi32(v, zero_point), low), high);
+                _mm512_mask_cvtusepi32_storeu_epi8(q + i, lanes, v);
+            }
+        }
+#endif
+
+        // Quantizes n activations with the SIMD path in use. Only float has SIMD ones.
+        template<typename U>
+        void quantize(const U *x, std::size_t n, const range &r, std::uint8_t *q) {
+            quantize_scalar(x, n, r, q);
+        }
+
+        inline void quantize(const float *x, std::size_t n, const range &r, std::uint8_t *q) {
+#if TNN_X86
+            switch (simd::current()) {
+                case simd::avx512: return quantize_avx512(x, n, r, q);
+                case simd::avx2: return quantize_avx2(x, n, r, q);
+                case simd::sse41: return quantize_sse41(x, n, r, q);
+                default: break;
+            }
+#endif
+            quantize_scalar(x, n, r, q);
+        }
+
+        // Weights quantized symmetrically to [-127, 127] with one scale per output (column of B).
+        class packed_weight {
+        public:
+            packed_weight() : m_columns(0), m_depth(0), m_mapped(nullptr) {}
+            // Element (j, p) of the float weights, output j and input p, is at data[j * rs + p * cs].
+            template<typename U>
+            void pack(std::size_t columns, std::size_t depth, const U *data, std::size_t rs, std::size_t cs) {
+                m_columns = columns;
+                m_depth = gemm::round_up(depth, group);
+                m_mapped = nullptr;
+                m_owner.reset();
+                m_scale.assign(columns, 1);
+                m_sum.assign(columns, 0);
+                m_data.assign(gemm::round_up(columns, nr) * m_depth, 0);
+                for (std::size_t j = 0; j < columns; ++j) {
+                    U bound = 0;
+                    for (std::size_t p = 0; p < depth; ++p)
+                        bound = std::max(bound, std::abs(data[j * rs + p * cs]));
+                    if (bound > 0)
+                        m_scale[j] = bound / 127;
+                    std::int8_t *panel = &m_data[j / nr * nr * m_depth] + j % nr * group;
+                    for (std::size_t p = 0; p < depth; ++p) {
+                        int q = static_cast<int>(std::nearbyint(data[j * rs + p * cs] / m_scale[j]));
+                        q = std::min(std::max(q, -127), 127);
+                        panel[p / group * nr * group + p % group] = static_cast<std::int8_t>(q);
+                        m_sum[j] += q;
+                    }
+                }
+            }
+            // Panel holding column j, a multiple of nr.
+            const std::int8_t *panel(std::size_t j) const {
+                return data() + j * m_depth;
+            }
+            // Padded depth, a multiple of 4. Rows of A must have at least this many bytes.
+            std::size_t depth() const {
+                return m_depth;
+            }
+            std::size_t columns() const {
+                return m_columns;
+            }
+            float scale(std::size_t j) const {
+                return m_scale[j];
+            }
+            // Sum of the quantized weights of column j, to take the zero point of A back out.
+            std::int32_t sum(std::size_t j) const {
+                return m_sum[j];
+            }
+            std::size_t bytes() const {
+                return gemm::round_up(m_columns, nr) * m_depth + m_scale.size() * sizeof(float) + m_sum.size() * sizeof(std::int32_t);
+            }
+            bool empty() const {
+                return !m_columns;
+            }
+            // The columns and the padded depth, the scales and sums, then the panels at the next multiple of
+            // packed_cache::alignment.
+            void save(std::ostream &out) const {
+                std::uint64_t shape[2] = {m_columns, m_depth};
+                out.write(reinterpret_cast<const char *>(shape), sizeof(shape));
+                out.write(reinterpret_cast<const char *>(m_scale.data()), m_scale.size() * sizeof(float));
+                out.write(reinterpret_cast<const char *>(m_sum.data()), m_sum.size() * sizeof(std::int32_t));
+                packed_cache::pad(out);
+                out.write(reinterpret_cast<const char *>(data()), gemm::round_up(m_columns, nr) * m_depth);
+            }
+            // Points the weights at what save() wrote for `columns` outputs of `depth` inputs, copying the few
+            // scales and sums. Returns false if `in` does not hold that.
+            bool map(mapped_file &in, std::size_t columns, std::size_t depth) {
+                std::uint64_t shape[2];
+                const char *header = in.read(sizeof(shape));
+                if (!header)
+                    return false;
+                std::memcpy(shape, header, sizeof(shape));
+                if (shape[0] != columns || shape[1] != gemm::round_up(depth, group))
+                    return false;
+                const char *scale = in.read(columns * sizeof(float)), *sum = in.read(columns * sizeof(std::int32_t));
+                in.align(packed_cache::alignment);
+                const char *panels = in.read(gemm::round_up(columns, nr) * shape[1]);
+                if (!scale || !sum || !panels)
+                    return false;
+                m_columns = columns;
+                m_depth = shape[1];
+                m_scale.resize(columns);
+                m_sum.resize(columns);
+                std::memcpy(m_scale.data(), scale, columns * sizeof(float));
+                std::memcpy(m_sum.data(), sum, columns * sizeof(std::int32_t));
+                m_data = aligned_vector<std::int8_t>();
+                m_mapped = reinterpret_cast<const std::int8_t *>(panels);
+                m_owner = in.owner();
+                return true;
+            }
+        private:
+            const std::int8_t *data() const {
+                return m_mapped ? m_mapped : m_data.data();
+            }
+            std::size_t m_columns, m_depth;
+            aligned_vector<std::int8_t> m_data;
+            // Panels in a mapped packed cache instead of m_data, and the owner of the mapping.
+            const std::int8_t *m_mapped;
+            std::shared_ptr<const void> m_owner;
+            std::vector<float> m_scale;
+            std::vector<std::int32_t> m_sum;
+        };
+
+        inline std::int32_t load_group(const std::uint8_t *a) {
+            std::int32_t result;
+            std::memcpy(&result, a, sizeof(result));
+            return result;
+        }
+
+        template<std::size_t Rows>
+        void micro_kernel_scalar(std::size_t k, const std::uint8_t *a, std::size_t lda, const std::int8_t *b,
+                                 std::int32_t *c, std::size_t ldc, bool accumulate) {
+            std::int32_t acc[Rows][nr] = {};
+            for (std::size_t p = 0; p < k; p += group, b += nr * group)
+                for (std::size_t i = 0; i < Rows; ++i)
+                    for (std::size_t j = 0; j < nr; ++j)
+                        for (std::size_t g = 0; g < group; ++g)
+                            acc[i][j] += a[i * lda + p + g] * b[j * group + g];
+            for (std::size_t i = 0; i < Rows; ++i, c += ldc)
+                for (std::size_t j = 0; j < nr; ++j)
+                    c[j] = accumulate ? c[j] + acc[i][j] : acc[i][j];
+        }
+
+#if TNN_X86
+        // The panel as two 8-column halves, each a pair of xmm accumulators per row.
+        template<std::size_t Rows>
+        TNN_TARGET_SSE41 void micro_kernel_sse41(std::size_t k, const std::uint8_t *a, std::size_t lda,
+                                                 const std::int8_t *b, std::int32_t *c, std::size_t ldc,
+                                                 bool accumulate) {
+            const __m128i ones = _mm_set1_epi16(1);
+            for (std::size_t half = 0; half < 2; ++half) {
+                __m128i acc[Rows][2];
+                for (std::size_t i = 0; i < Rows; ++i)
+                    acc[i][0] = acc[i][1] = _mm_setzero_si128();
+                const std::int8_t *bp = b + half * 8 * group;
+                for (std::size_t p = 0; p < k; p += group, bp += nr * group) {
+                    __m128i b0 = _mm_load_si128(reinterpret_cast<const __m128i *>(bp)),
+                            b1 = _mm_load_si128(reinterpret_cast<const __m128i *>(bp + 16));
+                    for (std::size_t i = 0; i < Rows; ++i) {
+                        __m128i ai = _mm_set1_epi32(load_group(a + i * lda + p));
+                        acc[i][0] = _mm_add_epi32(acc[i][0], _mm_madd_epi16(_mm_maddubs_epi16(ai, b0), ones));
+                        acc[i][1] = _mm_add_epi32(acc[i][1], _mm_madd_epi16(_mm_maddubs_epi16(ai, b1), ones));
+                    }
+                }
+                std::int32_t *cp = c + half * 8;
+                for (std::size_t i = 0; i < Rows; ++i, cp += ldc) {
+                    __m128i *row = reinterpret_cast<__m128i *>(cp);
+                    if (accumulate) {
+                        acc[i][0] = _mm_add_epi32(acc[i][0], _mm_loadu_si128(row));
+                        acc[i][1] = _mm_add_epi32(acc[i][1], _mm_loadu_si128(row + 1));
+                    }
+                    _mm_storeu_si128(row, acc[i][0]);
+                    _mm_storeu_si128(row + 1, acc[i][1]);
+                }
+            }
+        }
+
+        template<std::size_t Rows>
+        TNN_TARGET_AVX2 void micro_kernel_avx2(std::size_t k, const std::uint8_t *a, std::size_t lda,
+                                               const std::int8_t *b, std::int32_t *c, std::size_t ldc,
+                                               bool accumulate) {
+            const __m256i ones = _mm256_set1_epi16(1);
+            __m256i acc[Rows][2];
+            for (std::size_t i = 0; i < Rows; ++i)
+                acc[i][0] = acc[i][1] = _mm256_setzero_si256();
+            for (std::size_t p = 0; p < k; p += group, b += nr * group) {
+                __m256i b0 = _mm256_load_si256(reinterpret_cast<const __m256i *>(b)),
+                        b1 = _mm256_load_si256(reinterpret_cast<const __m256i *>(b + 32));
+                for (std::size_t i = 0; i < Rows; ++i) {
+                    __m256i ai = _mm256_set1_epi32(load_group(a + i * lda + p));
+                    acc[i][0] = _mm256_add_epi32(acc[i][0], _mm256_madd_epi16(_mm256_maddubs_epi16(ai, b0), ones));
+                    acc[i][1] = _mm256_add_epi32(acc[i][1], _mm256_madd_epi16(_mm256_maddubs_epi16(ai, b1), ones));
+                }
+            }
+            for (std::size_t i = 0; i < Rows; ++i, c += ldc) {
+                __m256i *row = reinterpret_cast<__m256i *>(c);
+                if (accumulate) {
+                    acc[i][0] = _mm256_add_epi32(acc[i][0], _mm256_loadu_si256(row));
+                    acc[i][1] = _mm256_add_epi32(acc[i][1], _mm256_loadu_si256(row + 1));
+                }
+                _mm256_storeu_si256(row, acc[i][0]);
+                _mm256_storeu_si256(row + 1, acc[i][1]);
+            }
+        }
+#endif
+
+        // Computes `Rows` rows of A against one panel of B into a Rows x nr tile of C.
+        typedef void (*kernel)(std::size_t k, const std::uint8_t *a, std::size_t lda, const std::int8_t *b,
+                               std::int32_t *c, std::size_t ldc, bool accumulate);
+
+        // The microkernel of the SIMD path in use. AVX-512F has no byte multiplies, which need AVX-512BW, so it
+        // runs the AVX2 one.
+        template<std::size_t Rows>
+        kernel micro_kernel(simd::isa level) {
+#if TNN_X86
+            switch (level) {
+                case simd::avx512:
+                case simd::avx2: return micro_kernel_avx2<Rows>;
+                case simd::sse41: return micro_kernel_sse41<Rows>;
+                default: break;
+            }
+#endif
+            return micro_kernel_scalar<Rows>;
+        }
+
+        // C = A * B for the m rows of A (row stride lda) and columns [first, first + n) of B, where first is a
+        // multiple of nr. C has a row stride of ldc. Runs on the calling thread.
+        inline void multiply(std::size_t m, std::size_t n, const std::uint8_t *a, std::size_t lda, const packed_weight &b,
+                             std::size_t first, std::int32_t *c, std::size_t ldc) {
+            // Every kc deep sliver of a panel stays in L1 while it is swept over all rows of A.
+            std::size_t k = b.depth();
+            simd::isa level = simd::current();
+            // Indexed by the number of rows less one.
+            const kernel kernels[mr] = {micro_kernel<1>(level), micro_kernel<2>(level), micro_kernel<3>(level),
+                                        micro_kernel<4>(level), micro_kernel<5>(level), micro_kernel<6>(level)};
+            std::int32_t tile[mr * nr];
+            for (std::size_t pc = 0; pc < k; pc += kc) {
+                std::size_t kb = std::min(kc, k - pc);
+                for (std::size_t j = 0; j < n; j += nr) {
+                    std::size_t cols = std::min(nr, n - j);
+                    const std::int8_t *panel = b.panel(first + j) + pc * nr;
+                    for (std::size_t i = 0; i < m; i += mr) {
+                        std::size_t rows = std::min(mr, m - i);
+                        if (cols == nr)
+                            kernels[rows - 1](kb, a + i * lda + pc, lda, panel, c + i * ldc + j, ldc, pc != 0);
+                        else {
+                            kernels[rows - 1](kb, a + i * lda + pc, lda, panel, tile, nr, false);
+                            for (std::size_t r = 0; r < rows; ++r)
+                                for (std::size_t s = 0; s < cols; ++s)
+                                    c[(i + r) * ldc + j + s] = pc ? c[(i + r) * ldc + j + s] + tile[r * nr + s]
+                                                                  : tile[r * nr + s];
+                        }
+                    }
+                }
+            }
+        }
+
+        template<typename T>
+        aligned_vector<T> &thread_buffer(std::size_t i) {
+            static thread_local aligned_vector<T> buffers[2];
+            return buffers[i];
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,175 @@
+#ifndef RESIZE_H
+#define RESIZE_H
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include "simd.h"
+#include "aligned_allocator.h"
+
+namespace tnn {
+    // Resampling of 8-bit images, one channel plane at a time, onto a crop of the resized image, without ever
+    // holding the resized image: every output pixel of the crop is computed from the input once, and written
+    // already normalized. The filter is a triangle as wide as an input pixel or an output pixel, whichever is
+    // larger, so bilinear when enlarging and close to an area average when shrinking, both axes separately.
+    namespace resize {
+        // One axis: outputs [first, first + count) of `output` resampled from `input` elements. Output o of the
+        // crop is the sum over k < taps of weight[k * count + o] times input element start[o] + k. Windows are
+        // clipped to the input, and shorter ones padded with zero weights, so that all have `taps` elements and
+        // [begin, end) holds them all.
+        struct axis {
+            axis(std::size_t input, std::size_t output, std::size_t first, std::size_t count)
+                    : count(count), taps(1), begin(input), end(0), start(count) {
+                double scale = static_cast<double>(input) / output, support = std::max(scale, 1.0);
+                std::vector<std::size_t> low(count), high(count);
+                std::vector<double> center(count);
+                for (std::size_t o = 0; o < count; ++o) {
+                    center[o] = (first + o + 0.5) * scale;
+                    low[o] = static_cast<std::size_t>(std::max(0.0, std::floor(center[o] - support + 0.5)));
+                    high[o] = std::min<std::size_t>(
+                            input, static_cast<std::size_t>(std::max(0.0, std::floor(center[o] + support + 0.5))));
+                    low[o] = std::min(low[o], input - 1);
+                    high[o] = std::max(high[o], low[o] + 1);
+                    taps = std::max(taps, high[o] - low[o]);
+                }
+                weight.assign(taps * count, 0);
+                for (std::size_t o = 0; o < count; ++o) {
+                    start[o] = static_cast<int>(std::min(low[o], input - taps));
+                    double total = 0;
+                    for (std::size_t x = low[o]; x < high[o]; ++x)
+                        total += std::max(0.0, 1 - std::fabs(x + 0.5 - center[o]) / support);
+                    for (std::size_t x = low[o]; x < high[o]; ++x)
+                        weight[(x - start[o]) * count + o] = static_cast<float>(
+                                total > 0 ? std::max(0.0, 1 - std::fabs(x + 0.5 - center[o]) / support) / total
+                                          : 1.0 / (high[o] - low[o]));
+                    begin = std::min<std::size_t>(begin, start[o]);
+                    end = std::max<std::size_t>(end, start[o] + taps);
+                }
+            }
+            std::size_t count, taps, begin, end;
+            std::vector<int> start;
+            std::vector<float> weight;
+        };
+
+        // Columns [cols.begin, cols.end) of an output row, resampled along the rows only.
+        inline aligned_vector<float> &row_buffer() {
+            static thread_local aligned_vector<float> buffer;
+            return buffer;
+        }
+
+        inline void resample_row_scalar(const float *row, const axis &cols, float scale, float shift, float *out) {
+            for (std::size_t j = 0; j < cols.count; ++j) {
+                const float *window = row + (cols.start[j] - cols.begin);
+                float sum = 0;
+                for (std::size_t k = 0; k < cols.taps; ++k)
+                    sum += cols.weight[k * cols.count + j] * window[k];
+                out[j] = sum * scale + shift;
+            }
+        }
+
+        inline void crop_scalar(const std::uint8_t *plane, std::size_t stride, const axis &rows, const axis &cols,
+                                float scale, float shift, float *out) {
+            aligned_vector<float> &row = row_buffer();
+            std::size_t width = cols.end - cols.begin;
+            row.resize(width);
+            for (std::size_t i = 0; i < rows.count; ++i, out += cols.count) {
+                std::fill(row.begin(), row.end(), 0.0f);
+                for (std::size_t k = 0; k < rows.taps; ++k) {
+                    const std::uint8_t *input = plane + (rows.start[i] + k) * stride + cols.begin;
+                    float w = rows.weight[k * rows.count + i];
+                    for (std::size_t x = 0; x < width; ++x)
+                        row[x] += w * input[x];
+                }
+                resample_row_scalar(&row[0], cols, scale, shift, out);
+            }
+        }
+
+#if TNN_X86
+        // Rows are resampled first, 4 or 8 contiguous input pixels at a time widened from bytes, into a float row
+        // in L1; the columns then gather the taps of 8 consecutive outputs from it on AVX2, one at a time below.
+        TNN_TARGET_SSE41 inline void crop_sse41(const std::uint8_t *plane, std::size_t stride, const axis &rows,
+                                                const axis &cols, float scale, float shift, float *out) {
+            aligned_vector<float> &row = row_buffer();
+            std::size_t width = cols.end - cols.begin;
+            row.resize(width + 4);
+            for (std::size_t i = 0; i < rows.count; ++i, out += cols.count) {
+                std::fill(row.begin(), row.end(), 0.0f);
+                for (std::size_t k = 0; k < rows.taps; ++k) {
+                    const std::uint8_t *input = plane + (rows.start[i] + k) * stride + cols.begin;
+                    float w = rows.weight[k * rows.count + i];
+                    __m128 weight = _mm_set1_ps(w);
+                    std::size_t x = 0;
+                    for (; x + 4 <= width; x += 4) {
+                        std::int32_t bytes;
+                        std::memcpy(&bytes, input + x, sizeof(bytes));
+                        __m128 value = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes)));
+                        _mm_store_ps(&row[x], _mm_add_ps(_mm_load_ps(&row[x]), _mm_mul_ps(weight, value)));
+                    }
+                    for (; x < width; ++x)
+                        row[x] += w * input[x];
+                }
+                resample_row_scalar(&row[0], cols, scale, shift, out);
+            }
+        }
+        TNN_TARGET_AVX2 inline void crop_avx2(const std::uint8_t *plane, std::size_t stride, const axis &rows,
+                                              const axis &cols, float scale, float shift, float *out) {
+            aligned_vector<float> &row = row_buffer();
+            std::size_t width = cols.end - cols.begin, j;
+            row.resize(width + 8);
+            const __m256i begin = _mm256_set1_epi32(static_cast<int>(cols.begin));
+            for (std::size_t i = 0; i < rows.count; ++i, out += cols.count) {
+                std::fill(row.begin(), row.end(), 0.0f);
+                for (std::size_t k = 0; k < rows.taps; ++k) {
+                    const std::uint8_t *input = plane + (rows.start[i] + k) * stride + cols.begin;
+                    float w = rows.weight[k * rows.count + i];
+                    __m256 weight = _mm256_set1_ps(w);
+                    std::size_t x = 0;
+                    for (; x + 8 <= width; x += 8) {
+                        __m256 value = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(
+                                _mm_loadl_epi64(reinterpret_cast<const __m128i *>(input + x))));
+                        _mm256_store_ps(&row[x], _mm256_fmadd_ps(weight, value, _mm256_load_ps(&row[x])));
+                    }
+                    for (; x < width; ++x)
+                        row[x] += w * input[x];
+                }
+                for (j = 0; j + 8 <= cols.count; j += 8) {
+                    __m256i index = _mm256_sub_epi32(
+                            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&cols.start[j])), begin);
+                    __m256 sum = _mm256_setzero_ps();
+                    for (std::size_t k = 0; k < cols.taps; ++k)
+                        sum = _mm256_fmadd_ps(_mm256_loadu_ps(&cols.weight[k * cols.count + j]),
+                                              _mm256_i32gather_ps(&row[k], index, 4), sum);
+                    _mm256_storeu_ps(out + j, _mm256_fmadd_ps(sum, _mm256_set1_ps(scale), _mm256_set1_ps(shift)));
+                }
+                for (; j < cols.count; ++j) {
+                    const float *window = &row[cols.start[j] - cols.begin];
+                    float sum = 0;
+                    for (std::size_t k = 0; k < cols.taps; ++k)
+                        sum += cols.weight[k * cols.count + j] * window[k];
+                    out[j] = sum * scale + shift;
+                }
+            }
+        }
+#endif
+
+        // Channel `plane` of an 8-bit image of `stride` bytes per row, resampled onto the crop `rows` x `cols`
+        // of the resized image, and every value v stored as v * scale + shift, cols.count per row, at `out`.
+        inline void crop(const std::uint8_t *plane, std::size_t stride, const axis &rows, const axis &cols, float scale,
+                         float shift, float *out) {
+#if TNN_X86
+            switch (simd::current()) {
+                case simd::avx512:
+                case simd::avx2: return crop_avx2(plane, stride, rows, cols, scale, shift, out);
+                case simd::sse41: return crop_sse41(plane, stride, rows, cols, scale, shift, out);
+                default: break;
+            }
+#endif
+            crop_scalar(plane, stride, rows, cols, scale, shift, out);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <cstring>
+#include <atomic>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TNN_X86 1
+// GCC 12 warns about the deliberately undefined registers in some AVX-512 intrinsics (GCC bug 105593).
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#include <immintrin.h>
+#pragma GCC diagnostic pop
+// Compiles one function for an instruction set beyond the one of the translation unit. It must only be called
+// once simd::current() has said the CPU supports it.
+#define TNN_TARGET(isa) __attribute__((target(isa)))
+#define TNN_TARGET_SSE41 TNN_TARGET("sse4.1")
+#define TNN_TARGET_AVX2 TNN_TARGET("avx2,fma")
+#define TNN_TARGET_AVX512 TNN_TARGET("avx512f,avx2,fma")
+#else
+#define TNN_X86 0
+#endif
+
+namespace tnn {
+    // Every SIMD kernel is compiled for each of these levels into the same binary, whatever the compiler flags,
+    // and the one in use is picked from cpuid when the process starts. Layers look at current() when they run.
+    namespace simd {
+        enum isa { scalar, sse41, avx2, avx512 };
+
+        // Best level the CPU supports. AVX2 is only used together with FMA.
+        inline isa detect() {
+#if TNN_X86
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+                return avx512;
+            if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+                return avx2;
+            if (__builtin_cpu_supports("sse4.1"))
+                return sse41;
+#endif
+            return scalar;
+        }
+
+        inline std::atomic<int> &selected() {
+            static std::atomic<int> level(detect());
+            return level;
+        }
+
+        inline isa current() {
+            return static_cast<isa>(selected().load(std::memory_order_relaxed));
+        }
+
+        // Uses at most `limit`, e.g. to compare the paths, and returns the level actually selected. Meant to be
+        // called before the model is loaded, not while layers run.
+        inline isa select(isa limit) {
+            isa level = std::min(limit, detect());
+            selected().store(level, std::memory_order_relaxed);
+            return level;
+        }
+
+        inline const char *name(isa level) {
+            switch (level) {
+                case sse41: return "SSE4.1";
+                case avx2: return "AVX2+FMA";
+                case avx512: return "AVX-512F";
+                default: return "scalar";
+            }
+        }
+
+        // Accepts "scalar", "sse4.1", "avx2" and "avx512", as well as the names above.
+        inline bool parse(const char *text, isa &level) {
+            const char *names[][2] = {{"scalar", "scalar"}, {"sse4.1", "SSE4.1"}, {"avx2", "AVX2+FMA"},
+                                      {"avx512", "AVX-512F"}};
+            for (int i = scalar; i <= avx512; ++i)
+                if (std::strcmp(text, names[i][0]) == 0 || std::strcmp(text, names[i][1]) == 0) {
+                    level = static_cast<isa>(i);
+                    return true;
+                }
+            return false;
+        }
+
+#if TNN_X86
+        TNN_TARGET_SSE41 inline float mm_sum(__m128 x) {
+            __m128 dual = _mm_add_ps(x, _mm_movehl_ps(x, x));
+            return _mm_cvtss_f32(_mm_add_ss(dual, _mm_shuffle_ps(dual, dual, 0x1)));
+        }
+
+        TNN_TARGET_AVX2 inline float mm256_sum(__m256 x) {
+            return mm_sum(_mm_add_ps(_mm256_castps256_ps128(x), _mm256_extractf128_ps(x, 1)));
+        }
+
+        // Lanes of the first n elements, all of them from 16 on. AVX-512 kernels load and store their remainders
+        // with it instead of looping over them.
+        inline __mmask16 mask16(std::size_t n) {
+            return n >= 16 ? 0xffff : static_cast<__mmask16>((1u << n) - 1);
+        }
+#endif
+    }
+}
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include <vector>
+
+#include "tensor.h"
+#include "simd.h"
+
+namespace tnn {
+    // Conversions between plain NCHW images and the channel blocked NCHW[b]c layout (see tensor_layout). Layers
+    // that consume blocked tensors produce blocked ones, so that a network converts only at its boundaries.
+    namespace layout {
+        // Channels per block: a vector register of floats on the selected SIMD path, but at least 8.
+        inline std::size_t preferred_block() {
+            return simd::current() == simd::avx512 ? 16 : 8;
+        }
+
+        inline std::size_t block(tensor_layout layout) {
+            return layout == tensor_layout::nchw16c ? 16 : layout == tensor_layout::nchw8c ? 8 : 1;
+        }
+
+        inline std::vector<std::size_t> blocked_shape(std::size_t n, std::size_t channels, std::size_t height,
+                                                      std::size_t width, std::size_t block) {
+            return {n, (channels + block - 1) / block, height, width, block};
+        }
+
+        // Rows [first, last) of the n x blocks x height rows of the blocked `y`, with zeros past the channels of `x`.
+        template<typename U, typename Allocator>
+        void to_blocked(const tensor<U, Allocator> &x, tensor<U, Allocator> &y, std::size_t first, std::size_t last) {
+            std::size_t channels = x.shape(1), blocks = y.shape(1), height = y.shape(2), width = y.shape(3),
+                        b = y.shape(4);
+            for (std::size_t j = first; j < last; ++j) {
+                std::size_t i = j / (blocks * height), c0 = j / height % blocks * b, h = j % height;
+                U *dst = y.get_raw(i, c0 / b, h, 0, 0);
+                for (std::size_t c = 0; c < b; ++c) {
+                    if (c0 + c >= channels) {
+                        for (std::size_t w = 0; w < width; ++w)
+                            dst[w * b + c] = U();
+                        continue;
+                    }
+                    const U *src = x.get_raw(i, c0 + c, h, 0);
+                    for (std::size_t w = 0; w < width; ++w)
+                        dst[w * b + c] = src[w];
+                }
+            }
+        }
+
+        // Planes [first, last) of the n x channels planes of the plain `y`.
+        template<typename U, typename Allocator>
+        void to_plain(const tensor<U, Allocator> &x, tensor<U, Allocator> &y, std::size_t first, std::size_t last) {
+            std::size_t channels = y.shape(1), pixels = y.shape(2) * y.shape(3), b = x.shape(4);
+            for (std::size_t j = first; j < last; ++j) {
+                std::size_t i = j / channels, c = j % channels;
+                const U *src = x.get_raw(i, c / b, 0, 0, c % b);
+                U *dst = y.get_raw(i, c, 0, 0);
+                for (std::size_t p = 0; p < pixels; ++p)
+                    dst[p] = src[p * b];
+            }
+        }
+
+        // Whole tensors, for inputs and results outside of a forward pass.
+        template<typename U, typename Allocator>
+        tensor<U, Allocator> to_blocked(const tensor<U, Allocator> &x, std::size_t block) {
+            tensor<U, Allocator> y;
+            std::vector<std::size_t> shape = blocked_shape(x.shape(0), x.shape(1), x.shape(2), x.shape(3), block);
+            y.resize(shape.begin(), shape.end());
+            to_blocked(x, y, 0, shape[0] * shape[1] * shape[2]);
+            return y;
+        }
+        template<typename U, typename Allocator>
+        tensor<U, Allocator> to_plain(const tensor<U, Allocator> &x, std::size_t channels) {
+            tensor<U, Allocator> y({x.shape(0), channels, x.shape(2), x.shape(3)});
+            to_plain(x, y, 0, x.shape(0) * channels);
+            return y;
+        }
+    }
+}
+
+#endif
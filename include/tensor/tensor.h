@@ -12,52 +12,110 @@
 #include <initializer_list>
 #include <cassert>
 #include <iostream>
+#include <atomic>
+#include <algorithm>
+
+#include "mapped_file.h"
+#include "aligned_allocator.h"
 
 namespace tnn {
 
-    template<typename U = float, typename Allocator = std::allocator<U> >
+    // Elements are either owned or point into memory owned by someone else, e.g. a mapped file (see map()).
+    // Resizing external storage first copies it into owned memory. Owned elements start at a multiple of
+    // `alignment` bytes, 64 with the default allocator.
+    template<typename U = float, typename Allocator = aligned_allocator<U> >
     class tensor_storage {
     public:
         typedef U data_type;
         typedef std::vector<U, Allocator> container;
-        tensor_storage() {}
+        static const std::size_t alignment = allocator_alignment<Allocator>::value;
+        tensor_storage() : m_pointer(nullptr), m_size(0) {}
         tensor_storage(const tensor_storage &other)
-                : m_data(other.m_data) {}
+                : m_data(other.m_pointer, other.m_pointer + other.m_size) {
+            update();
+            ++s_copies;
+        }
         tensor_storage(tensor_storage &&other)
-                : m_data(std::move(other.m_data)) {}
+                : m_data(std::move(other.m_data)), m_owner(std::move(other.m_owner)),
+                  m_pointer(other.m_pointer), m_size(other.m_size) {
+            other.update();
+        }
         tensor_storage &operator=(const tensor_storage &other) {
-            m_data = other.m_data;
+            m_data.assign(other.m_pointer, other.m_pointer + other.m_size);
+            m_owner.reset();
+            update();
+            ++s_copies;
             return *this;
         }
         tensor_storage &operator=(tensor_storage &&other) {
             m_data = std::move(other.m_data);
+            m_owner = std::move(other.m_owner);
+            m_pointer = other.m_pointer;
+            m_size = other.m_size;
+            other.update();
             return *this;
         }
         explicit tensor_storage(std::initializer_list<data_type> data)
-                : m_data(data) {}
+                : m_data(data) {
+            update();
+        }
         data_type &at(std::size_t i) {
-            return m_data[i];
+            return m_pointer[i];
         }
         const data_type &at(std::size_t i) const {
-            return m_data[i];
+            return m_pointer[i];
         }
         std::size_t size() const {
-            return m_data.size();
+            return m_size;
         }
         void resize(std::size_t i) {
+            if (m_owner) {
+                m_data.assign(m_pointer, m_pointer + std::min(i, m_size));
+                m_owner.reset();
+            }
             m_data.resize(i);
+            update();
         }
         data_type *get_raw() {
-            return &m_data[0];
+            return m_pointer;
         }
         const data_type *get_raw() const {
-            return &m_data[0];
+            return m_pointer;
+        }
+        // Uses `size` elements at `data` without copying them. `owner` keeps the memory alive.
+        void map(data_type *data, std::size_t size, std::shared_ptr<const void> owner) {
+            m_data = container();
+            m_owner = std::move(owner);
+            m_pointer = data;
+            m_size = size;
+        }
+        bool mapped() const {
+            return static_cast<bool>(m_owner);
+        }
+        // Number of deep copies made so far, for checking that the forward pass never copies.
+        static std::size_t copies() {
+            return s_copies;
         }
     private:
+        void update() {
+            m_pointer = m_data.data();
+            m_size = m_data.size();
+        }
         container m_data;
+        std::shared_ptr<const void> m_owner;
+        data_type *m_pointer;
+        std::size_t m_size;
+        static std::atomic<std::size_t> s_copies;
     };
 
-    template<typename U = float, typename Allocator = std::allocator<U> >
+    template<typename U, typename Allocator>
+    std::atomic<std::size_t> tensor_storage<U, Allocator>::s_copies(0);
+
+    // Layouts of images. Channel blocked ones, NCHW[b]c, are 5-D {n, (c + b - 1) / b, h, w, b}: the channels of
+    // a pixel b at a time, zero padded at the end, so that SIMD kernels load b channels at once. See layout.h.
+    enum class tensor_layout { nchw, nchw8c, nchw16c };
+
+    template<typename U = float, typename Allocator = aligned_allocator<U> >
     class tensor {
         template<typename V, typename A>
         friend std::ostream &operator<<(std::ostream &out, const tensor<V, A> &t);
@@ -68,16 +126,12 @@ namespace tnn {
         tensor() : m_data(std::make_shared<storage>()) {
             update_base();
         }
-        tensor(const tensor &other)
-                : m_data(std::make_shared<storage>(*other.m_data)), m_shape(other.m_shape), m_base(other.m_base) {}
+        // Tensors are move-only, so that passing one through the layers never copies its data by accident.
+        // Use clone() for a deep copy.
+        tensor(const tensor &other) = delete;
         tensor(tensor &&other)
                 : m_data(std::move(other.m_data)), m_shape(std::move(other.m_shape)), m_base(std::move(other.m_base)) {}
-        tensor &operator=(const tensor &other) {
-            m_data = std::make_shared<storage>(*other.m_data);
-            m_shape = other.m_shape;
-            m_base = other.m_base;
-            return *this;
-        }
+        tensor &operator=(const tensor &other) = delete;
         tensor &operator=(tensor &&other) {
             m_data = std::move(other.m_data);
             m_shape = std::move(other.m_shape);
@@ -94,9 +148,32 @@ namespace tnn {
             update_base();
             assert(size() == m_data->size());
         }
+        // View of the leading elements of a storage that may be larger than the tensor, e.g. a workspace buffer.
+        template<class InputIt>
+        tensor(storage_pointer data, InputIt first, InputIt last)
+                : m_data(std::move(data)), m_shape(first, last) {
+            update_base();
+            assert(size() <= m_data->size());
+        }
+        tensor clone() const {
+            tensor result;
+            result.m_data = std::make_shared<storage>(*m_data);
+            result.m_shape = m_shape;
+            result.m_base = m_base;
+            return result;
+        }
         void load(std::istream &in) {
             in.read(reinterpret_cast<char *>(get_raw()), sizeof(data_type) * size());
         }
+        // Points the tensor at its data in a mapped file instead of reading it.
+        void map(mapped_file &in) {
+            char *data = in.read(sizeof(data_type) * size());
+            if (data)
+                m_data->map(reinterpret_cast<data_type *>(data), size(), in.owner());
+        }
+        bool mapped() const {
+            return m_data->mapped();
+        }
         void save(std::ostream &out) const {
             out.write(reinterpret_cast<const char *>(get_raw()), sizeof(data_type) * size());
         }
@@ -104,12 +181,12 @@ namespace tnn {
         void reshape(InputIt first, InputIt last) {
             m_shape.assign(first, last);
             update_base();
-            assert(size() == m_data->size());
+            assert(size() <= m_data->size());
         }
         void reshape(std::initializer_list<std::size_t> shape) {
             m_shape = shape;
             update_base();
-            assert(size() == m_data->size());
+            assert(size() <= m_data->size());
         }
         template<class InputIt>
         void resize(InputIt first, InputIt last) {
@@ -142,6 +219,19 @@ namespace tnn {
         std::size_t ndim() const {
             return m_shape.size();
         }
+        // Whether the elements start at a multiple of `bytes`, e.g. of a vector register, so that kernels may use
+        // aligned loads. Owned tensors are aligned to storage::alignment; mapped ones to wherever the file put them.
+        bool aligned(std::size_t bytes) const {
+            return memory::aligned(get_raw(), bytes);
+        }
+        // Told by the shape: 5-D tensors with 8 or 16 elements in the last dimension are channel blocked.
+        tensor_layout layout() const {
+            if (m_shape.size() == 5 && m_shape[4] == 16)
+                return tensor_layout::nchw16c;
+            if (m_shape.size() == 5 && m_shape[4] == 8)
+                return tensor_layout::nchw8c;
+            return tensor_layout::nchw;
+        }
         template<typename ...Args>
         data_type *get_raw(Args ...args) {
             return m_data->get_raw() + get_pos(std::forward<Args>(args)...);
@@ -172,9 +262,9 @@ namespace tnn {
 
     template<typename U, typename Allocator>
     std::ostream &operator<<(std::ostream &out, const tensor<U, Allocator> &t) {
-        if (t.m_data->size())
+        if (t.size())
             out << t.m_data->at(0);
-        for (std::size_t i = 1; i < t.m_data->size(); ++i)
+        for (std::size_t i = 1; i < t.size(); ++i)
             out << " " << t.m_data->at(i);
         out << "\n[";
         if (!t.m_shape.empty())
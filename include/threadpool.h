@@ -2,7 +2,7 @@
 #define THREAD_POOL_H
 
 #include <vector>
-#include <queue>
+#include <deque>
 #include <memory>
 #include <thread>
 #include <mutex>
@@ -10,14 +10,22 @@
 #include <atomic>
 #include <future>
 #include <functional>
+#include <algorithm>
+
+#include "profiler.h"
 
 namespace tnn {
 
+    // Work-stealing pool. Every worker owns a deque: it pushes and pops its own tasks at the back and steals
+    // from the front of the others. Threads outside the pool share one extra deque. While the profiler is
+    // enabled, every task is recorded with the time it spent queued.
     class thread_pool {
     public:
-        thread_pool(std::size_t threads_n = std::thread::hardware_concurrency()) : stop(false) {
-            for(; threads_n; --threads_n)
-                workers.emplace_back(std::bind(&thread_pool::run, this));
+        thread_pool(std::size_t threads_n = std::thread::hardware_concurrency()) : stop(false), pending(0) {
+            for (std::size_t i = 0; i <= threads_n; ++i)
+                queues.emplace_back(new task_queue);
+            for (std::size_t i = 0; i < threads_n; ++i)
+                workers.emplace_back(std::bind(&thread_pool::run, this, i));
         }
         thread_pool(const thread_pool &) = delete;
         thread_pool &operator = (const thread_pool &) = delete;
@@ -26,58 +34,152 @@ namespace tnn {
         template<class F, class... Args>
         std::future<typename std::result_of<F(Args...)>::type> enqueue(F&& f, Args&&... args) {
             using packaged_task_t = std::packaged_task<typename std::result_of<F(Args...)>::type ()>;
-            std::shared_ptr<packaged_task_t> task(new packaged_task_t(
+            packaged_task_t *task = new packaged_task_t(
                     std::bind(std::forward<F>(f), std::forward<Args>(args)...)
-            ));
+            );
             auto res = task->get_future();
-            {
-                std::unique_lock<std::mutex> lock(this->queue_mutex);
-                tasks.emplace([task](){ (*task)(); });
-            }
-            condition.notify_one();
+            push(&thread_pool::invoke<packaged_task_t>, task, current_queue());
             return res;
         }
+        // Calls fn(s, e) for consecutive chunks [s, e) of [begin, end) with `grain` elements each, and returns
+        // when all chunks are done. Chunks are claimed dynamically by the calling thread and by idle workers.
+        // While waiting the calling thread runs other tasks, so parallel_for may be nested inside a chunk.
+        template<typename F>
+        void parallel_for(std::size_t begin, std::size_t end, std::size_t grain, const F &fn) {
+            if (begin >= end)
+                return;
+            grain = std::max<std::size_t>(grain, 1);
+            std::size_t chunks = (end - begin + grain - 1) / grain;
+            if (chunks == 1 || workers.empty()) {
+                fn(begin, end);
+                return;
+            }
+            job<F> j(begin, end, grain, chunks, fn);
+            std::size_t helpers = std::min(chunks - 1, workers.size()), index = current_queue();
+            j.helpers = helpers;
+            for (std::size_t i = 0; i < helpers; ++i)
+                push(&job<F>::help, &j, index);
+            j.run();
+            while (j.helpers.load())
+                if (!run_once(index))
+                    std::this_thread::yield();
+        }
         std::size_t get_thread_num() const {
             return workers.size();
         }
-        void run() {
-            while(true) {
-                std::function<void()> task;
-                {
-                    std::unique_lock<std::mutex> lock(queue_mutex);
-                    condition.wait(lock, [this]{ return stop || !tasks.empty(); });
-                    if(stop && tasks.empty())
-                        return;
-                    task = std::move(tasks.front());
-                    tasks.pop();
-                }
-                task();
-            }
-        }
-        void run_once() {
-            std::function<void()> task;
+        ~thread_pool() {
             {
-                std::unique_lock<std::mutex> lock(queue_mutex);
-                condition.wait(lock, [this]{ return stop || !tasks.empty(); });
-                if(stop && tasks.empty())
-                    return;
-                task = std::move(tasks.front());
-                tasks.pop();
+                std::unique_lock<std::mutex> lock(sleep_mutex);
+                this->stop = true;
             }
-            task();
-        }
-        ~thread_pool() {
-            this->stop = true;
             this->condition.notify_all();
             for(std::thread &worker: this->workers)
                 worker.join();
         }
     private:
+        struct task {
+            void (*function)(void *);
+            void *argument;
+            // Only set while profiling.
+            profiler::clock::time_point queued;
+        };
+        struct task_queue {
+            std::mutex mutex;
+            std::deque<task> tasks;
+        };
+        template<typename F>
+        struct job {
+            job(std::size_t begin, std::size_t end, std::size_t grain, std::size_t chunks, const F &fn)
+                    : begin(begin), end(end), grain(grain), chunks(chunks), fn(fn), next(0) {}
+            void run() {
+                for (std::size_t c; (c = next.fetch_add(1)) < chunks;)
+                    fn(begin + c * grain, std::min(end, begin + (c + 1) * grain));
+            }
+            // The job lives on the stack of parallel_for, which returns once every helper has checked out.
+            static void help(void *argument) {
+                job *j = static_cast<job *>(argument);
+                j->run();
+                --j->helpers;
+            }
+            std::size_t begin, end, grain, chunks;
+            const F &fn;
+            std::atomic<std::size_t> next, helpers;
+        };
+        template<typename T>
+        static void invoke(void *argument) {
+            T *t = static_cast<T *>(argument);
+            (*t)();
+            delete t;
+        }
+        static std::pair<const thread_pool *, std::size_t> &current() {
+            static thread_local std::pair<const thread_pool *, std::size_t> worker(nullptr, 0);
+            return worker;
+        }
+        std::size_t current_queue() const {
+            return current().first == this ? current().second : workers.size();
+        }
+        void push(void (*function)(void *), void *argument, std::size_t index) {
+            task t = {function, argument, profiler::enabled() ? profiler::clock::now() : profiler::clock::time_point()};
+            // Counted before it becomes visible, so that `pending` never drops below the number of queued tasks.
+            ++pending;
+            {
+                std::unique_lock<std::mutex> lock(queues[index]->mutex);
+                queues[index]->tasks.push_back(t);
+            }
+            {
+                std::unique_lock<std::mutex> lock(sleep_mutex);
+            }
+            condition.notify_one();
+        }
+        bool pop(task &t, std::size_t index) {
+            for (std::size_t i = 0; i < queues.size(); ++i) {
+                task_queue &queue = *queues[(index + i) % queues.size()];
+                std::unique_lock<std::mutex> lock(queue.mutex);
+                if (queue.tasks.empty())
+                    continue;
+                if (i == 0) {
+                    t = queue.tasks.back();
+                    queue.tasks.pop_back();
+                } else {
+                    t = queue.tasks.front();
+                    queue.tasks.pop_front();
+                }
+                --pending;
+                return true;
+            }
+            return false;
+        }
+        bool run_once(std::size_t index) {
+            task t;
+            if (!pop(t, index))
+                return false;
+            if (t.queued == profiler::clock::time_point() || !profiler::enabled()) {
+                t.function(t.argument);
+                return true;
+            }
+            profiler::clock::time_point begin = profiler::clock::now();
+            t.function(t.argument);
+            profiler::instance().record_task(t.queued, begin, profiler::clock::now());
+            return true;
+        }
+        void run(std::size_t index) {
+            current() = std::make_pair(this, index);
+            profiler::name_thread("worker", index);
+            while(true) {
+                if (run_once(index))
+                    continue;
+                std::unique_lock<std::mutex> lock(sleep_mutex);
+                condition.wait(lock, [this]{ return stop || pending.load(); });
+                if(stop && !pending.load())
+                    return;
+            }
+        }
         std::vector<std::thread> workers;
-        std::queue<std::function<void()> > tasks;
-        std::mutex queue_mutex;
+        std::vector<std::unique_ptr<task_queue> > queues;
+        std::mutex sleep_mutex;
         std::condition_variable condition;
         std::atomic_bool stop;
+        std::atomic<std::size_t> pending;
     };
 
 }
@@ -0,0 +1,50 @@
+#ifndef WINDOW_H
+#define WINDOW_H
+
+#include <cstddef>
+#include <algorithm>
+
+namespace tnn {
+    // One axis of a sliding window over an input padded on both sides, without the padding ever being stored.
+    // The windows of outputs [first, last) lie within the input; those of the few outputs around them are clipped
+    // to [begin(o), end(o)), and kernels treat what they leave out as zeros.
+    struct window_axis {
+        window_axis(std::size_t input, std::size_t kernel, std::size_t stride, std::size_t padding)
+                : input(input), kernel(kernel), stride(stride), padding(padding),
+                  output((input + 2 * padding - kernel) / stride + 1) {
+            first = std::min(output, (padding + stride - 1) / stride);
+            last = input + padding >= kernel ? std::min(output, (input + padding - kernel) / stride + 1) : 0;
+            last = std::max(first, last);
+        }
+        // Input element under the first element of the window of output o, negative within the padding.
+        std::ptrdiff_t start(std::size_t o) const {
+            return static_cast<std::ptrdiff_t>(o * stride) - static_cast<std::ptrdiff_t>(padding);
+        }
+        bool interior(std::size_t o) const {
+            return o >= first && o < last;
+        }
+        bool clipped(std::size_t o) const {
+            return begin(o) != 0 || end(o) != kernel;
+        }
+        // Elements of the window of output o that lie within the input.
+        std::size_t begin(std::size_t o) const {
+            std::ptrdiff_t s = start(o);
+            return s < 0 ? std::min<std::size_t>(static_cast<std::size_t>(-s), kernel) : 0;
+        }
+        std::size_t end(std::size_t o) const {
+            std::ptrdiff_t remaining = static_cast<std::ptrdiff_t>(input) - start(o);
+            return std::max(begin(o), std::min(kernel, static_cast<std::size_t>(std::max<std::ptrdiff_t>(remaining, 0))));
+        }
+        // Outputs [from(e), to(e)) are those whose windows have element e within the input.
+        std::size_t from(std::size_t e) const {
+            return e >= padding ? 0 : std::min(output, (padding - e + stride - 1) / stride);
+        }
+        std::size_t to(std::size_t e) const {
+            std::size_t to = input + padding > e ? std::min(output, (input + padding - e - 1) / stride + 1) : 0;
+            return std::max(from(e), to);
+        }
+        std::size_t input, kernel, stride, padding, output, first, last;
+    };
+}
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef WINOGRAD_H
+#define WINOGRAD_H
+
+#include <vector>
+
+#include "aligned_allocator.h"
+
+namespace tnn {
+    namespace winograd {
+        // F(4x4, 3x3): a 6x6 input tile and a 3x3 filter give a 4x4 output tile with 36 instead of 144
+        // multiplications. Transformed tiles are stored element-major, element e of item i at out[e * stride + i].
+        const std::size_t input_tile = 6, output_tile = 4, kernel = 3, elements = input_tile * input_tile;
+        // Most tiles a layer transforms and multiplies at once. The products read all the weights once per block.
+        const std::size_t max_block = 64;
+
+        // u = G g G^T
+        template<typename U>
+        void transform_weight(const U *g, U *u, std::size_t stride) {
+            U t[input_tile][kernel];
+            for (std::size_t j = 0; j < kernel; ++j) {
+                U g0 = g[j], g1 = g[kernel + j], g2 = g[2 * kernel + j];
+                t[0][j] = g0 / 4;
+                t[1][j] = -(g0 + g1 + g2) / 6;
+                t[2][j] = -(g0 - g1 + g2) / 6;
+                t[3][j] = g0 / 24 + g1 / 12 + g2 / 6;
+                t[4][j] = g0 / 24 - g1 / 12 + g2 / 6;
+                t[5][j] = g2;
+            }
+            for (std::size_t i = 0; i < input_tile; ++i, u += input_tile * stride) {
+                U g0 = t[i][0], g1 = t[i][1], g2 = t[i][2];
+                u[0 * stride] = g0 / 4;
+                u[1 * stride] = -(g0 + g1 + g2) / 6;
+                u[2 * stride] = -(g0 - g1 + g2) / 6;
+                u[3 * stride] = g0 / 24 + g1 / 12 + g2 / 6;
+                u[4 * stride] = g0 / 24 - g1 / 12 + g2 / 6;
+                u[5 * stride] = g2;
+            }
+        }
+
+        // v = B^T d B for `count` tiles at once, element e of tile x at d[e * count + x] and v[e * stride + x],
+        // through the scratch `t` of elements * count. Tiles are the innermost loop, so that it vectorizes.
+        template<typename U>
+        void transform_input(const U *d, U *t, std::size_t count, U *v, std::size_t stride) {
+            for (std::size_t j = 0; j < input_tile; ++j) {
+                const U *d0 = d + j * count, *d1 = d0 + input_tile * count, *d2 = d1 + input_tile * count,
+                        *d3 = d2 + input_tile * count, *d4 = d3 + input_tile * count, *d5 = d4 + input_tile * count;
+                U *t0 = t + j * count, *t1 = t0 + input_tile * count, *t2 = t1 + input_tile * count,
+                  *t3 = t2 + input_tile * count, *t4 = t3 + input_tile * count, *t5 = t4 + input_tile * count;
+                for (std::size_t x = 0; x < count; ++x) {
+                    t0[x] = 4 * d0[x] - 5 * d2[x] + d4[x];
+                    t1[x] = -4 * (d1[x] + d2[x]) + d3[x] + d4[x];
+                    t2[x] = 4 * (d1[x] - d2[x]) - d3[x] + d4[x];
+                    t3[x] = 2 * (d3[x] - d1[x]) - d2[x] + d4[x];
+                    t4[x] = 2 * (d1[x] - d3[x]) - d2[x] + d4[x];
+                    t5[x] = 4 * d1[x] - 5 * d3[x] + d5[x];
+                }
+            }
+            for (std::size_t i = 0; i < input_tile; ++i, v += input_tile * stride) {
+                const U *d0 = t + i * input_tile * count, *d1 = d0 + count, *d2 = d1 + count, *d3 = d2 + count,
+                        *d4 = d3 + count, *d5 = d4 + count;
+                for (std::size_t x = 0; x < count; ++x) {
+                    v[0 * stride + x] = 4 * d0[x] - 5 * d2[x] + d4[x];
+                    v[1 * stride + x] = -4 * (d1[x] + d2[x]) + d3[x] + d4[x];
+                    v[2 * stride + x] = 4 * (d1[x] - d2[x]) - d3[x] + d4[x];
+                    v[3 * stride + x] = 2 * (d3[x] - d1[x]) - d2[x] + d4[x];
+                    v[4 * stride + x] = 2 * (d1[x] - d3[x]) - d2[x] + d4[x];
+                    v[5 * stride + x] = 4 * d1[x] - 5 * d3[x] + d5[x];
+                }
+            }
+        }
+
+        // y = A^T m A for `count` tiles at once, element (r, c) of tile x at y[(r * output_tile + c) * count + x].
+        template<typename U>
+        void transform_output(const U *m, std::size_t stride, U *t, std::size_t count, U *y) {
+            for (std::size_t j = 0; j < input_tile; ++j) {
+                const U *m0 = m + j * stride, *m1 = m0 + input_tile * stride, *m2 = m1 + input_tile * stride,
+                        *m3 = m2 + input_tile * stride, *m4 = m3 + input_tile * stride, *m5 = m4 + input_tile * stride;
+                U *t0 = t + j * count, *t1 = t0 + input_tile * count, *t2 = t1 + input_tile * count,
+                  *t3 = t2 + input_tile * count;
+                for (std::size_t x = 0; x < count; ++x) {
+                    t0[x] = m0[x] + m1[x] + m2[x] + m3[x] + m4[x];
+                    t1[x] = m1[x] - m2[x] + 2 * (m3[x] - m4[x]);
+                    t2[x] = m1[x] + m2[x] + 4 * (m3[x] + m4[x]);
+                    t3[x] = m1[x] - m2[x] + 8 * (m3[x] - m4[x]) + m5[x];
+                }
+            }
+            for (std::size_t i = 0; i < output_tile; ++i, y += output_tile * count) {
+                const U *m0 = t + i * input_tile * count, *m1 = m0 + count, *m2 = m1 + count, *m3 = m2 + count,
+                        *m4 = m3 + count, *m5 = m4 + count;
+                for (std::size_t x = 0; x < count; ++x) {
+                    y[0 * count + x] = m0[x] + m1[x] + m2[x] + m3[x] + m4[x];
+                    y[1 * count + x] = m1[x] - m2[x] + 2 * (m3[x] - m4[x]);
+                    y[2 * count + x] = m1[x] + m2[x] + 4 * (m3[x] + m4[x]);
+                    y[3 * count + x] = m1[x] - m2[x] + 8 * (m3[x] - m4[x]) + m5[x];
+                }
+            }
+        }
+
+        template<typename U>
+        aligned_vector<U> &thread_buffer(std::size_t i) {
+            static thread_local aligned_vector<U> buffers[4];
+            return buffers[i];
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef WORKSPACE_H
+#define WORKSPACE_H
+
+#include <vector>
+#include <memory>
+
+#include "tensor/tensor.h"
+
+namespace tnn {
+
+    // Arena of activation buffers. acquire() hands out a tensor backed by a free buffer; the buffer is free
+    // again as soon as no tensor refers to it, so the liveness of every buffer is that of the tensors using it.
+    //
+    // Running layer::plan() for an input shape replays the acquire/release sequence of a forward pass without
+    // computing anything, which sizes the buffers for the peak footprint of that shape. Forward passes with the
+    // same or smaller shapes then only ping-pong between these buffers and never allocate.
+    template <typename U = float, typename Allocator = aligned_allocator<U> >
+    class workspace {
+    public:
+        typedef tensor<U, Allocator> tensor_type;
+        typedef typename tensor_type::storage storage;
+        typedef typename tensor_type::storage_pointer storage_pointer;
+        workspace() : m_allocations(0) {}
+        workspace(const workspace &) = delete;
+        workspace &operator = (const workspace &) = delete;
+        tensor_type acquire(std::initializer_list<std::size_t> shape) {
+            return acquire(shape.begin(), shape.end());
+        }
+        tensor_type acquire(const std::vector<std::size_t> &shape) {
+            return acquire(shape.begin(), shape.end());
+        }
+        // Best fit among the free buffers. If none is large enough, the largest free buffer grows; if there is
+        // no free buffer, a new one is added.
+        template<class InputIt>
+        tensor_type acquire(InputIt first, InputIt last) {
+            std::size_t size = 1;
+            for (InputIt it = first; it != last; ++it)
+                size *= *it;
+            storage_pointer *best = nullptr, *largest = nullptr;
+            for (std::size_t i = 0; i < m_buffers.size(); ++i) {
+                if (m_buffers[i].use_count() != 1)
+                    continue;
+                std::size_t capacity = m_buffers[i]->size();
+                if (capacity >= size && (!best || capacity < (*best)->size()))
+                    best = &m_buffers[i];
+                if (!largest || capacity > (*largest)->size())
+                    largest = &m_buffers[i];
+            }
+            if (!best) {
+                if (!largest) {
+                    m_buffers.push_back(std::make_shared<storage>());
+                    largest = &m_buffers.back();
+                }
+                (*largest)->resize(size);
+                ++m_allocations;
+                best = largest;
+            }
+            return tensor_type(*best, first, last);
+        }
+        // Bytes held by all buffers, i.e. the peak activation footprint planned so far.
+        std::size_t size() const {
+            std::size_t bytes = 0;
+            for (std::size_t i = 0; i < m_buffers.size(); ++i)
+                bytes += m_buffers[i]->size() * sizeof(U);
+            return bytes;
+        }
+        std::size_t buffers() const {
+            return m_buffers.size();
+        }
+        // Number of times a buffer had to be allocated or grown.
+        std::size_t allocations() const {
+            return m_allocations;
+        }
+    private:
+        std::vector<storage_pointer> m_buffers;
+        std::size_t m_allocations;
+    };
+
+}
+
+#endif
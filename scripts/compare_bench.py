@@ -0,0 +1,26 @@
+import sys
+import json
+
+# Compares the median times of two runs of `bench -j`, e.g. of two releases, and lists the layers that got slower
+# by more than the threshold (default 5%). Exits with 1 if there are any.
+baseline_name = sys.argv[1] if len(sys.argv) >= 2 else 'bench-baseline.json'
+current_name = sys.argv[2] if len(sys.argv) >= 3 else 'bench.json'
+threshold = float(sys.argv[3]) if len(sys.argv) >= 4 else 0.05
+
+def read_results(filename):
+	with open(filename) as f:
+		results = json.load(f)['results']
+	return dict(((r['layer'], r['mode'], r['threads'], r['batch']), r) for r in results)
+
+baseline = read_results(baseline_name)
+current = read_results(current_name)
+regressions = 0
+print('layer\tmode\tthreads\tbatch\tbaseline\tcurrent\tspeedup')
+for key in sorted(set(baseline) & set(current)):
+	speedup = baseline[key]['median'] / current[key]['median'] if current[key]['median'] else float('inf')
+	slower = speedup < 1 / (1 + threshold)
+	regressions += slower
+	print('%s\t%s\t%d\t%d\t%.3fms\t%.3fms\t%.2fx%s' % (key + (baseline[key]['median'] * 1e3, current[key]['median'] * 1e3,
+	                                                        speedup, '\tslower' if slower else '')))
+print('%d of %d results slower by more than %.0f%%' % (regressions, len(set(baseline) & set(current)), threshold * 100))
+sys.exit(1 if regressions else 0)
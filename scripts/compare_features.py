@@ -0,0 +1,17 @@
+import sys
+import numpy as np
+from closest_accuracy import read_labels, closest_accuracy
+
+# Compares features extracted in INT8 with the float ones of the same images.
+filelists = sys.argv[1] if len(sys.argv) >= 2 else 'filelists.txt'
+reference_name = sys.argv[2] if len(sys.argv) >= 3 else 'features-raw.dat'
+labels = read_labels(filelists)
+reference = np.fromfile(reference_name, dtype=np.float32).reshape(labels.shape[0], -1)
+
+print('features\tcosine mean\tcosine min\tclosest accuracy')
+print('%s\t%f\t%f\t%f' % (reference_name, 1, 1, closest_accuracy(reference, labels)))
+for features_name in sys.argv[3:]:
+	features = np.fromfile(features_name, dtype=np.float32).reshape(labels.shape[0], -1)
+	norms = np.linalg.norm(reference, axis=1) * np.linalg.norm(features, axis=1)
+	cosine = np.sum(reference * features, axis=1) / np.maximum(norms, np.finfo(np.float32).tiny)
+	print('%s\t%f\t%f\t%f' % (features_name, cosine.mean(), cosine.min(), closest_accuracy(features, labels)))
@@ -1,10 +1,29 @@
 import sys
 import torch.utils.model_zoo as model_zoo
+from tnn_model import write_model
 state_dict = model_zoo.load_url('https://download.pytorch.org/models/alexnet-owt-4df8aa71.pth')
-# Remove final classification layer
-del state_dict['classifier.6.weight']
-del state_dict['classifier.6.bias']
 filename = sys.argv[1] if len(sys.argv) >= 2 else 'alexnet.dat'
-with open(filename, 'wb') as f:
-	for t in state_dict.values():
-		t.data.view(-1).numpy().tofile(f)
+
+
+def conv(name, in_channels, out_channels, kernel_size, stride, padding):
+	return ('conv2d', [in_channels, out_channels, kernel_size, stride, padding, 1],
+			[state_dict[name + '.weight'].numpy(), state_dict[name + '.bias'].numpy()])
+
+
+def linear(name, in_features, out_features):
+	return ('linear', [in_features, out_features, 1],
+			[state_dict[name + '.weight'].numpy(), state_dict[name + '.bias'].numpy()])
+
+
+relu = ('relu', [], [])
+# The final classification layer is left out.
+write_model(filename, [3, 224, 224], [
+	conv('features.0', 3, 64, 11, 4, 2), relu, ('maxpool2d', [3, 2, 0], []),
+	conv('features.3', 64, 192, 5, 1, 2), relu, ('maxpool2d', [3, 2, 0], []),
+	conv('features.6', 192, 384, 3, 1, 1), relu,
+	conv('features.8', 384, 256, 3, 1, 1), relu,
+	conv('features.10', 256, 256, 3, 1, 1), relu, ('maxpool2d', [3, 2, 0], []),
+	('reshape', [256 * 6 * 6], []),
+	linear('classifier.1', 256 * 6 * 6, 4096), relu,
+	linear('classifier.4', 4096, 4096), relu
+])
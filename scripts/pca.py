@@ -1,6 +1,7 @@
 import sys
 import numpy as np
 from sklearn.decomposition import PCA
+from tnn_model import write_model
 
 n_components = int(sys.argv[1])
 features_name = sys.argv[2] if len(sys.argv) >= 3 else 'features-raw.dat'
@@ -12,6 +13,7 @@ ipca = PCA(n_components=n_components)
 ipca.fit(features)
 if (output_name):
 	ipca.transform(features).astype(np.float32).tofile(output_name)
-with open(pca_name, 'wb') as f:
-	(-ipca.mean_).astype(np.float32).tofile(f)
-	ipca.components_.astype(np.float32).tofile(f)
+write_model(pca_name, [4096], [
+	('bias', [4096], [-ipca.mean_]),
+	('linear', [4096, n_components, 0], [ipca.components_])
+])
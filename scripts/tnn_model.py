@@ -0,0 +1,38 @@
+import struct
+import numpy as np
+
+MAGIC = b'TNNMODEL'
+VERSION = 1
+ALIGNMENT = 64
+FLOAT32 = 0
+
+
+def align(offset):
+	return (offset + ALIGNMENT - 1) // ALIGNMENT * ALIGNMENT
+
+
+def write_model(filename, input_shape, layers):
+	"""Writes a model file as read by include/model.h.
+
+	input_shape is the shape of one sample without the batch dimension, and layers is a list of
+	(type, params, tensors) in forward order, where tensors are arrays in the order the layer loads them.
+	"""
+	tensors = []
+	header = MAGIC + struct.pack('<4I', VERSION, len(layers), sum(len(l[2]) for l in layers), len(input_shape))
+	header += struct.pack('<%dQ' % len(input_shape), *input_shape)
+	for layer_type, params, arrays in layers:
+		indices = list(range(len(tensors), len(tensors) + len(arrays)))
+		tensors += [np.ascontiguousarray(a, dtype=np.float32) for a in arrays]
+		header += struct.pack('<16sI', layer_type.encode(), len(params)) + struct.pack('<%dq' % len(params), *params)
+		header += struct.pack('<I', len(indices)) + struct.pack('<%dI' % len(indices), *indices)
+	offset = align(len(header) + sum(16 + 8 * t.ndim for t in tensors))
+	offsets = []
+	for t in tensors:
+		header += struct.pack('<IIQ', FLOAT32, t.ndim, offset) + struct.pack('<%dQ' % t.ndim, *t.shape)
+		offsets.append(offset)
+		offset = align(offset + t.nbytes)
+	with open(filename, 'wb') as f:
+		f.write(header)
+		for t, o in zip(tensors, offsets):
+			f.write(b'\0' * (o - f.tell()))
+			t.tofile(f)